@@ -10,8 +10,13 @@
 
 #if 	(defined(__clang__) || defined (__GNUC__))
 #define ATTRIBUTE_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#define ATTRIBUTE_NOINLINE __attribute__((noinline))
+/* thread_local in static TLS: no lazy allocation, so signal safe */
+#define ATTRIBUTE_INITIAL_EXEC __attribute__((tls_model("initial-exec")))
 #else
 #define ATTRIBUTE_NO_SANITIZE_ADDRESS
+#define ATTRIBUTE_NOINLINE
+#define ATTRIBUTE_INITIAL_EXEC
 #endif
 
 #include <vector>
@@ -4,7 +4,7 @@
 #include "guest.h"
 
 I386WindowsABI::I386WindowsABI(Guest& g_)
-: RegStrABI(g_, nullptr, "EAX", "EAX", true)
+: RegStrABI<uint32_t>(g_, nullptr, "EAX", "EAX")
 , edx_off(g_.getCPUState()->name2Off("EDX"))
 {
 	use_linux_sysenter = false;
@@ -14,7 +14,8 @@ SyscallParams I386WindowsABI::getSyscallParams(void) const
 {
 	auto	dat = (const uint8_t*)g.getCPUState()->getStateData();
 	uint32_t edx_v = *((const uint32_t*)(dat + edx_off));
-#define GET_ARGN(x,n)	g.getMem()->readNative(guest_ptr(edx_v), n)
+	GuestView<uint32_t> v(*g.getMem());
+#define GET_ARGN(x,n)	v.readNative(guest_ptr(edx_v), n)
 	return SyscallParams(
 		getSyscallResult(), /* sysnr */
 		GET_ARGN(x86,0),
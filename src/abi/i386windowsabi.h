@@ -3,7 +3,7 @@
 
 #include "guestabi.h"
 
-class I386WindowsABI : public RegStrABI
+class I386WindowsABI : public RegStrABI<uint32_t>
 {
 public:
 	I386WindowsABI(Guest& g_);
@@ -0,0 +1,125 @@
+#include <sys/mman.h>
+
+#include "codetracker.h"
+#include "guestmem.h"
+
+CodeTracker::CodeTracker(GuestMem& _mem)
+: mem(_mem)
+, clock(0)
+, watched_c(0)
+{
+	FaultDispatch::add(this);
+}
+
+CodeTracker::~CodeTracker(void)
+{
+	FaultDispatch::remove(this);
+	unwatch(guest_ptr(0), guest_ptr(tab_t::MAX_PAGES << tab_t::PG_BITS));
+}
+
+template <typename F>
+void CodeTracker::eachPage(guest_ptr b, guest_ptr e, bool alloc, F f)
+{
+	tab.each(tab_t::pageOf(b), tab_t::pageEnd(e), alloc,
+		[&f] (uintptr_t pg, word_t& w) {
+			f(guest_ptr(pg << tab_t::PG_BITS), w); });
+}
+
+void CodeTracker::restore(guest_ptr pg, int prot) const
+{ hostProtect(mem.getHostPtr(pg), prot); }
+
+uint64_t CodeTracker::watch(guest_ptr p, int prot)
+{
+	word_t		*w = find(p);
+	uint64_t	v;
+	void		*host;
+
+	if (w == NULL || (v = w->load()) == 0)
+		return 0;
+	if ((v & PROT_MASK) != 0 || !(prot & PROT_WRITE))
+		return v >> PROT_BITS;
+
+	host = mem.getHostPtr(guest_ptr(p.o & ~(tab_t::PAGE_BYTES - 1)));
+
+	/* marked first; a write faults the moment it's protected */
+	watched_c++;
+	w->store(v | (prot & PROT_MASK));
+	if (hostWriteProtect(host, prot) != 0) {
+		w->store(v);
+		watched_c--;
+	}
+
+	return v >> PROT_BITS;
+}
+
+void CodeTracker::unwatch(guest_ptr b, guest_ptr e)
+{
+	eachPage(b, e, false, [this] (guest_ptr pg, word_t& w) {
+		uint64_t	v = w.load();
+
+		/* a write may stamp it first */
+		while (	(v & PROT_MASK) != 0 &&
+			!w.compare_exchange_weak(v, v & ~PROT_MASK));
+		if ((v & PROT_MASK) == 0)
+			return;
+		watched_c--;
+		restore(pg, v & PROT_MASK);
+	});
+}
+
+void CodeTracker::noteCode(guest_ptr b, guest_ptr e)
+{
+	uint64_t	g = (++clock) << PROT_BITS;
+
+	/* the host protection is as it was; so is any watch */
+	eachPage(b, e, true, [g] (guest_ptr, word_t& w) {
+		w.store(g | (w.load() & PROT_MASK)); });
+	if (hook)
+		hook(b, e - b);
+}
+
+void CodeTracker::noteChanged(guest_ptr b, guest_ptr e)
+{
+	uint64_t	g = (++clock) << PROT_BITS;
+	bool		moved = false;
+
+	eachPage(b, e, false, [this, g, &moved] (guest_ptr, word_t& w) {
+		if (w.load() == 0)
+			return;
+		if (w.exchange(g) & PROT_MASK)
+			watched_c--;
+		moved = true;
+	});
+	if (moved && hook)
+		hook(b, e - b);
+}
+
+bool CodeTracker::handleFault(void* addr, void* uctx)
+{
+	uintptr_t	a = (uintptr_t)addr;
+	uintptr_t	base = (uintptr_t)mem.getBase();
+	guest_ptr	pg;
+	word_t		*w;
+	uint64_t	v;
+	int		prot;
+	bool		stamped;
+
+	if (a < base)
+		return false;
+	pg = guest_ptr((a - base) & ~(tab_t::PAGE_BYTES - 1));
+	if ((w = find(pg)) == NULL)
+		return false;
+
+	v = w->load();
+	if ((prot = v & PROT_MASK) == 0)
+		return false;
+
+	/* racing threads all open the page; only one stamps it */
+	stamped = w->compare_exchange_strong(v, (++clock) << PROT_BITS);
+	if (stamped)
+		watched_c--;
+	restore(pg, prot);
+	if (stamped && hook)
+		hook(pg, tab_t::PAGE_BYTES);
+	return true;
+}
@@ -0,0 +1,93 @@
+/* generations of guest code pages, for caches of decoded blocks */
+#ifndef CODETRACKER_H
+#define CODETRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+
+#include "faultdispatch.h"
+#include "pagetable.h"
+
+class GuestMem;
+
+/* [p, p+len) moved on to a new generation */
+typedef std::function<void(guest_ptr p, size_t len)> code_hook_t;
+
+/* Every page that has been code carries a stamp from a clock that only
+ * goes up, so a page never gets an old stamp back. Stamps live in a
+ * PageTable. A watched page is also write-protected on the host; its
+ * word keeps the protection to put back, and the first write faults,
+ * stamps the page, and runs the hook.
+ *
+ * Lookups are safe from other threads. The hook runs in signal context
+ * for caught writes, so it mustn't allocate or lock. Watched pages are
+ * plain mprotect()s, so GuestMem keeps mprotect dirty tracking and write
+ * watches off them, and the kernel's own writes to one (e.g., read(2))
+ * get EFAULT */
+class CodeTracker : public FaultHandler
+{
+public:
+	CodeTracker(GuestMem& _mem);
+	virtual ~CodeTracker(void);
+
+	/* 0 if p's page was never code */
+	uint64_t getGen(guest_ptr p) const
+	{
+		const word_t	*w = find(p);
+		return (w != NULL) ? w->load() >> PROT_BITS : 0;
+	}
+
+	/* p's page is write-protected until its next write */
+	bool isWatched(guest_ptr p) const
+	{
+		const word_t	*w = find(p);
+		return w != NULL && (w->load() & PROT_MASK) != 0;
+	}
+
+	/* p's generation; a code page with 'prot' writable is watched */
+	uint64_t watch(guest_ptr p, int prot);
+	/* put back the protection of watched pages in [b, e) */
+	void unwatch(guest_ptr b, guest_ptr e);
+	/* pages write-protected for a watch */
+	size_t getNumWatched(void) const { return watched_c.load(); }
+
+	void setHook(code_hook_t h) { hook = h; }
+
+	/* every page of [b, e) is code now, and moves on */
+	void noteCode(guest_ptr b, guest_ptr e);
+	/* the host protection of [b, e) was replaced; code pages move on */
+	void noteChanged(guest_ptr b, guest_ptr e);
+
+	bool handleFault(void* addr, void* uctx) override;
+
+private:
+	CodeTracker(const CodeTracker&) = delete;
+	CodeTracker& operator=(const CodeTracker&) = delete;
+
+	/* low bits of a word: protection to restore, 0 if not watched */
+	static const unsigned PROT_BITS = 3;
+	static const uint64_t PROT_MASK = (1 << PROT_BITS) - 1;
+
+	typedef std::atomic<uint64_t>	word_t;
+	typedef PageTable<word_t>	tab_t;
+
+	const word_t* find(guest_ptr p) const
+	{ return tab.find(tab_t::pageOf(p)); }
+	word_t* find(guest_ptr p) { return tab.find(tab_t::pageOf(p)); }
+
+	/* f(page, word) for pages of [b, e) with a leaf; 'alloc' makes
+	   missing leaves */
+	template <typename F>
+	void eachPage(guest_ptr b, guest_ptr e, bool alloc, F f);
+	void restore(guest_ptr pg, int prot) const;
+
+	GuestMem		&mem;
+	tab_t			tab;
+	std::atomic<uint64_t>	clock;
+	std::atomic<size_t>	watched_c;
+	code_hook_t		hook;
+};
+
+#endif
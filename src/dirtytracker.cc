@@ -0,0 +1,350 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "dirtytracker.h"
+#include "faultdispatch.h"
+
+#define PAGE_SIZE	4096
+#define PM_SOFT_DIRTY	(1ULL << 55)
+/* pagemap entries per read */
+#define PM_BATCH	512
+
+static void appendRun(
+	std::vector<GuestMem::pagerun_t>& v, guest_ptr p, size_t len)
+{
+	if (!v.empty() && v.back().first + v.back().second == p)
+		v.back().second += len;
+	else
+		v.push_back(GuestMem::pagerun_t(p, len));
+}
+
+static void mergeRuns(std::vector<GuestMem::pagerun_t>& v)
+{
+	std::vector<GuestMem::pagerun_t>	out;
+
+	std::sort(v.begin(), v.end());
+	for (const auto &r : v) {
+		if (!out.empty() && out.back().first + out.back().second >= r.first) {
+			guest_ptr e(std::max<uintptr_t>(
+				out.back().first + out.back().second,
+				r.first + r.second));
+			out.back().second = e - out.back().first;
+		} else
+			out.push_back(r);
+	}
+	v.swap(out);
+}
+
+void DirtyTracker::clipToMappings(std::vector<GuestMem::pagerun_t>& runs) const
+{
+	std::vector<GuestMem::pagerun_t>	out;
+	auto					r(runs.begin());
+
+	for (const auto &m : mem.getMappings()) {
+		for (; r != runs.end() && r->first + r->second <= m.offset; ++r);
+
+		for (auto r2 = r; r2 != runs.end() && r2->first < m.end(); ++r2) {
+			guest_ptr	b(std::max<uintptr_t>(r2->first, m.offset));
+			guest_ptr	e(std::min<uintptr_t>(
+				r2->first + r2->second, m.end()));
+			appendRun(out, b, e - b);
+		}
+	}
+
+	runs.swap(out);
+}
+
+/* the kernel's soft-dirty bits; only one user per process since clearing
+   them is process-wide */
+class SoftDirtyTracker : public DirtyTracker
+{
+public:
+	static SoftDirtyTracker* create(GuestMem& mem);
+	virtual ~SoftDirtyTracker(void);
+	void checkpoint(void) override;
+	void getDirty(std::vector<GuestMem::pagerun_t>& out) const override;
+	const char* getName(void) const override { return "soft-dirty"; }
+private:
+	SoftDirtyTracker(GuestMem& mem, int _pm_fd, int _clear_fd)
+	: DirtyTracker(mem), pm_fd(_pm_fd), clear_fd(_clear_fd) {}
+	static bool probe(int pm_fd, int clear_fd);
+
+	int				pm_fd, clear_fd;
+	static SoftDirtyTracker		*owner;
+};
+
+SoftDirtyTracker* SoftDirtyTracker::owner = NULL;
+
+/* kernels without CONFIG_MEM_SOFT_DIRTY take the clear but never
+   set the bit, so check one actually shows up */
+bool SoftDirtyTracker::probe(int pm_fd, int clear_fd)
+{
+	volatile char	*p;
+	uint64_t	ent = 0;
+	ssize_t		sz;
+
+	p = (volatile char*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	p[0] = 1;
+	if (write(clear_fd, "4", 1) == 1) {
+		p[0] = 2;
+		sz = pread(pm_fd, &ent, sizeof(ent),
+			((uintptr_t)p / PAGE_SIZE) * sizeof(ent));
+		if (sz != sizeof(ent))
+			ent = 0;
+	}
+
+	munmap((void*)p, PAGE_SIZE);
+	return (ent & PM_SOFT_DIRTY) != 0;
+}
+
+SoftDirtyTracker* SoftDirtyTracker::create(GuestMem& mem)
+{
+	int	pm_fd, clear_fd;
+
+	if (owner != NULL || getenv("GUEST_NO_SOFTDIRTY") != NULL)
+		return NULL;
+
+	pm_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	clear_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (pm_fd < 0 || clear_fd < 0 || !probe(pm_fd, clear_fd)) {
+		if (pm_fd >= 0) close(pm_fd);
+		if (clear_fd >= 0) close(clear_fd);
+		return NULL;
+	}
+
+	owner = new SoftDirtyTracker(mem, pm_fd, clear_fd);
+	return owner;
+}
+
+SoftDirtyTracker::~SoftDirtyTracker(void)
+{
+	close(pm_fd);
+	close(clear_fd);
+	owner = NULL;
+}
+
+void SoftDirtyTracker::checkpoint(void)
+{
+	ssize_t	sz = write(clear_fd, "4", 1);
+	assert (sz == 1 && "could not clear soft-dirty bits");
+}
+
+void SoftDirtyTracker::getDirty(std::vector<GuestMem::pagerun_t>& out) const
+{
+	uint64_t	ents[PM_BATCH];
+
+	out.clear();
+	for (const auto &m : mem.getMappings()) {
+		uintptr_t	vpn, pages;
+
+		vpn = (uintptr_t)mem.getHostPtr(m.offset) / PAGE_SIZE;
+		pages = m.length / PAGE_SIZE;
+		for (uintptr_t i = 0; i < pages; i += PM_BATCH) {
+			unsigned	n = std::min<uintptr_t>(PM_BATCH, pages - i);
+			ssize_t		sz;
+
+			sz = pread(pm_fd, ents, n*sizeof(ents[0]),
+				(vpn + i)*sizeof(ents[0]));
+			assert (sz == (ssize_t)(n*sizeof(ents[0])));
+
+			for (unsigned j = 0; j < n; j++) {
+				if (!(ents[j] & PM_SOFT_DIRTY))
+					continue;
+				appendRun(out, m.offset + (i+j)*PAGE_SIZE,
+					PAGE_SIZE);
+			}
+		}
+	}
+}
+
+/* write-protect everything writable at checkpoint; the first write to
+ * each page faults, gets logged, and the page is opened back up.
+ *
+ * The kernel won't raise SIGSEGV for its own accesses, so host syscalls
+ * that write into a clean guest page (e.g., read(2)) get EFAULT. */
+class ProtDirtyTracker : public DirtyTracker, public FaultHandler
+{
+public:
+	ProtDirtyTracker(GuestMem& mem) : DirtyTracker(mem)
+	{ FaultDispatch::add(this); }
+	virtual ~ProtDirtyTracker(void);
+	void checkpoint(void) override;
+	void getDirty(std::vector<GuestMem::pagerun_t>& out) const override;
+	void noteChanged(guest_ptr p, size_t len) override;
+	void release(guest_ptr p, size_t len) override;
+	const char* getName(void) const override { return "mprotect"; }
+	bool protectsPages(void) const override { return true; }
+	bool handleFault(void* addr, void* uctx) override;
+private:
+	/* a mapping as it was at checkpoint; bit set = page is writable */
+	struct Region
+	{
+		uintptr_t		host;
+		guest_ptr		offset;
+		size_t			pages;
+		int			prot;
+		std::vector<uint64_t>	bits;
+
+		bool test(size_t i) const { return bits[i/64] & (1ULL << (i%64)); }
+		void set(size_t i) { bits[i/64] |= 1ULL << (i%64); }
+	};
+
+	/* restore write access to pages [b, e) of r still protected */
+	static void unprotect(Region& r, size_t b, size_t e);
+
+	std::vector<Region>			regions;
+	/* changed since the checkpoint, counted as dirty wholesale */
+	std::vector<GuestMem::pagerun_t>	changed;
+};
+
+ProtDirtyTracker::~ProtDirtyTracker(void)
+{
+	FaultDispatch::remove(this);
+	for (auto &r : regions)
+		unprotect(r, 0, r.pages);
+}
+
+void ProtDirtyTracker::unprotect(Region& r, size_t b, size_t e)
+{
+	for (size_t i = b; i < e; ) {
+		size_t	j;
+
+		if (r.test(i)) { i++; continue; }
+		for (j = i; j < e && !r.test(j); j++)
+			r.set(j);
+		::mprotect((void*)(r.host + i*PAGE_SIZE),
+			(j - i)*PAGE_SIZE, r.prot);
+		i = j;
+	}
+}
+
+void ProtDirtyTracker::checkpoint(void)
+{
+	std::vector<Region>	new_regions;
+
+	for (const auto &m : mem.getMappings()) {
+		Region	r;
+
+		if (!(m.cur_prot & PROT_WRITE))
+			continue;
+
+		r.host = (uintptr_t)mem.getHostPtr(m.offset);
+		r.offset = m.offset;
+		r.pages = m.length / PAGE_SIZE;
+		r.prot = m.cur_prot;
+		r.bits.assign((r.pages + 63) / 64, 0);
+		new_regions.push_back(r);
+	}
+
+	/* old regions stay live until the new ones are protected */
+	for (const auto &r : new_regions) {
+		int err = ::mprotect((void*)r.host, r.pages*PAGE_SIZE,
+			r.prot & ~PROT_WRITE);
+		assert (err == 0 && "could not write-protect guest memory");
+	}
+
+	regions.swap(new_regions);
+	changed.clear();
+}
+
+bool ProtDirtyTracker::handleFault(void* addr, void* uctx)
+{
+	uintptr_t	a = (uintptr_t)addr;
+	size_t		i;
+
+	auto it = std::upper_bound(regions.begin(), regions.end(), a,
+		[] (uintptr_t a, const Region& r) { return a < r.host; });
+	if (it == regions.begin())
+		return false;
+	--it;
+
+	if (a >= it->host + it->pages*PAGE_SIZE)
+		return false;
+
+	/* already writable; it's a real fault */
+	i = (a - it->host) / PAGE_SIZE;
+	if (it->test(i))
+		return false;
+
+	it->set(i);
+	return ::mprotect(
+		(void*)(it->host + i*PAGE_SIZE), PAGE_SIZE, it->prot) == 0;
+}
+
+/* the guest's protection wins from here on; hands off those pages */
+void ProtDirtyTracker::noteChanged(guest_ptr p, size_t len)
+{
+	guest_ptr	e(p + len);
+
+	for (auto &r : regions) {
+		guest_ptr	re(r.offset + r.pages*PAGE_SIZE);
+		if (re <= p || r.offset >= e)
+			continue;
+
+		size_t b = (std::max<uintptr_t>(p, r.offset) - r.offset) / PAGE_SIZE;
+		size_t n = (std::min<uintptr_t>(e, re) - r.offset + PAGE_SIZE - 1)
+			/ PAGE_SIZE;
+		for (; b < n; b++)
+			r.set(b);
+	}
+
+	changed.push_back(GuestMem::pagerun_t(p, len));
+}
+
+/* the host won't move a mapping split by protections, and would carry
+   ours along if it did */
+void ProtDirtyTracker::release(guest_ptr p, size_t len)
+{
+	guest_ptr	e(p + len);
+
+	for (auto &r : regions) {
+		guest_ptr	re(r.offset + r.pages*PAGE_SIZE);
+		if (re <= p || r.offset >= e)
+			continue;
+
+		size_t b = (std::max<uintptr_t>(p, r.offset) - r.offset) / PAGE_SIZE;
+		size_t n = (std::min<uintptr_t>(e, re) - r.offset + PAGE_SIZE - 1)
+			/ PAGE_SIZE;
+		unprotect(r, b, n);
+	}
+
+	changed.push_back(GuestMem::pagerun_t(p, len));
+}
+
+void ProtDirtyTracker::getDirty(std::vector<GuestMem::pagerun_t>& out) const
+{
+	out = changed;
+	for (const auto &r : regions) {
+		for (size_t w = 0; w < r.bits.size(); w++) {
+			if (r.bits[w] == 0) continue;
+			for (size_t i = w*64; i < std::min(r.pages, w*64 + 64); i++)
+				if (r.test(i))
+					appendRun(out, r.offset + i*PAGE_SIZE,
+						PAGE_SIZE);
+		}
+	}
+
+	mergeRuns(out);
+	clipToMappings(out);
+}
+
+DirtyTracker* DirtyTracker::create(GuestMem& mem)
+{
+	DirtyTracker	*dt;
+
+	if (!mem.isHostBacked())
+		return NULL;
+
+	if ((dt = SoftDirtyTracker::create(mem)) != NULL)
+		return dt;
+
+	return new ProtDirtyTracker(mem);
+}
@@ -0,0 +1,36 @@
+/* finds guest pages written since a checkpoint */
+#ifndef DIRTYTRACKER_H
+#define DIRTYTRACKER_H
+
+#include <vector>
+#include "guestmem.h"
+
+class DirtyTracker
+{
+public:
+	/* soft-dirty bits if the kernel keeps them, otherwise write
+	 * protection and SIGSEGV. NULL if 'mem' isn't host-backed */
+	static DirtyTracker* create(GuestMem& mem);
+	virtual ~DirtyTracker(void) {}
+
+	/* everything counts as clean again */
+	virtual void checkpoint(void) = 0;
+	/* sorted, merged runs of pages written since the checkpoint */
+	virtual void getDirty(std::vector<GuestMem::pagerun_t>& out) const = 0;
+	/* mapping or protection changed underneath; treat as dirty */
+	virtual void noteChanged(guest_ptr p, size_t len) {}
+	/* [p, p+len) is about to be moved or resized; put back any
+	   protection of ours there and count it as dirty */
+	virtual void release(guest_ptr p, size_t len) { noteChanged(p, len); }
+	/* write-protects pages itself; no one else may then */
+	virtual bool protectsPages(void) const { return false; }
+	virtual const char* getName(void) const = 0;
+protected:
+	DirtyTracker(GuestMem& _mem) : mem(_mem) {}
+	/* drop anything that isn't mapped anymore */
+	void clipToMappings(std::vector<GuestMem::pagerun_t>& runs) const;
+
+	GuestMem	&mem;
+};
+
+#endif
@@ -13,17 +13,55 @@
 
 #include <stdio.h>
 
-Symbols* ElfDebug::getSymsAll(ElfDebug& ed, uintptr_t base)
+/* ELF types for a word size */
+template <typename W> struct ElfTypes;
+template <> struct ElfTypes<uint32_t>
 {
-	auto ret = new Symbols();
-	while (auto s = ed.nextSym()) {
+	typedef Elf32_Sym	Sym;
+	typedef Elf32_Rela	Rela;
+	static unsigned rSym(Elf32_Word info) { return ELF32_R_SYM(info); }
+};
+template <> struct ElfTypes<uint64_t>
+{
+	typedef Elf64_Sym	Sym;
+	typedef Elf64_Rela	Rela;
+	static unsigned rSym(Elf64_Xword info) { return ELF64_R_SYM(info); }
+};
+
+bool ElfDebug::is32Bit(void) const
+{
+	switch (elf_arch) {
+	case Arch::ARM:
+	case Arch::I386:
+		return true;
+	case Arch::X86_64:
+		return false;
+	default:
+		assert (0 ==1 && "elf no bueno");
+	}
+	return false;
+}
+
+template <typename W>
+void ElfDebug::addSyms(Symbols* syms, uintptr_t base)
+{
+	while (auto s = nextSym<W>()) {
 		symaddr_t	addr = s->getBaseAddr();
 		if (s->isCode() && s->getName().size() > 0 && addr) {
-			if (!ed.isExec())
+			if (!isExec())
 				addr += base;
-			ret->addSym(s->getName(), addr, s->getLength());
+			syms->addSym(s->getName(), addr, s->getLength());
 		}
 	}
+}
+
+Symbols* ElfDebug::getSymsAll(ElfDebug& ed, uintptr_t base)
+{
+	auto ret = new Symbols();
+	if (ed.is32Bit())
+		ed.addSyms<uint32_t>(ret, base);
+	else
+		ed.addSyms<uint64_t>(ret, base);
 	return ret;
 }
 
@@ -49,9 +87,10 @@ Symbols* ElfDebug::getLinkageSyms(
 	}
 
 	ret = new Symbols();
-	while (auto s = ed.nextLinkageSym(m)) {
-		ret->addSym(s->getName(), s->getBaseAddr(), s->getLength());
-	}
+	if (ed.is32Bit())
+		ed.addLinkageSyms<uint32_t>(ret, m);
+	else
+		ed.addLinkageSyms<uint64_t>(ret, m);
 	return ret;
 
 }
@@ -206,89 +245,66 @@ void ElfDebug::setupTables(void)
 		sym_count = 0;
 }
 
+template <typename W>
 std::unique_ptr<Symbol> ElfDebug::nextSym(void)
 {
-	switch (elf_arch) {
-	case Arch::ARM:
-	case Arch::I386:
-		return nextSym32();
-	case Arch::X86_64:
-		return nextSym64();
-	default:
-		assert (0 ==1 && "elf no bueno");
-	}
+	typedef typename ElfTypes<W>::Sym	Elf_Sym;
+	Elf_Sym		*sym = (Elf_Sym*)symtab;	/* FIXME */
+	Elf_Sym		*cur_sym;
+	const char	*name_c, *atat;
+	std::string	name;
 
-	return NULL;
-}
+	if (next_sym_idx >= sym_count)
+		return NULL;
 
-#define NEXTSYM_BITS(x)	\
-std::unique_ptr<Symbol> ElfDebug::nextSym##x(void)		\
-{	\
-	Elf##x##_Sym	*sym = (Elf##x##_Sym*)symtab;	/* FIXME */	\
-	Elf##x##_Sym	*cur_sym;	\
-	const char	*name_c, *atat;	\
-	std::string	name;		\
-\
-	if (next_sym_idx >= sym_count)	\
-		return NULL;		\
-\
-	cur_sym = &sym[next_sym_idx++];	\
-\
-	name_c = &strtab[cur_sym->st_name];	\
-	name = std::string(name_c);		\
-	atat = strstr(name_c, "@@");		\
-	if (atat) {				\
-		name = name.substr(0, atat - name_c);	\
-	}	\
-	return std::make_unique<Symbol>(	\
-		name,	\
-		cur_sym->st_value,	\
-		cur_sym->st_size,	\
-		is_reloc,	\
-		(ELF##x##_ST_TYPE(cur_sym->st_info) == STT_FUNC));	\
-}
+	cur_sym = &sym[next_sym_idx++];
 
-NEXTSYM_BITS(32)
-NEXTSYM_BITS(64)
-
-#define NEXTLINKSYM_BITS(x)	\
-std::unique_ptr<Symbol> ElfDebug::nextLinkageSym##x(const GuestMem* m)	\
-{	\
-	Elf##x##_Sym	*cur_sym;	\
-	guest_ptr	guest_sym;	\
-	Elf##x##_Sym	*sym = (Elf##x##_Sym*)dynsymtab;	\
-	Elf##x##_Rela	*rela;	\
-	const char	*name_c;	\
-\
-	if (!rela_tab || next_rela_idx >= rela_count)\
-		return NULL;\
-\
-	rela = &((Elf##x##_Rela*)rela_tab)[next_rela_idx++];\
-	cur_sym = &sym[ELF##x##_R_SYM(rela->r_info)];	\
-	name_c = &dynstrtab[cur_sym->st_name];	\
-	guest_sym = guest_ptr(rela->r_offset);	\
-\
-	return std::make_unique<Symbol>(	\
-		name_c,	\
-		m->read<uint64_t>(guest_sym)-6,	\
-		6,	\
-		false,	\
-		(ELF##x##_ST_TYPE(cur_sym->st_info) == STT_FUNC));	\
+	name_c = &strtab[cur_sym->st_name];
+	name = std::string(name_c);
+	atat = strstr(name_c, "@@");
+	if (atat) {
+		name = name.substr(0, atat - name_c);
+	}
+	return std::make_unique<Symbol>(
+		name,
+		cur_sym->st_value,
+		cur_sym->st_size,
+		is_reloc,
+		(ELF32_ST_TYPE(cur_sym->st_info) == STT_FUNC));
 }
 
-NEXTLINKSYM_BITS(32)
-NEXTLINKSYM_BITS(64)
-
+/* the GOT slot is a guest word, read at the image's width */
+template <typename W>
 std::unique_ptr<Symbol> ElfDebug::nextLinkageSym(const GuestMem* m)
 {
-	switch (elf_arch) {
-	case Arch::ARM:
-	case Arch::I386:
-		return nextLinkageSym32(m);
-	case Arch::X86_64:
-		return nextLinkageSym64(m);
-	default:
-		assert (0 ==1 && "elf no bueno");
-	}
-	return NULL;
+	typedef typename ElfTypes<W>::Sym	Elf_Sym;
+	typedef typename ElfTypes<W>::Rela	Elf_Rela;
+	GuestView<W, const GuestMem>	v(*m);
+	Elf_Sym		*cur_sym;
+	guest_ptr	guest_sym;
+	Elf_Sym		*sym = (Elf_Sym*)dynsymtab;
+	Elf_Rela	*rela;
+	const char	*name_c;
+
+	if (!rela_tab || next_rela_idx >= rela_count)
+		return NULL;
+
+	rela = &((Elf_Rela*)rela_tab)[next_rela_idx++];
+	cur_sym = &sym[ElfTypes<W>::rSym(rela->r_info)];
+	name_c = &dynstrtab[cur_sym->st_name];
+	guest_sym = guest_ptr(rela->r_offset);
+
+	return std::make_unique<Symbol>(
+		name_c,
+		v.readNative(guest_sym)-6,
+		6,
+		false,
+		(ELF32_ST_TYPE(cur_sym->st_info) == STT_FUNC));
+}
+
+template <typename W>
+void ElfDebug::addLinkageSyms(Symbols* syms, const GuestMem* m)
+{
+	while (auto s = nextLinkageSym<W>(m))
+		syms->addSym(s->getName(), s->getBaseAddr(), s->getLength());
 }
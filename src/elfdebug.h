@@ -28,14 +28,16 @@ private:
 		typename Elf_Sym>
 		void setupTables(void);
 
-	std::unique_ptr<Symbol>	nextSym(void);
-	std::unique_ptr<Symbol>	nextSym32(void);
-	std::unique_ptr<Symbol>	nextSym64(void);
-
+	/* W is the image's word size, picked once per table */
+	template <typename W> std::unique_ptr<Symbol> nextSym(void);
+	template <typename W>
 	std::unique_ptr<Symbol>	nextLinkageSym(const GuestMem* m);
-	std::unique_ptr<Symbol> nextLinkageSym32(const GuestMem* m);
-	std::unique_ptr<Symbol> nextLinkageSym64(const GuestMem* m);
+	template <typename W> void addSyms(Symbols* syms, uintptr_t base);
+	template <typename W>
+	void addLinkageSyms(Symbols* syms, const GuestMem* m);
+
 	bool isExec(void) const { return is_exec; }
+	bool is32Bit(void) const;
 
 	static Symbols* getSymsAll(ElfDebug& ed, uintptr_t base);
 
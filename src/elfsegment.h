@@ -14,7 +14,7 @@ public:
 	uintptr_t relocation() const { return es_hostbase - es_elfbase; }
 	guest_ptr offset(uintptr_t offset) { return es_hostbase + offset; }
 	guest_ptr base() const { return es_mmapbase; }
-	unsigned int length() const { return es_len; }
+	size_t length() const { return es_len; }
 	int protection() const { return prot; }
 	void clearEnd();
 	void takeMem(void) { mem = NULL; }
@@ -31,15 +31,15 @@ private:
 	guest_ptr	es_elfbase;
 	guest_ptr	es_hostbase;
 	guest_ptr	es_mmapbase;
-	unsigned int	es_len;
-	unsigned int	file_pages;
-	unsigned int	spill_pages;
+	size_t		es_len;
+	size_t		file_pages;
+	size_t		spill_pages;
 
 	size_t		elf_file_size;
 	guest_ptr	reloc;
 	int		prot;
 	guest_ptr	my_end;
-	unsigned int	extra_bytes;
+	size_t		extra_bytes;
 	GuestMem	*mem;
 };
 
@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <signal.h>
+#include <string.h>
+#include <atomic>
+
+#include "faultdispatch.h"
+
+#define MAX_FAULT_HANDLERS	16
+
+/* read by the signal handlers on any thread while add() and remove()
+   change them */
+static std::atomic<FaultHandler*>	handlers[MAX_FAULT_HANDLERS];
+static struct sigaction			old_segv, old_trap;
+static bool				installed = false;
+static bool				installed_trap = false;
+
+static void install(int sig,
+	void (*f)(int, siginfo_t*, void*), struct sigaction* old)
+{
+	struct sigaction	sa;
+	int			err;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = f;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	err = sigaction(sig, &sa, old);
+	assert (err == 0 && "could not install signal handler");
+}
+
+/* hand an unclaimed signal to whoever had it before; false if there
+   was no handler */
+static bool chain(struct sigaction* old, int sig, siginfo_t* si, void* uctx)
+{
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, si, uctx);
+		return true;
+	}
+
+	if (	old->sa_handler != SIG_DFL &&
+		old->sa_handler != SIG_IGN)
+	{
+		old->sa_handler(sig);
+		return true;
+	}
+
+	return false;
+}
+
+void FaultDispatch::add(FaultHandler* h, bool traps)
+{
+	unsigned	i;
+
+	for (i = 0; i < MAX_FAULT_HANDLERS; i++) {
+		FaultHandler	*empty = NULL;
+		if (handlers[i].compare_exchange_strong(empty, h))
+			break;
+	}
+	assert (i < MAX_FAULT_HANDLERS && "too many fault handlers");
+
+	if (!installed) {
+		install(SIGSEGV, onFault, &old_segv);
+		installed = true;
+	}
+
+	if (traps && !installed_trap) {
+		install(SIGTRAP, onTrap, &old_trap);
+		installed_trap = true;
+	}
+}
+
+/* the signal handler stays put; with no handlers it just passes through */
+void FaultDispatch::remove(FaultHandler* h)
+{
+	for (unsigned i = 0; i < MAX_FAULT_HANDLERS; i++)
+		if (handlers[i].load() == h)
+			handlers[i].store(NULL);
+}
+
+void FaultDispatch::onFault(int sig, siginfo_t* si, void* uctx)
+{
+	for (unsigned i = 0; i < MAX_FAULT_HANDLERS; i++) {
+		FaultHandler	*h = handlers[i].load(std::memory_order_acquire);
+		if (h != NULL && h->handleFault(si->si_addr, uctx))
+			return;
+	}
+
+	if (chain(&old_segv, sig, si, uctx))
+		return;
+
+	/* nobody wanted it; die on the retried access like we would have */
+	signal(SIGSEGV, SIG_DFL);
+}
+
+void FaultDispatch::onTrap(int sig, siginfo_t* si, void* uctx)
+{
+	for (unsigned i = 0; i < MAX_FAULT_HANDLERS; i++) {
+		FaultHandler	*h = handlers[i].load(std::memory_order_acquire);
+		if (h != NULL && h->handleTrap(uctx))
+			return;
+	}
+
+	if (chain(&old_trap, sig, si, uctx) || old_trap.sa_handler == SIG_IGN)
+		return;
+
+	/* a trap isn't retried; take the default action now */
+	signal(SIGTRAP, SIG_DFL);
+	raise(SIGTRAP);
+}
@@ -0,0 +1,31 @@
+/* process-wide SIGSEGV fan-out for page protection tricks */
+#ifndef FAULTDISPATCH_H
+#define FAULTDISPATCH_H
+
+#include <signal.h>
+
+/* handlers run in signal context: no allocation, no locks */
+class FaultHandler
+{
+public:
+	virtual ~FaultHandler(void) {}
+	/* true if the fault was ours and the access can be retried */
+	virtual bool handleFault(void* addr, void* uctx) = 0;
+	/* true if a single-step trap was ours; see FaultDispatch::add() */
+	virtual bool handleTrap(void* uctx) { return false; }
+};
+
+/* faults no handler claims go to whatever was installed before us */
+class FaultDispatch
+{
+public:
+	/* 'traps' catches SIGTRAP as well, for handlers that step the
+	   faulting instruction */
+	static void add(FaultHandler* h, bool traps = false);
+	static void remove(FaultHandler* h);
+private:
+	static void onFault(int sig, siginfo_t* si, void* uctx);
+	static void onTrap(int sig, siginfo_t* si, void* uctx);
+};
+
+#endif
@@ -58,21 +58,25 @@ void Guest::setSyscallResult(uint64_t ret) { abi->setSyscallResult(ret); }
 uint64_t Guest::getExitCode(void) const { return abi->getExitCode(); }
 
 
+/* analysis threads may all ask at once; the loser waits for the load */
 const Symbols& Guest::getSymbols(void) const
 {
-	if (!symbols) symbols = loadSymbols();
+	std::call_once(symbols_once,
+		[this] { if (!symbols) symbols = loadSymbols(); });
 	return *symbols;
 }
 
 Symbols& Guest::getSymbols(void)
 {
-	if (!symbols) symbols = loadSymbols();
+	std::call_once(symbols_once,
+		[this] { if (!symbols) symbols = loadSymbols(); });
 	return *symbols;
 }
 
 const Symbols& Guest::getDynSymbols(void) const
 {
-	if (!dyn_symbols) dyn_symbols = loadDynSymbols();
+	std::call_once(dyn_symbols_once,
+		[this] { if (!dyn_symbols) dyn_symbols = loadDynSymbols(); });
 	return *dyn_symbols;
 }
 
@@ -5,6 +5,7 @@
 #include <vector>
 #include <stdint.h>
 #include <list>
+#include <mutex>
 #include "arch.h"
 #include "guestmem.h"
 #include "syscall/syscallparams.h"
@@ -110,9 +111,11 @@ protected:
 	/* XXX: should this be a ptrlist? */
 	std::vector<GuestCPUState*>		thread_cpus;
 
-	// so const getSymbols will lazy load
+	// so const getSymbols will lazy load; once, whoever asks first
 	mutable std::unique_ptr<Symbols>	symbols;
 	mutable std::unique_ptr<Symbols>	dyn_symbols;
+	mutable std::once_flag			symbols_once;
+	mutable std::once_flag			dyn_symbols_once;
 };
 
 #endif
\ No newline at end of file
@@ -20,14 +20,17 @@ protected:
 	Guest	&g;
 };
 
+/* syscall registers named in the guest CPU state; W is the guest word,
+ * so 32-bit guests get their registers cut down without a test per
+ * access. Instantiated for uint32_t and uint64_t in guestabi.cc */
+template <typename W>
 class RegStrABI : public GuestABI
 {
 public:
 	RegStrABI(Guest& g_,
 		const char** sc_regs,
 		const char* sc_ret,
-		const char* exit_reg,
-		bool	_is_32bit);
+		const char* exit_reg);
 	virtual ~RegStrABI(void) {}
 
 	virtual SyscallParams getSyscallParams(void) const;
@@ -35,10 +38,11 @@ public:
 	virtual uint64_t getExitCode(void) const;
 	virtual uint64_t getSyscallResult(void) const;
 private:
+	W* reg(unsigned off) const;
+
 	unsigned	sc_reg_off[8]; /* [0] = sc_num, [1] = arg0, ... */
 	unsigned	scret_reg_off;
 	unsigned	exit_reg_off;
-	bool		is_32bit;
 };
 
 #endif
@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "guestarena.h"
+
+#define PAGE_SIZE	4096
+#define PM_PRESENT	(1ULL << 63)
+#define PM_SWAPPED	(1ULL << 62)
+#define PM_FILE		(1ULL << 61)
+/* pagemap entries per read */
+#define PM_BATCH	512
+
+std::shared_ptr<GuestArena> GuestArena::create(void)
+{
+	int	fd;
+
+	fd = memfd_create("guestmem", MFD_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+
+	return std::shared_ptr<GuestArena>(new GuestArena(fd));
+}
+
+GuestArena::GuestArena(int _fd)
+: fd(_fd)
+, file_end(0)
+{
+	struct stat	st;
+	int		err;
+
+	err = fstat(fd, &st);
+	assert (err == 0);
+	dev = st.st_dev;
+	ino = st.st_ino;
+}
+
+GuestArena::~GuestArena(void) { close(fd); }
+
+off_t GuestArena::alloc(size_t len, holds_t& h)
+{
+	std::lock_guard<std::mutex>	lk(mtx);
+	off_t				off;
+
+	len = (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+	off = file_end;
+	if (ftruncate(fd, off + len) < 0)
+		return -errno;
+
+	file_end += len;
+	extents[off] = Extent{len, 1};
+	h.insert(off);
+	return off;
+}
+
+void GuestArena::hold(off_t off, holds_t& h)
+{
+	std::lock_guard<std::mutex>		lk(mtx);
+	std::map<off_t, Extent>::iterator	it;
+
+	it = extents.upper_bound(off);
+	assert (it != extents.begin() && "offset outside of arena");
+	--it;
+	assert (off < it->first + (off_t)it->second.len);
+
+	if (h.insert(it->first).second)
+		it->second.refs++;
+}
+
+void GuestArena::drop(holds_t& h)
+{
+	std::lock_guard<std::mutex>	lk(mtx);
+
+	for (auto off : h) {
+		auto	it = extents.find(off);
+
+		assert (it != extents.end());
+		if (--it->second.refs)
+			continue;
+
+		punch(it->first, it->second.len);
+		extents.erase(it);
+	}
+
+	h.clear();
+}
+
+void GuestArena::punch(off_t off, size_t len)
+{
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+}
+
+size_t GuestArena::getBytes(void) const
+{
+	struct stat	st;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+	return (size_t)st.st_blocks * 512;
+}
+
+static int pwriteAll(int fd, const char* p, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t	n = pwrite(fd, p, len, off);
+		if (n <= 0)
+			return (n < 0) ? -errno : -EIO;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+int GuestArena::copyIn(off_t off, const char* p, size_t len, int pagemap_fd)
+{
+	uint64_t	ents[PM_BATCH];
+	size_t		done = 0;
+
+	if (pagemap_fd < 0)
+		return pwriteAll(fd, p, len, off);
+
+	while (done < len) {
+		size_t	c = std::min<size_t>((len - done) / PAGE_SIZE, PM_BATCH);
+		size_t	i = 0;
+		ssize_t	got;
+
+		got = pread(pagemap_fd, ents, c * 8,
+			((uintptr_t)p + done) / PAGE_SIZE * 8);
+		if (got != (ssize_t)(c * 8))
+			return pwriteAll(fd, p + done, len - done, off + done);
+
+		while (i < c) {
+			size_t	j;
+			int	err;
+
+			if (!(ents[i] & (PM_PRESENT | PM_SWAPPED))) {
+				i++;
+				continue;
+			}
+
+			for (j = i + 1; j < c; j++)
+				if (!(ents[j] & (PM_PRESENT | PM_SWAPPED)))
+					break;
+
+			err = pwriteAll(fd,
+				p + done + i*PAGE_SIZE,
+				(j - i)*PAGE_SIZE,
+				off + done + i*PAGE_SIZE);
+			if (err)
+				return err;
+			i = j;
+		}
+
+		done += c * PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+int GuestArena::copyOut(off_t off, int out_fd, off_t out_off, size_t len) const
+{
+	loff_t	in = off, out = out_off;
+
+	while (len) {
+		ssize_t	n = copy_file_range(fd, &in, out_fd, &out, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+
+	if (len == 0)
+		return 0;
+
+	/* older kernels won't copy across filesystems; sendfile will */
+	if (lseek(out_fd, out, SEEK_SET) != out)
+		return -errno;
+
+	while (len) {
+		ssize_t	n = sendfile(out_fd, fd, &in, len);
+		if (n <= 0)
+			return (n < 0) ? -errno : -EIO;
+		len -= n;
+	}
+
+	return 0;
+}
+
+bool GuestArena::readHostMaps(std::vector<HostMap>& out)
+{
+	FILE		*f;
+	unsigned long	start, end, off, ino;
+	unsigned	maj, min;
+	char		perms[5];
+
+	f = fopen("/proc/self/maps", "r");
+	if (f == NULL)
+		return false;
+
+	out.clear();
+	while (fscanf(f, "%lx-%lx %4s %lx %x:%x %lu%*[^\n]",
+		&start, &end, perms, &off, &maj, &min, &ino) == 7)
+	{
+		HostMap	hm;
+
+		hm.start = start;
+		hm.end = end;
+		hm.prot =
+			((perms[0] == 'r') ? PROT_READ : 0) |
+			((perms[1] == 'w') ? PROT_WRITE : 0) |
+			((perms[2] == 'x') ? PROT_EXEC : 0);
+		hm.shared = (perms[3] == 's');
+		hm.off = off;
+		hm.dev = makedev(maj, min);
+		hm.ino = ino;
+		out.push_back(hm);
+	}
+
+	fclose(f);
+	return true;
+}
+
+bool GuestArena::hasPrivatePages(int pagemap_fd, const void* p, size_t len)
+{
+	uint64_t	ents[PM_BATCH];
+	uintptr_t	pg = (uintptr_t)p / PAGE_SIZE;
+	size_t		n = len / PAGE_SIZE;
+
+	while (n) {
+		size_t	c = (n < PM_BATCH) ? n : PM_BATCH;
+		ssize_t	got;
+
+		got = pread(pagemap_fd, ents, c * 8, pg * 8);
+		if (got != (ssize_t)(c * 8))
+			return true;
+
+		for (size_t i = 0; i < c; i++) {
+			if (ents[i] & PM_SWAPPED)
+				return true;
+			if ((ents[i] & PM_PRESENT) && !(ents[i] & PM_FILE))
+				return true;
+		}
+
+		pg += c;
+		n -= c;
+	}
+
+	return false;
+}
@@ -0,0 +1,78 @@
+/* memfd holding guest pages that several GuestMems map copy-on-write */
+#ifndef GUESTARENA_H
+#define GUESTARENA_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <sys/types.h>
+#include <stdint.h>
+
+class GuestArena
+{
+public:
+	/* one line of /proc/self/maps */
+	struct HostMap
+	{
+		uintptr_t	start, end;
+		int		prot;
+		bool		shared;
+		off_t		off;
+		dev_t		dev;
+		ino_t		ino;
+	};
+
+	/* extents a GuestMem keeps alive; dropped all at once */
+	typedef std::set<off_t> holds_t;
+
+	/* NULL if there's no memfd support */
+	static std::shared_ptr<GuestArena> create(void);
+	virtual ~GuestArena(void);
+
+	int getFd(void) const { return fd; }
+	bool owns(const HostMap& hm) const
+	{ return hm.ino == ino && hm.dev == dev; }
+
+	/* new zeroed extent of 'len' bytes, held by 'h'; -errno on failure */
+	off_t alloc(size_t len, holds_t& h);
+	/* take a reference on the extent holding file offset 'off' */
+	void hold(off_t off, holds_t& h);
+	/* extents nobody holds any more are punched out of the file */
+	void drop(holds_t& h);
+	/* give back the pages under part of an extent; it reads as zero */
+	void punch(off_t off, size_t len);
+
+	/* fill the extent at 'off' from host memory. With a pagemap fd,
+	   pages that were never touched are left as zero-filled holes */
+	int copyIn(off_t off, const char* p, size_t len, int pagemap_fd = -1);
+	/* copy to another file without going through user space */
+	int copyOut(off_t off, int out_fd, off_t out_off, size_t len) const;
+
+	/* memory the file holds, in bytes */
+	size_t getBytes(void) const;
+
+	static bool readHostMaps(std::vector<HostMap>& out);
+	/* true if any page in [p, p+len) is no longer the one the file
+	   has (written through a private mapping, or swapped out) */
+	static bool hasPrivatePages(int pagemap_fd, const void* p, size_t len);
+
+private:
+	GuestArena(int _fd);
+
+	struct Extent
+	{
+		size_t		len;
+		unsigned	refs;
+	};
+
+	std::mutex			mtx;
+	std::map<off_t, Extent>		extents;
+	int				fd;
+	dev_t				dev;
+	ino_t				ino;
+	off_t				file_end;
+};
+
+#endif
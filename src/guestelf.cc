@@ -164,7 +164,8 @@ public:
 	}
 };
 
-void GuestELF::createElfTables(int argc, int envc)
+template <typename W>
+void GuestELF::createElfTables(const GuestView<W>& v, int argc, int envc)
 {
 	guest_ptr string_stack = sp;
 	int rnd_br;
@@ -260,53 +261,52 @@ void GuestELF::createElfTables(int argc, int envc)
 
 	/* align to 16 bytes for the entry point */
 	int items = argc + 1 + envc + 1 + 1 + table.size() * 2 ;
-	int sz = img->getAddressBits() == 32 ?
-		sizeof(int) * items
-		: sizeof(long) * items;
+	int sz = v.WORD_BYTES * items;
 	while(((uintptr_t)sp - sz) & 0xf)
 		pushPadByte();
 
 	foreach(it, table.rbegin(), table.rend()) {
-		pushNative(it->second);
-		pushNative(it->first);
+		pushNative(v, it->second);
+		pushNative(v, it->first);
 	}
 
-	loaderBuildArgptr(envc, argc, string_stack, 0);
+	loaderBuildArgptr(v, envc, argc, string_stack, 0);
 }
 
 /* Construct the envp and argv tables on the target stack.	*/
-void GuestELF::loaderBuildArgptr(int envc, int argc,
+template <typename W>
+void GuestELF::loaderBuildArgptr(const GuestView<W>& v, int envc, int argc,
 	guest_ptr stringp, int push_ptr)
 {
 	guest_ptr envp;
 	guest_ptr argv;
 
 	/* reserve space for the environment string pointers and a null */
-	for(int i = 0; i <= envc; ++i) pushPointer(guest_ptr(0));
+	for(int i = 0; i <= envc; ++i) pushNative(v, 0);
 	envp = sp;
 
 	/* reserve space for the argument string pointers and a null */
-	for(int i = 0; i <= argc; ++i) pushPointer(guest_ptr(0));
+	for(int i = 0; i <= argc; ++i) pushNative(v, 0);
 	argv = sp;
 
 	/* our ABI doesn't need this */
 	if (push_ptr) {
-		pushPointer(envp);
-		pushPointer(argv);
+		pushNative(v, envp.o);
+		pushNative(v, argv.o);
 	}
 
-	pushNative(argc);
+	pushNative(v, argc);
 
 	/* copy all the arg pointers into the table */
 	while (argc-- > 0) {
-		putPointer(argv, stringp, 1);
+		putNative(v, argv, stringp.o, 1);
 		argv_ptrs.push_back(argv);
 		stringp.o += mem->strlen(stringp) + 1;
 	}
 
 	/* copy all the env pointers into the table */
 	while (envc-- > 0) {
-		putPointer(envp, stringp, 1);
+		putNative(v, envp, stringp.o, 1);
 		stringp.o += mem->strlen(stringp) + 1;
 	}
 }
@@ -336,7 +336,10 @@ void GuestELF::setArgv(unsigned int argc, const char* argv[],
 
 	setupArgPages();
 
-	createElfTables(argc, envc);
+	if (img->getAddressBits() == 32)
+		createElfTables(GuestView<uint32_t>(*mem), argc, envc);
+	else
+		createElfTables(GuestView<uint64_t>(*mem), argc, envc);
 
 	if(getenv("GUEST_DUMP_MAPS")) {
 		std::list<ElfSegment*> m;
@@ -418,43 +421,18 @@ Arch::Arch GuestELF::getArch() const {
 	return img->getArch();
 }
 
-void GuestELF::pushPointer(guest_ptr v) {
-	pushNative((uintptr_t)v);
-}
-void GuestELF::pushNative(uintptr_t v) {
-	if(img->getAddressBits() == 32) {
-		assert(!(v & ~0xFFFFFFFFULL));
-		sp.o -= sizeof(unsigned int);
-		mem->write<unsigned>(sp, v);
-	} else {
-		/* only other option is 64-bit and that means
-		   we are on a 64-bit host, so smash it in there*/
-		sp.o -= sizeof(uintptr_t);
-		mem->write<uintptr_t>(sp, v);
-	}
-}
-void GuestELF::putPointer(guest_ptr& p, guest_ptr v, ssize_t inc) {
-	putNative(p, (uintptr_t)v, inc);
+template <typename W>
+void GuestELF::pushNative(const GuestView<W>& v, uintptr_t x) {
+	assert(v.fits(x));
+	sp.o -= v.WORD_BYTES;
+	v.writeNative(sp, x);
 }
-void GuestELF::putNative(guest_ptr& p, uintptr_t v, ssize_t inc) {
-	if(img->getAddressBits() == 32) {
-		assert(!(v & ~0xFFFFFFFFULL));
-		mem->write<unsigned>(p, v);
-	} else {
-		/* only other option is 64-bit and that means
-		   we are on a 64-bit host, so smash it in there*/
-		mem->write<uintptr_t>(p, v);
-	}
-	nextNative(p, inc);
-}
-void GuestELF::nextNative(guest_ptr& p, ssize_t num) {
-	if(img->getAddressBits() == 32) {
-		p.o += num * sizeof(unsigned int);
-	} else {
-		/* only other option is 64-bit and that means
-		   we are on a 64-bit host, so smash it in there*/
-		p.o += num * sizeof(uintptr_t);
-	}
+template <typename W>
+void GuestELF::putNative(const GuestView<W>& v, guest_ptr& p, uintptr_t x,
+	ssize_t inc) {
+	assert(v.fits(x));
+	v.writeNative(p, x);
+	p.o += inc * v.WORD_BYTES;
 }
 
 void GuestELF::pushPadByte() {
@@ -25,17 +25,22 @@ private:
 	void setupMem(void);
 	void setupMemARM(void);
 	void setupArgPages(void);
-	void createElfTables(int argc, int envc);
 	void copyElfStrings(int argc, const char **argv);
-	void loaderBuildArgptr(int envc, int argc,
+
+	/* the tables are built with the image's word size fixed; see
+	   GuestView */
+	template <typename W>
+	void createElfTables(const GuestView<W>& v, int argc, int envc);
+	template <typename W>
+	void loaderBuildArgptr(const GuestView<W>& v, int envc, int argc,
 		guest_ptr stringp, int push_ptr);
 		
 	void pushPadByte();
-	void pushPointer(guest_ptr);
-	void pushNative(uintptr_t);
-	void putPointer(guest_ptr& p, guest_ptr v, ssize_t inc = 0);
-	void putNative(guest_ptr& p, uintptr_t v, ssize_t inc = 0);
-	void nextNative(guest_ptr& p, ssize_t inc = 1);
+	template <typename W>
+	void pushNative(const GuestView<W>& v, uintptr_t x);
+	template <typename W>
+	void putNative(const GuestView<W>& v, guest_ptr& p, uintptr_t x,
+		ssize_t inc = 0);
 
 	ElfImg			*img;
 	std::vector<char*>	arg_pages;
@@ -0,0 +1,818 @@
+/* sorted interval table backing GuestMem's mapping list */
+#ifndef GUESTMAPTAB_H
+#define GUESTMAPTAB_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Sugar.h"
+
+/* Records are kept inline in fixed-size sorted chunks. A separate flat
+ * array holds the first offset of every chunk, so an address lookup is a
+ * binary search over one small contiguous array followed by a binary search
+ * inside a single chunk-- no pointer chasing through tree nodes.
+ *
+ * The records must not overlap and must provide 'offset' and 'end()'.
+ *
+ * Every chunk also tracks the largest hole between one of its records and
+ * the record before it. A max-tree over those values lets firstGap() skip
+ * straight to the first chunk with a big enough hole, so first-fit searches
+ * are logarithmic in the number of chunks instead of linear in records.
+ * Hole bookkeeping is deferred: mutations only mark the chunks they touch
+ * and the next firstGap() recomputes those, so mprotect-heavy workloads
+ * that never search for free space do not pay for it.
+ *
+ * Copies are versions: they share the chunk array and the chunks, so a
+ * copy costs the same for ten records or a million. Whichever version
+ * changes first takes its own chunk array and its own copy of each chunk
+ * it writes to; everything else stays shared. A non-const iterator takes
+ * its chunk as it gets there, so it counts as writing. diff() skips the
+ * chunks two versions share.
+ *
+ * Chunks are carved out of slabs and recycled through a free list, so
+ * splitting and trimming records (e.g., mprotect storms) does not hit the
+ * allocator. A table and its copies draw on the same slabs, which go away
+ * with the last of them.
+ *
+ * Iterators are invalidated by insert/erase and by copying the table;
+ * mutating methods return a fresh iterator to keep going. Any number of
+ * threads may find(), search, and iterate a table nobody is changing;
+ * find()'s last-hit cache is a single atomic word. firstGap() catches up
+ * its index as it goes, so it belongs to the writer. Separate versions
+ * may be changed and dropped on separate threads. */
+template <typename T, unsigned CHUNK_ENTS = 64>
+class GuestMapTab
+{
+	struct Chunk
+	{
+		Chunk(void) : refs(0), n(0) {}
+		std::atomic<unsigned>	refs;	/* versions using it */
+		unsigned		n;
+		T			ents[CHUNK_ENTS];
+	};
+
+	/* a version's chunk array and what's indexed by chunk */
+	struct Root
+	{
+		Root(void) : refs(1), ent_c(0) {}
+		Root(const Root& r)
+		: refs(1), chunks(r.chunks), keys(r.keys)
+		, max_gap(r.max_gap), dirty(r.dirty), ent_c(r.ent_c) {}
+		std::atomic<unsigned>	refs;
+		std::vector<Chunk*>	chunks;
+		std::vector<uintptr_t>	keys;
+		std::vector<uintptr_t>	max_gap;
+		std::vector<uint8_t>	dirty;	/* queued on gap_dirty */
+		unsigned		ent_c;
+	};
+
+	/* slabs and free chunks, shared by a table and its copies */
+	struct Pool
+	{
+		Pool(void) : slab_ents(0) {}
+		std::mutex				mtx;
+		std::vector<std::unique_ptr<Chunk[]>>	slabs;
+		std::vector<Chunk*>			free_chunks;
+		unsigned				slab_ents;
+	};
+
+	struct pos_t
+	{
+		pos_t(unsigned _c, unsigned _i) : c(_c), i(_i) {}
+		unsigned c, i;
+	};
+
+	template <typename TabT, typename RecT>
+	class iter_base
+	{
+	public:
+		iter_base(void) : tab(NULL), c(0), i(0) {}
+		iter_base(TabT* _tab, unsigned _c, unsigned _i)
+		: tab(_tab), c(_c), i(_i) { claim(tab, c); }
+		iter_base(TabT* _tab, const pos_t& p)
+		: tab(_tab), c(p.c), i(p.i) { claim(tab, c); }
+
+		template <typename T2, typename R2>
+		iter_base(const iter_base<T2, R2>& it)
+		: tab(it.tab), c(it.c), i(it.i) {}
+
+		RecT& operator*() const { return tab->root->chunks[c]->ents[i]; }
+		RecT* operator->() const { return &tab->root->chunks[c]->ents[i]; }
+
+		iter_base& operator++()
+		{
+			if (++i == tab->root->chunks[c]->n) {
+				c++;
+				i = 0;
+				claim(tab, c);
+			}
+			return *this;
+		}
+
+		iter_base& operator--()
+		{
+			if (i == 0) {
+				c--;
+				claim(tab, c);
+				i = tab->root->chunks[c]->n - 1;
+			} else
+				i--;
+			return *this;
+		}
+
+		bool operator==(const iter_base& it) const
+		{ return c == it.c && i == it.i; }
+		bool operator!=(const iter_base& it) const
+		{ return !(*this == it); }
+
+		TabT		*tab;
+		unsigned	c, i;
+
+	private:
+		/* writable records are the iterator's own before it gets there */
+		static void claim(GuestMapTab* t, unsigned c)
+		{
+			if (t->versioned && c < t->root->chunks.size())
+				t->ownChunk(c);
+		}
+		static void claim(const GuestMapTab* t, unsigned c) {}
+	};
+
+public:
+	typedef iter_base<GuestMapTab, T>		iterator;
+	typedef iter_base<const GuestMapTab, const T>	const_iterator;
+
+	GuestMapTab(void)
+	: root(new Root()), pool(std::make_shared<Pool>()), versioned(false)
+	, gap_p(0), gap_resize(false) { resetHit(); }
+
+	/* the same version; O(1) */
+	GuestMapTab(const GuestMapTab& t)
+	: root(NULL), versioned(true), gap_p(0), gap_resize(true) { share(t); }
+
+	virtual ~GuestMapTab(void) { dropRoot(root); }
+
+	GuestMapTab& operator=(const GuestMapTab& t)
+	{
+		if (&t == this || t.root == root) return *this;
+		dropRoot(root);
+		share(t);
+		return *this;
+	}
+
+	unsigned size(void) const { return root->ent_c; }
+	/* number of slab allocations made over the table's life */
+	unsigned getSlabCount(void) const
+	{
+		std::lock_guard<std::mutex>	lk(pool->mtx);
+		return pool->slabs.size();
+	}
+	bool empty(void) const { return root->ent_c == 0; }
+
+	/* bulk release; slabs go when no copy is left using them */
+	void clear(void)
+	{
+		dropRoot(root);
+		root = new Root();
+		pool = std::make_shared<Pool>();
+		versioned = false;
+		gap_tree.clear();
+		gap_dirty.clear();
+		gap_p = 0;
+		gap_resize = false;
+		resetHit();
+	}
+
+	/* bulk load from records sorted by offset; replaces everything.
+	 * chunks are left partly empty so later inserts don't split */
+	template <typename It>
+	void assign(It first, It last)
+	{
+		const unsigned	fill_ents(CHUNK_ENTS - CHUNK_ENTS/4);
+
+		dropRoot(root);
+		root = new Root();
+		versioned = false;
+		gap_dirty.clear();
+		resetHit();
+
+		for (; first != last; ++first) {
+			Chunk	*ch;
+
+			if (root->chunks.empty() ||
+			    root->chunks.back()->n == fill_ents)
+			{
+				root->chunks.push_back(allocChunk());
+				root->keys.push_back(first->offset);
+			}
+
+			ch = root->chunks.back();
+			assert (ch->n == 0 ||
+				ch->ents[ch->n-1].end() <= first->offset);
+			ch->ents[ch->n++] = *first;
+			root->ent_c++;
+		}
+
+		root->max_gap.assign(root->chunks.size(), 0);
+		root->dirty.assign(root->chunks.size(), 0);
+		for (unsigned c = 0; c < root->chunks.size(); c++) markGap(c);
+		gap_resize = true;
+	}
+
+	iterator begin(void) { return iterator(this, 0, 0); }
+	iterator end(void) { return iterator(this, root->chunks.size(), 0); }
+	const_iterator begin(void) const { return const_iterator(this, 0, 0); }
+	const_iterator end(void) const
+	{ return const_iterator(this, root->chunks.size(), 0); }
+	/* for looking without writing; see versions above */
+	const_iterator cbegin(void) const { return begin(); }
+	const_iterator cend(void) const { return end(); }
+
+	/* first record with offset >= addr */
+	iterator lowerBound(uintptr_t addr)
+	{ return iterator(this, lowerPos(addr)); }
+	const_iterator lowerBound(uintptr_t addr) const
+	{ return const_iterator(this, lowerPos(addr)); }
+
+	/* first record with end() > addr; i.e., the record containing
+	 * addr or the first record following it */
+	iterator upperEnd(uintptr_t addr)
+	{ return iterator(this, endPos(addr)); }
+	const_iterator upperEnd(uintptr_t addr) const
+	{ return const_iterator(this, endPos(addr)); }
+
+	/* record that contains addr, if any */
+	const T* find(uintptr_t addr) const
+	{
+		const std::vector<Chunk*>	&chunks(root->chunks);
+		const T				*r;
+		uint64_t			h(hit.load(std::memory_order_relaxed));
+		unsigned			hit_c(h >> 32), hit_i(h);
+
+		if (hit_c < chunks.size() && hit_i < chunks[hit_c]->n) {
+			r = &chunks[hit_c]->ents[hit_i];
+			if (r->offset <= addr && addr < r->end())
+				return r;
+		}
+
+		const_iterator	it(upperEnd(addr));
+		if (it == end() || it->offset > addr)
+			return NULL;
+
+		hit.store(((uint64_t)it.c << 32) | it.i,
+			std::memory_order_relaxed);
+		return &*it;
+	}
+
+	T* find(uintptr_t addr)
+	{
+		uint64_t	h;
+
+		if (((const GuestMapTab*)this)->find(addr) == NULL)
+			return NULL;
+		/* a hit always leaves its position behind */
+		h = hit.load(std::memory_order_relaxed);
+		return &ownChunk(h >> 32)->ents[(unsigned)h];
+	}
+
+	/* insert 't' directly before 'pos'; caller keeps ordering */
+	iterator insert(iterator pos, const T& t)
+	{
+		Chunk		*ch;
+		unsigned	c(pos.c), i(pos.i);
+
+		ownRoot();
+		resetHit();
+		root->ent_c++;
+
+		if (root->chunks.empty()) {
+			root->chunks.push_back(allocChunk());
+			root->keys.push_back(0);
+			root->max_gap.push_back(0);
+			root->dirty.push_back(0);
+			rebuildGaps();
+			c = i = 0;
+		} else if (i == 0 && c > 0 && root->chunks[c-1]->n < CHUNK_ENTS) {
+			/* append to tail of previous chunk; key unchanged */
+			c--;
+			i = root->chunks[c]->n;
+		} else if (c == root->chunks.size()) {
+			c--;
+			i = root->chunks[c]->n;
+		}
+
+		if (root->chunks[c]->n == CHUNK_ENTS) {
+			splitChunk(c);
+			if (i > root->chunks[c]->n) {
+				i -= root->chunks[c]->n;
+				c++;
+			}
+		}
+
+		ch = ownChunk(c);
+		std::copy_backward(&ch->ents[i], &ch->ents[ch->n], &ch->ents[ch->n+1]);
+		ch->ents[i] = t;
+		ch->n++;
+		if (i == 0) root->keys[c] = ch->ents[0].offset;
+		fixGaps(c);
+
+		return iterator(this, c, i);
+	}
+
+	/* remove record at pos; returns iterator to following record */
+	iterator erase(iterator pos)
+	{
+		Chunk		*ch;
+		unsigned	c(pos.c), i(pos.i);
+
+		ch = ownChunk(c);
+		resetHit();
+		root->ent_c--;
+
+		std::copy(&ch->ents[i+1], &ch->ents[ch->n], &ch->ents[i]);
+		ch->ents[--ch->n] = T();
+
+		if (ch->n == 0) {
+			dropChunk(ch);
+			root->chunks.erase(root->chunks.begin() + c);
+			root->keys.erase(root->keys.begin() + c);
+			root->max_gap.erase(root->max_gap.begin() + c);
+			root->dirty.erase(root->dirty.begin() + c);
+			rebuildGaps();
+			if (c < root->chunks.size()) fixGaps(c);
+			return iterator(this, c, 0);
+		}
+
+		if (i == 0) root->keys[c] = ch->ents[0].offset;
+		fixGaps(c);
+		if (i == ch->n) return iterator(this, c+1, 0);
+		return iterator(this, c, i);
+	}
+
+	/* must be called after changing a record's extent in place */
+	void update(iterator pos)
+	{
+		ownChunk(pos.c);
+		resetHit();
+		if (pos.i == 0) root->keys[pos.c] = pos->offset;
+		fixGaps(pos.c);
+	}
+
+	/* first record at or after 'from' with more than 'len' bytes
+	 * of free space between it and the record before it */
+	const_iterator firstGap(const_iterator from, uintptr_t len) const
+	{
+		unsigned	c(from.c), i(from.i);
+
+		flushGaps();
+		if (c >= root->chunks.size())
+			return end();
+
+		if (root->max_gap[c] <= len) {
+			c = gapChunk(c + 1, len);
+			i = 0;
+			if (c >= root->chunks.size())
+				return end();
+		}
+
+		for (; i < root->chunks[c]->n; i++)
+			if (gapBefore(c, i) > len)
+				return const_iterator(this, c, i);
+
+		/* hole was before 'from' in the same chunk */
+		c = gapChunk(c + 1, len);
+		if (c >= root->chunks.size())
+			return end();
+
+		for (i = 0; gapBefore(c, i) <= len; i++);
+		return const_iterator(this, c, i);
+	}
+
+	/* f(rec, false) for each record only here, f(rec, true) for each
+	 * only in 'b'; records that differ at all count as both. Time goes
+	 * to the chunks the two versions don't share. Needs T::operator== */
+	template <typename F>
+	void diff(const GuestMapTab& b, F f) const
+	{
+		const_iterator	ia(begin()), ea(end());
+		const_iterator	ib(b.begin()), eb(b.end());
+
+		if (root == b.root)
+			return;
+
+		while (ia != ea && ib != eb) {
+			if (	ia.i == 0 && ib.i == 0 &&
+				root->chunks[ia.c] == b.root->chunks[ib.c])
+			{
+				ia.c++;
+				ib.c++;
+				continue;
+			}
+
+			if (ia->offset < ib->offset) {
+				f(*ia, false);
+				++ia;
+			} else if (ib->offset < ia->offset) {
+				f(*ib, true);
+				++ib;
+			} else {
+				if (!(*ia == *ib)) {
+					f(*ia, false);
+					f(*ib, true);
+				}
+				++ia;
+				++ib;
+			}
+		}
+
+		for (; ia != ea; ++ia) f(*ia, false);
+		for (; ib != eb; ++ib) f(*ib, true);
+	}
+
+	/* for tests: this version's records are sorted and apart, chunk
+	 * keys and counts agree, and caught-up hole maxima are right */
+	bool isConsistent(void) const
+	{
+		const std::vector<Chunk*>	&chunks(root->chunks);
+		unsigned			ents(0);
+		uintptr_t			prev_end(0);
+
+		if (	root->refs == 0 ||
+			root->keys.size() != chunks.size() ||
+			root->max_gap.size() != chunks.size() ||
+			root->dirty.size() != chunks.size())
+			return false;
+
+		flushGaps();
+		if (gap_tree.size() != 2*gap_p || gap_p < chunks.size())
+			return false;
+		for (unsigned k = 1; k < gap_p; k++)
+			if (gap_tree[k] != std::max(gap_tree[2*k], gap_tree[2*k+1]))
+				return false;
+
+		for (unsigned c = 0; c < chunks.size(); c++) {
+			const Chunk	*ch(chunks[c]);
+			uintptr_t	g(0);
+
+			if (	ch->refs == 0 || ch->n == 0 ||
+				ch->n > CHUNK_ENTS ||
+				root->keys[c] != (uintptr_t)ch->ents[0].offset)
+				return false;
+
+			for (unsigned i = 0; i < ch->n; i++) {
+				const T	&t(ch->ents[i]);
+				if (	(uintptr_t)t.offset < prev_end ||
+					(uintptr_t)t.end() < (uintptr_t)t.offset)
+					return false;
+				g = std::max(g, gapBefore(c, i));
+				prev_end = t.end();
+			}
+
+			if (root->max_gap[c] != g || gap_tree[gap_p + c] != g)
+				return false;
+			ents += ch->n;
+		}
+
+		return ents == root->ent_c;
+	}
+
+	/* for tests: 'all' holds every live version there is; each chunk
+	 * array and chunk counts exactly the versions using it, and no
+	 * chunk in use is on a free list */
+	static bool refsConsistent(const std::vector<const GuestMapTab*>& all)
+	{
+		std::map<const Root*, unsigned>		roots;
+		std::map<const Chunk*, unsigned>	used;
+		std::map<const Pool*, unsigned>		pools;
+
+		for (auto t : all) {
+			roots[t->root]++;
+			pools[t->pool.get()]++;
+		}
+
+		for (const auto &r : roots) {
+			if (r.first->refs != r.second)
+				return false;
+			for (auto ch : r.first->chunks)
+				used[ch]++;
+		}
+
+		for (const auto &u : used)
+			if (u.first->refs != u.second)
+				return false;
+
+		for (const auto &p : pools) {
+			std::lock_guard<std::mutex>	lk(
+				const_cast<Pool*>(p.first)->mtx);
+			for (auto ch : p.first->free_chunks)
+				if (ch->refs != 0 || used.count(ch))
+					return false;
+		}
+
+		return true;
+	}
+
+private:
+	template <typename TabT, typename RecT>
+	friend class iter_base;
+
+	/* take on t's version; its pending hole updates go in first so
+	 * the shared maxima are right for everybody */
+	void share(const GuestMapTab& t)
+	{
+		t.flushGaps();
+		t.versioned = versioned = true;
+		root = t.root;
+		root->refs++;
+		pool = t.pool;
+		gap_tree.clear();
+		gap_dirty.clear();
+		gap_resize = true;
+		resetHit();
+	}
+
+	/* whoever dropped the last other reference is done reading */
+	static bool solo(const std::atomic<unsigned>& refs)
+	{ return refs.load(std::memory_order_acquire) == 1; }
+
+	void ownRoot(void) { if (versioned && !solo(root->refs)) copyRoot(); }
+
+	Chunk* ownChunk(unsigned c)
+	{
+		if (!versioned ||
+		    (solo(root->refs) && solo(root->chunks[c]->refs)))
+			return root->chunks[c];
+		return copyChunk(c);
+	}
+
+	/* copies stay out of line so the solo checks inline cheaply */
+	ATTRIBUTE_NOINLINE void copyRoot(void)
+	{
+		Root	*r(new Root(*root));
+
+		for (auto ch : r->chunks) ch->refs++;
+		dropRoot(root);
+		root = r;
+	}
+
+	ATTRIBUTE_NOINLINE Chunk* copyChunk(unsigned c)
+	{
+		Chunk	*ch, *nch;
+
+		ownRoot();
+		ch = root->chunks[c];
+		if (solo(ch->refs))
+			return ch;
+
+		nch = allocChunk();
+		std::copy(ch->ents, ch->ents + ch->n, nch->ents);
+		nch->n = ch->n;
+		root->chunks[c] = nch;
+		dropChunk(ch);
+		return nch;
+	}
+
+	void dropRoot(Root* r)
+	{
+		if (r == NULL || r->refs.fetch_sub(1) != 1)
+			return;
+		for (auto ch : r->chunks) dropChunk(ch);
+		delete r;
+	}
+
+	/* chunk that would hold addr */
+	unsigned chunkIdx(uintptr_t addr) const
+	{
+		const std::vector<uintptr_t>	&keys(root->keys);
+		auto it = std::upper_bound(keys.begin(), keys.end(), addr);
+		return (it == keys.begin()) ? 0 : (it - keys.begin()) - 1;
+	}
+
+	pos_t normalize(unsigned c, unsigned i) const
+	{
+		if (c < root->chunks.size() && i == root->chunks[c]->n)
+			return pos_t(c+1, 0);
+		return pos_t(c, i);
+	}
+
+	pos_t lowerPos(uintptr_t addr) const
+	{
+		const Chunk	*ch;
+		unsigned	c;
+
+		if (root->chunks.empty()) return pos_t(0, 0);
+
+		c = chunkIdx(addr);
+		ch = root->chunks[c];
+		auto it = std::lower_bound(
+			&ch->ents[0], &ch->ents[ch->n], addr,
+			[] (const T& t, uintptr_t a) { return t.offset < a; });
+		return normalize(c, it - &ch->ents[0]);
+	}
+
+	pos_t endPos(uintptr_t addr) const
+	{
+		const Chunk	*ch;
+		unsigned	c;
+
+		if (root->chunks.empty()) return pos_t(0, 0);
+
+		c = chunkIdx(addr);
+		ch = root->chunks[c];
+		auto it = std::upper_bound(
+			&ch->ents[0], &ch->ents[ch->n], addr,
+			[] (uintptr_t a, const T& t) { return a < t.end(); });
+		return normalize(c, it - &ch->ents[0]);
+	}
+
+	void splitChunk(unsigned c)
+	{
+		Chunk		*ch(ownChunk(c));
+		unsigned	half(ch->n / 2);
+		Chunk		*nch(allocChunk());
+
+		nch->n = ch->n - half;
+		std::copy(&ch->ents[half], &ch->ents[ch->n], &nch->ents[0]);
+		for (unsigned i = half; i < ch->n; i++) ch->ents[i] = T();
+		ch->n = half;
+
+		root->keys.insert(root->keys.begin() + c + 1, nch->ents[0].offset);
+		root->chunks.insert(root->chunks.begin() + c + 1, nch);
+		root->max_gap.insert(root->max_gap.begin() + c + 1, 0);
+		root->dirty.insert(root->dirty.begin() + c + 1, 0);
+		rebuildGaps();
+		fixGaps(c);
+	}
+
+	/* free bytes between record (c, i) and its predecessor */
+	uintptr_t gapBefore(unsigned c, unsigned i) const
+	{
+		const std::vector<Chunk*>	&chunks(root->chunks);
+		uintptr_t			prev_end;
+
+		if (i > 0)
+			prev_end = chunks[c]->ents[i-1].end();
+		else if (c > 0)
+			prev_end = chunks[c-1]->ents[chunks[c-1]->n - 1].end();
+		else
+			prev_end = 0;
+
+		return (uintptr_t)chunks[c]->ents[i].offset - prev_end;
+	}
+
+	void setChunkGap(unsigned c) const
+	{
+		uintptr_t	g(0);
+		unsigned	k;
+
+		for (unsigned i = 0; i < root->chunks[c]->n; i++)
+			g = std::max(g, gapBefore(c, i));
+		root->max_gap[c] = g;
+
+		if (gap_resize)
+			return;
+
+		k = gap_p + c;
+		gap_tree[k] = g;
+		for (k >>= 1; k > 0; k >>= 1)
+			gap_tree[k] = std::max(gap_tree[2*k], gap_tree[2*k+1]);
+	}
+
+	void markGap(unsigned c)
+	{
+		if (root->dirty[c]) return;
+		root->dirty[c] = 1;
+		gap_dirty.push_back(c);
+	}
+
+	/* the first hole of the next chunk depends on our last record */
+	void fixGaps(unsigned c)
+	{
+		markGap(c);
+		if (c + 1 < root->chunks.size()) markGap(c + 1);
+	}
+
+	/* chunk count changed; max-tree is resized on the next flush */
+	void rebuildGaps(void) { gap_resize = true; }
+
+	/* bring hole maxima up to date before a search */
+	void flushGaps(void) const
+	{
+		if (gap_resize) {
+			/* chunks moved since they were queued; go by the flags */
+			for (unsigned c = 0; c < root->chunks.size(); c++) {
+				if (!root->dirty[c]) continue;
+				root->dirty[c] = 0;
+				setChunkGap(c);
+			}
+			gap_dirty.clear();
+			resizeGaps();
+			return;
+		}
+
+		for (auto c : gap_dirty) {
+			root->dirty[c] = 0;
+			setChunkGap(c);
+		}
+		gap_dirty.clear();
+	}
+
+	void resizeGaps(void) const
+	{
+		gap_resize = false;
+		for (gap_p = 1; gap_p < root->chunks.size(); gap_p <<= 1);
+		gap_tree.assign(2*gap_p, 0);
+		for (unsigned c = 0; c < root->chunks.size(); c++)
+			gap_tree[gap_p + c] = root->max_gap[c];
+		for (unsigned k = gap_p - 1; k > 0; k--)
+			gap_tree[k] = std::max(gap_tree[2*k], gap_tree[2*k+1]);
+	}
+
+	/* first chunk >= c0 holding a hole bigger than len */
+	unsigned gapChunk(unsigned c0, uintptr_t len) const
+	{
+		unsigned	k;
+
+		if (c0 >= root->chunks.size())
+			return root->chunks.size();
+
+		k = gap_p + c0;
+		if (gap_tree[k] > len)
+			return c0;
+
+		/* climb until some subtree to the right has a hole */
+		for (; k > 1; k >>= 1) {
+			if ((k & 1) == 0 && gap_tree[k + 1] > len)
+				break;
+		}
+
+		if (k <= 1)
+			return root->chunks.size();
+
+		/* descend, favoring leftmost */
+		for (k++; k < gap_p; ) {
+			k *= 2;
+			if (gap_tree[k] <= len) k++;
+		}
+
+		return k - gap_p;
+	}
+
+	Chunk* allocChunk(void)
+	{
+		std::lock_guard<std::mutex>	lk(pool->mtx);
+		Chunk				*ch;
+
+		/* grow slabs geometrically so big tables need few of them */
+		if (pool->free_chunks.empty()) {
+			unsigned	n = pool->slab_ents ? pool->slab_ents : 4;
+			Chunk		*slab = new Chunk[n];
+
+			pool->slabs.push_back(std::unique_ptr<Chunk[]>(slab));
+			for (unsigned i = 0; i < n; i++)
+				pool->free_chunks.push_back(&slab[n - i - 1]);
+			pool->slab_ents = std::min(2*n, 1024U);
+		}
+
+		ch = pool->free_chunks.back();
+		pool->free_chunks.pop_back();
+		ch->refs = 1;
+		return ch;
+	}
+
+	void dropChunk(Chunk* ch)
+	{
+		if (ch->refs.fetch_sub(1) != 1)
+			return;
+
+		for (unsigned i = 0; i < ch->n; i++) ch->ents[i] = T();
+		ch->n = 0;
+
+		std::lock_guard<std::mutex>	lk(pool->mtx);
+		pool->free_chunks.push_back(ch);
+	}
+
+	void resetHit(void) const { hit.store(~0ULL, std::memory_order_relaxed); }
+
+	Root				*root;
+	std::shared_ptr<Pool>		pool;
+	/* ever shared a version; until then everything is ours alone */
+	mutable bool			versioned;
+
+	/* hole index; brought up to date lazily by flushGaps() */
+	mutable std::vector<uintptr_t>	gap_tree;
+	mutable std::vector<unsigned>	gap_dirty;
+	mutable unsigned		gap_p;
+	mutable bool			gap_resize;
+
+	/* most recent find() hit; chunk in the high half */
+	mutable std::atomic<uint64_t>	hit;
+};
+
+#endif
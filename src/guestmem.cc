@@ -3,25 +3,71 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include "Sugar.h"
 #include "guestmem.h"
 #include "guestptimg.h"	//dumpSelfMap
+#include "dirtytracker.h"
 
 /* XXX other archs? */
 #define PAGE_SIZE 4096
 #define BRK_RESERVE 256 * 1024 * 1024
+/* free space kept above a flat-mode heap so it can outgrow BRK_RESERVE;
+   the host fills address space top-down, so it stays clear a long time */
+#define BRK_HEADROOM (64ULL * 1024 * 1024 * 1024)
+/* least the heap's host commit grows by */
+#define BRK_COMMIT_MIN (256 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* bounce buffer for memory that can't be read in place */
+#define SCAN_CHUNK 512
+/* pages per unit of hashing work */
+#define HASH_BATCH 64
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* room the kernel leaves under the stack before mmaps start */
+#define MMAP_MIN_GAP (128UL * 1024 * 1024)
+#define MMAP_MAX_GAP (1UL << 40)
+/* vm.mmap_min_addr */
+#define MMAP_FLOOR 0x10000
+/* what a 32-bit or rebased guest gets held for it */
+#define WINDOW_END 0x100000000ULL
+
+extern "C" void* __libc_stack_end;
 
 GuestMem::GuestMem(void)
 : base(NULL)
 , top_brick(0)
 , base_brick(0)
 , reserve_brick(0)
+, commit_brick(0)
 , is_32_bit(false)
 , force_flat(getenv("GUEST_4GB_REBASE") == NULL)
+, coalesce_maps(getenv("GUEST_COALESCE_MAPS") != NULL)
+, host_backed(true)
+, huge_pages(getenv("GUEST_HUGEPAGES") != NULL)
 , syspage_data(NULL)
+, syspage_len(0)
+, memfd_backed(false)
+, view_stale(true)
+, view_hint(0)
+, mmap_top(0)
+, want_window(!force_flat)
+, shared_reads(false)
+, publish_held(false)
+, pub_maps(NULL)
 {
 	const char	*base_str;
 #ifdef __amd64__
@@ -48,60 +94,76 @@ GuestMem::GuestMem(void)
 	   record the null page so we don't reuse it */
 	Mapping null_page(guest_ptr(0), PAGE_SIZE, PROT_NONE);
 	recordMapping(null_page);
+
+	if (getenv("GUEST_MEMFD") != NULL)
+		setMemfdBacking(true);
 }
 
 GuestMem::~GuestMem(void)
 {
-	for (const auto &p : maps) {
-		Mapping	*m = p.second;
+	/* stop taking faults before the memory goes away */
+	dirty_log.reset();
+	code_log.reset();
+	watch_log.reset();
+
+	for (const auto &m : maps) {
 		/* XXX: NOTE: won't call subtype's sys_munmap!! */
-		sys_munmap(getHostPtr(m->offset), m->length);
-		delete m;
+		sys_munmap(getHostPtr(m.offset), m.length);
+	}
+
+	/* heap pages past brk and the reservation aren't in the table */
+	if (top_brick != 0) {
+		guest_ptr	b(heapEnd());
+		guest_ptr	e(brkEnd());
+		if (e > b) sys_munmap(getHostPtr(b), e - b);
 	}
 
+	for (const auto &w : window)
+		sys_munmap(getHostPtr(w.offset), w.length);
+
 	if (syspage_data) delete [] syspage_data;
+	if (arena != nullptr) arena->drop(arena_holds);
+	delete pub_maps.load();
 }
 
-/* XXX I haven't audited this, so it's very likely that it's wrong. -AJR */
+/* the heap gets BRK_RESERVE of PROT_NONE address space up front and
+   grows through it in place; see commitBrk() */
 bool GuestMem::sbrkInitial()
 {
 	GuestMem::Mapping m;
-	void *addr;
-	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	int flags = MAP_NORESERVE;
 	int prot = PROT_READ | PROT_WRITE;
 
-	if (is_32_bit) flags |= MAP_32BIT;
+	bool found = false;
 
-	/* this sux, for some reason it keeps redirecting the allocation
-	   lower, but the truth is, we're forcing it elsewhere anyway, so
-	   it doesn't matter.  it would be good to reserve the whole address
-	   space for a 32-bit proc */
-	if (!force_flat) flags |= MAP_FIXED;
+	holdWindow();
 
-	bool found = findFreeRegion(BRK_RESERVE, m);
+	/* sit at the bottom of the hole, away from whatever's above */
+	if (force_flat && !is_32_bit)
+		found = findFreeRegion(BRK_HEADROOM, m);
+	if (!found)
+		found = findFreeRegion(BRK_RESERVE, m);
 	assert(found && "couldn't allocate mapping");
 
-	addr = sys_mmap(getBase()+m.offset.o, BRK_RESERVE, prot, flags, -1, 0);
-
-	assert(addr != MAP_FAILED && "initial sbrk failed");
-	m.offset = guest_ptr((char*)addr - getBase());
+	/* flat mode only probed the host; it may have lost the race */
+	flags |= force_flat ? MAP_FIXED_NOREPLACE : MAP_FIXED;
+	if (!mapBrk(m.offset, BRK_RESERVE, PROT_NONE, flags)) {
+		found = findFreeRegion(BRK_RESERVE, m);
+		assert(found && "couldn't allocate mapping");
+		found = mapBrk(m.offset, BRK_RESERVE, PROT_NONE, flags);
+		assert(found && "initial sbrk failed");
+	}
 	assert(!is_32_bit || m.offset.o < 0xFFFFFFFFULL);
 
+	top_brick = base_brick = commit_brick = m.offset;
+	reserve_brick = base_brick + BRK_RESERVE;
 
-	addr = sys_mremap(addr, BRK_RESERVE, PAGE_SIZE, 0);
-	assert(addr != MAP_FAILED && "sbrk shrink assploded");
-	flags &= ~MAP_NORESERVE;
-	flags |= MAP_FIXED;
-
-	addr = sys_mmap(addr, PAGE_SIZE, prot, flags, -1, 0);
-	assert(addr != MAP_FAILED && "sbrk flags fix kerplunked");
+	found = commitBrk(base_brick + PAGE_SIZE);
+	assert(found && "sbrk flags fix kerplunked");
 
 	m.length = PAGE_SIZE;
 	m.cur_prot = m.req_prot = prot;
 	recordMapping(m);
-
-	top_brick = base_brick = m.offset;
-	reserve_brick = base_brick + BRK_RESERVE;
 	return true;
 }
 
@@ -114,13 +176,16 @@ bool GuestMem::sbrkInitial(guest_ptr new_top)
 
 	if (is_32_bit) flags |= MAP_32BIT;
 
+	holdWindow();
+	if (inWindow(new_top, PAGE_SIZE)) flags |= MAP_FIXED;
+
 	/* they picked it (e.g. xchk), try to make a mapping there.
 	   note that this initial mapping doesn't reserve any extra
 	   space, so jerks could map over it and screw us.  in this
 	   case you'd eventually see divergence in xchk, manifested
 	   by -ENOMEM being returned for the vex process on brk when
 	   the real process managed to extend the brk */
-	addr = sys_mmap(getHostPtr(new_top), PAGE_SIZE, prot, flags, -1, 0);
+	addr = mapAnon(new_top, PAGE_SIZE, prot, flags);
 	assert(addr == getHostPtr(new_top) && "initial forced sbrk failed");
 
 	m.offset = new_top;
@@ -129,687 +194,2610 @@ bool GuestMem::sbrkInitial(guest_ptr new_top)
 	recordMapping(m);
 
 	top_brick = base_brick = m.offset;
+	commit_brick = m.end();
 	return true;
 }
 
+/* brk moves a lot and by a little. the host heap is committed ahead of
+   it in chunks, so most calls only touch the heap's table record */
 bool GuestMem::sbrk(guest_ptr new_top)
 {
-	GuestMem::Mapping	m;
-	size_t			new_len;
-	void			*addr;
+	maptab_t::iterator	it;
+	guest_ptr		old_end, new_end;
 
 	if (top_brick == 0)
 		return (new_top == 0)
 			? sbrkInitial()
 			: sbrkInitial(new_top);
 
+	/* a plain query, or below the start of the heap */
+	if (new_top < base_brick)
+		return true;
 
-	if (!lookupMapping(base_brick, m))
+	it = maps.upperEnd(base_brick);
+	if (it == maps.end() || it->offset != base_brick)
 		return false;
 
-	new_len = new_top - base_brick;
-	new_len = (new_len + PAGE_SIZE - 1) & ~(PAGE_SIZE -1);
+	old_end = it->end();
+	new_end = pageUp(new_top);
 
 	/* new_top is not page aligned because its really just
 	   a number the guest will use... we don't ever use it
 	   anymore. */
-	if (new_len == m.length) {
+	if (new_end == old_end) {
 		top_brick = new_top;
 		return true;
 	}
 
-	/* lame we can be more graceful here and try to do it */
-	if(reserve_brick && m.offset + new_len > reserve_brick)
-		return false;
+	/* at least a page always stays, like the kernel's */
+	if (new_end == base_brick)
+		new_end = base_brick + PAGE_SIZE;
 
-	/* i want to extend the existing mapping... but it seems like
-	   something is not working with that, so do this instead */
-	// addr = mremap(m.offset, m.length, new_len, MREMAP_FIXED);
-	addr = sys_mmap(
-		getBase() + m.end(),
-		new_len - m.length,
-		PROT_READ | PROT_WRITE,
-		MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
-		-1,
-		0);
+	if (new_end > old_end) {
+		maptab_t::iterator	next(it);
+
+		/* someone mapped over where we'd grow to */
+		if (++next != maps.end() && next->offset < new_end)
+			return false;
 
-	if (addr == MAP_FAILED && errno != EFAULT) return false;
-	assert (addr != MAP_FAILED && "sbrk is broken again");
+		if (new_end > commit_brick && !commitBrk(new_end))
+			return false;
 
-	m.length = new_len;
-	recordMapping(m);
+		noteChanged(old_end, new_end - old_end);
+	} else {
+		/* regrowing has to see zeroes, so the pages go back */
+		if (!decommitBrk(new_end))
+			return false;
+		dropShadow(new_end, old_end);
+		noteChanged(new_end, old_end - new_end);
+	}
+
+	it->length = new_end - base_brick;
+	maps.update(it);
+	if (new_end > old_end)
+		perms.set(old_end, new_end, accessProt(*it));
+	else
+		perms.set(new_end, old_end, 0);
+	tableChanged();
 
 	top_brick = new_top;
 	return true;
 }
 
-void GuestMem::recordMapping(Mapping& mapping)
+guest_ptr GuestMem::pageUp(guest_ptr p)
+{ return guest_ptr((p.o + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1)); }
+
+/* end of the heap's record; the guest may have unmapped it */
+guest_ptr GuestMem::heapEnd(void) const
 {
-	Mapping	*cur_m = NULL;
+	const Mapping	*m = findOwner(base_brick);
+	return (m != NULL) ? m->end() : pageUp(top_brick);
+}
 
-	assert(((uintptr_t)mapping.offset & (PAGE_SIZE - 1)) == 0 &&
-		"Mapping offset not page-aligned");
+/* end of all host memory the heap holds past its record */
+guest_ptr GuestMem::brkEnd(void) const
+{ return std::max(commit_brick, reserve_brick); }
 
-	mapping.length += (PAGE_SIZE - 1);
-	mapping.length &= ~(PAGE_SIZE - 1);
+/* the guest mapped or unmapped [b, e) over the heap's slack or
+   reservation; the heap can't grow past it, so everything held from
+   there up goes */
+void GuestMem::trimBrk(guest_ptr b, guest_ptr e)
+{
+	guest_ptr	lo, hi;
 
-	mapmap_t::iterator it = maps.lower_bound(mapping.offset);
-	if (it != maps.begin()) --it;
-
-	cur_m = (it != maps.end()) ? it->second : NULL;
-
-	if (cur_m && cur_m->offset < mapping.offset) {
-		/* we are cutting off someone before us */
-		if (cur_m->end() > mapping.offset) {
-			long lost;
-			/* we are completely inside the old block */
-			if (mapping.end() < cur_m->end()) {
-				Mapping *smaller;
-
-				smaller = new Mapping(
-					mapping.end(),
-					(long)cur_m->end()-(long)mapping.end(),
-					cur_m->req_prot);
-
-				smaller->cur_prot = cur_m->cur_prot;
-				maps.insert(
-					std::make_pair(
-						smaller->offset,
-						smaller));
-			}
-			lost = cur_m->end() - mapping.offset;
-			cur_m->length -= lost;
-		}
-		++it;
-	}
+	if (top_brick == 0)
+		return;
 
-	cur_m = (it != maps.end()) ? it->second : NULL;
+	lo = heapEnd();
+	hi = brkEnd();
+	if (e <= lo || b >= hi)
+		return;
 
-	/* mapping overlaps completly */
-	if (cur_m && cur_m->offset == mapping.offset) {
-		if (cur_m->length  == mapping.length) {
-			it->second = new Mapping(mapping);
-			delete cur_m;
-			return;
-		}
+	if (e < hi) {
+		clearBacking(e, hi);
+		releaseHost(e, hi - e);
+	}
 
-		/* old mapping is bigger, split */
-		if(cur_m->length > mapping.length) {
-			Mapping	*smaller;
+	b = std::max(b, lo);
+	commit_brick = std::min(commit_brick, b);
+	reserve_brick = b;
+}
 
-			smaller = new Mapping(
-				mapping.end(),
-				cur_m->length - mapping.length,
-				cur_m->req_prot);
-			smaller->cur_prot = cur_m->cur_prot;
+/* fresh anonymous memory at exactly 'p', or nothing */
+bool GuestMem::mapBrk(guest_ptr p, size_t len, int prot, int flags)
+{
+	void	*at;
 
-			maps.insert(std::make_pair(smaller->offset, smaller));
+	if (is_32_bit && p.o + len > WINDOW_END)
+		return false;
 
-			it->second = new Mapping(mapping);
-			delete cur_m;
-			return;
-		}
+	/* callers have checked the table, and that's all the window needs */
+	if ((flags & MAP_FIXED_NOREPLACE) && inWindow(p, len))
+		flags ^= MAP_FIXED_NOREPLACE | MAP_FIXED;
 
-		/* newer mapping is bigger, replace it */
-		it->second = new Mapping(mapping);
-		delete cur_m;
-		++it;
-	} else {
-		/* no specific one to overwrite, just add it */
-		it = maps.insert(std::make_pair(
-			mapping.offset,
-			new Mapping(mapping))).first;
-		++it;
+	at = mapAnon(p, len, prot, flags | MAP_NORESERVE);
+	if (at == MAP_FAILED) {
+		if (errno == EEXIST) viewStale();
+		return false;
 	}
 
-	/* kill all the ones it overlaps */
-	while (it != maps.end() && mapping.end() > it->second->end()) {
-		mapmap_t::iterator to_erase = it++;
+	if (at != getHostPtr(p)) {
+		/* old kernels take NOREPLACE as a hint */
+		guest_ptr	g((char*)at - getBase());
 
-		delete to_erase->second;
-		maps.erase(to_erase);
+		sys_munmap(at, len);
+		clearBacking(g, g + len);
+		return false;
 	}
 
-	/* trim the last one if necessary */
-	cur_m = (it != maps.end()) ? it->second : NULL;
-	if (cur_m && mapping.end() > cur_m->offset) {
-		long lost;
+	/* a remap drops the advice; keep the whole heap one way */
+	if (huge_pages)
+		adviseHuge(p, len);
 
-		lost = mapping.end() - cur_m->offset;
-		cur_m->offset = mapping.end();
-		cur_m->length -= lost;
-	}
+	return true;
 }
 
-void GuestMem::removeMapping(Mapping& mapping)
+/* make the host heap read/write up to at least 'end'. commits run a
+   quarter of the heap ahead; the reservation doubles when it runs out */
+bool GuestMem::commitBrk(guest_ptr end)
 {
-	mapmap_t::iterator	it;
+	maptab_t::const_iterator	it;
+	guest_ptr			want, resv, big;
+	size_t				step;
+
+	end = pageUp(end);
+	step = std::max<size_t>(
+		(commit_brick - base_brick) / 4, BRK_COMMIT_MIN);
+	want = pageUp(std::max(end, guest_ptr(commit_brick + step)));
+	resv = brkEnd();
+	big = std::max(want, guest_ptr(resv + (resv - base_brick)));
+
+	/* stop short of whatever the guest mapped past the heap */
+	it = cmaps().upperEnd(commit_brick);
+	if (it != maps.cend()) {
+		guest_ptr	lim(std::max(it->offset, commit_brick));
+
+		if (end > lim)
+			return false;
+		want = std::min(want, lim);
+		big = std::min(big, lim);
+	}
 
-	/* this reuses the collision handling code in the insert
-	   function.  could be more efficient, but meh */
-	recordMapping(mapping);
+	for (guest_ptr t : { big, want, end }) {
+		if (t <= resv)
+			break;
+		if (mapBrk(resv, t - resv, PROT_NONE, MAP_FIXED_NOREPLACE)) {
+			resv = t;
+			break;
+		}
+	}
 
-	it = maps.find(mapping.offset);
-	if (it != maps.end()) {
-		delete it->second;
-		maps.erase(it);
+	if (end > resv)
+		return false;
+	reserve_brick = resv;
+	want = std::min(want, resv);
+
+	/* anything not held yet is free; the guest table says so */
+	if (	sys_mprotect(getHostPtr(commit_brick), want - commit_brick,
+			PROT_READ | PROT_WRITE) != 0 &&
+		!mapBrk(commit_brick, want - commit_brick,
+			PROT_READ | PROT_WRITE, MAP_FIXED_NOREPLACE))
+	{
+		return false;
 	}
+
+	commit_brick = want;
+	return true;
 }
 
-bool GuestMem::lookupMapping(guest_ptr addr, Mapping& mapping) const
+/* hand back the heap past 'end' to the reservation */
+bool GuestMem::decommitBrk(guest_ptr end)
 {
-	const GuestMem::Mapping* m;
+	if (commit_brick <= end)
+		return true;
 
-	if ((m = lookupMapping(addr)) == NULL)
+	clearBacking(end, commit_brick);
+	if (!mapBrk(end, commit_brick - end, PROT_NONE, MAP_FIXED))
 		return false;
 
-	mapping = *m;
+	if (reserve_brick < commit_brick)
+		reserve_brick = commit_brick;
+	commit_brick = end;
 	return true;
 }
 
-bool GuestMem::lookupMapping(const char* name, Mapping& mapping) const
+/* punch [b, e) out of the mapping table, trimming or splitting anything
+   that straddles the edges. returns where a mapping starting at 'b' goes */
+GuestMem::maptab_t::iterator GuestMem::clearRange(guest_ptr b, guest_ptr e)
 {
-	for (const auto &p : maps) {
-		const Mapping	*m(p.second);
-		if (m->name && *(m->name) == name) {
-			mapping = *m;
-			return true;
+	maptab_t::iterator	it;
+
+	it = maps.upperEnd(b);
+	if (it == maps.end())
+		return it;
+
+	/* we are cutting off someone before us */
+	if (it->offset < b) {
+		/* we are completely inside the old block */
+		if (it->end() > e) {
+			Mapping	tail(*it);
+
+			tail.offset = e;
+			tail.length = it->end() - e;
+			it->length = b - it->offset;
+			maps.update(it);
+			indexName(tail);
+			return maps.insert(++it, tail);
 		}
+
+		it->length = b - it->offset;
+		maps.update(it);
+		++it;
 	}
 
-	return false;
-}
+	/* kill all the ones it overlaps */
+	while (it != maps.end() && it->end() <= e)
+		it = eraseMapping(it);
 
-/* return mapping that begins at addr */
-const GuestMem::Mapping* GuestMem::lookupMapping(guest_ptr addr) const
-{
-	mapmap_t::const_iterator it;
-	it = maps.lower_bound(addr);
+	/* trim the last one if necessary */
+	if (it != maps.end() && it->offset < e) {
+		unindexName(*it);
+		it->length -= e - it->offset;
+		it->offset = e;
+		maps.update(it);
+		indexName(*it);
+	}
 
-	if (it != maps.end() && it->first == addr)
-		return it->second;
+	return it;
+}
 
-	if (it == maps.begin())
-		return NULL;
+GuestMem::maptab_t::iterator GuestMem::eraseMapping(maptab_t::iterator it)
+{
+	unindexName(*it);
+	return maps.erase(it);
+}
 
-	--it;
-	if (it->second->end() > addr)
-		return it->second;
+/* names live as long as the process; there are only so many files */
+static std::mutex			intern_mtx;
+static std::unordered_set<std::string>	intern_names;
 
-	return NULL;
+const std::string* GuestMem::internName(const std::string& s)
+{
+	std::lock_guard<std::mutex>	lk(intern_mtx);
+	return &*intern_names.insert(s).first;
 }
 
-/* find mapping (if any) that contains the given address */
-const GuestMem::Mapping* GuestMem::findOwner(guest_ptr addr) const
+const std::string* GuestMem::findName(const std::string& s)
 {
-	const Mapping		*m;
-	mapmap_t::const_iterator it;
+	std::lock_guard<std::mutex>	lk(intern_mtx);
+	auto				it = intern_names.find(s);
+	return (it != intern_names.end()) ? &*it : NULL;
+}
 
-	it = maps.find(addr);
-	if (it != maps.end())
-		return it->second;
+void GuestMem::indexName(const Mapping& m)
+{
+	if (m.name == NULL) return;
+	mapping_names[*m.name].insert(m.offset);
+}
 
-	/* first mapping  >addr */
-	it = maps.upper_bound(addr);
-	if (it == maps.begin())
-		return NULL;
+void GuestMem::unindexName(const Mapping& m)
+{
+	namemap_t::iterator	it;
 
-	/* last mapping <= addr */
-	it--;
-	m = it->second;
-	if (m->contains(addr))
-		return m;
+	if (m.name == NULL) return;
+	it = mapping_names.find(*m.name);
+	if (it == mapping_names.end())
+		return;
+	/* names come and go with churn; don't keep dead ones around */
+	it->second.erase(m.offset);
+	if (it->second.empty())
+		mapping_names.erase(it);
+}
 
-	return NULL;
+/* the brk mapping is never merged; sbrk() works off its exact extent */
+bool GuestMem::canCoalesce(const Mapping& a, const Mapping& b) const
+{
+	return	a.end() == b.offset &&
+		a.req_prot == b.req_prot &&
+		a.cur_prot == b.cur_prot &&
+		a.type == b.type &&
+		a.name == b.name &&
+		!a.contains(base_brick) && !b.contains(base_brick);
 }
 
-/* return mapping that follows directly after 'addr' (but does not contain it) */
-const GuestMem::Mapping* GuestMem::findNextMapping(guest_ptr addr) const
+/* fold mergeable records on either side of insert position 'pos' into 'm';
+   returns where 'm' goes now */
+GuestMem::maptab_t::iterator GuestMem::absorbNeighbours(
+	maptab_t::iterator pos, Mapping& m)
 {
-	mapmap_t::const_iterator it;
-	const Mapping		*m;
+	maptab_t::iterator	prev;
 
-	it = maps.lower_bound(addr);
-	if (it == maps.end() || it == maps.end())
-		return NULL;
+	if (pos != maps.end() && canCoalesce(m, *pos)) {
+		m.length += pos->length;
+		pos = eraseMapping(pos);
+	}
 
-	m = it->second;
-	if (m->contains(addr))
-		it++;
+	if (pos == maps.begin())
+		return pos;
 
-	if (it == maps.end()) return NULL;
+	prev = pos;
+	if (canCoalesce(*--prev, m)) {
+		m.offset = prev->offset;
+		m.length += prev->length;
+		pos = eraseMapping(prev);
+	}
 
-	return it->second;
+	return pos;
 }
 
-std::list<GuestMem::Mapping> GuestMem::getMaps(void) const
+void GuestMem::recordMapping(Mapping& mapping)
 {
-	std::list<Mapping>	ret;
+	maptab_t::iterator	pos;
 
-	for (const auto &p : maps) {
-		Mapping	m(*(p.second));
-		if (!(m.req_prot & PROT_READ))
-			continue;
-		ret.push_back(m);
-	}
+	assert(((uintptr_t)mapping.offset & (PAGE_SIZE - 1)) == 0 &&
+		"Mapping offset not page-aligned");
 
-	return ret;
-}
+	mapping.length += (PAGE_SIZE - 1);
+	mapping.length &= ~(PAGE_SIZE - 1);
+	if (mapping.length == 0)
+		return;
 
-void GuestMem::Mapping::print(std::ostream& os) const
-{
-	os	<< "Addr: " << (void*)offset.o << "--" << (void*)end().o;
+	/* may have been named by some other GuestMem */
+	if (mapping.name != NULL)
+		mapping.name = internName(*mapping.name);
 
-	if (name != NULL) os << ". Name=" << *name;
+	/* anything but the heap's own record ends the heap below it */
+	if (mapping.offset != base_brick)
+		trimBrk(mapping.offset, mapping.end());
 
-	os	<< ". ReqProt=" << std::hex << req_prot
-		<< ". CurProt=" << cur_prot
-		<< std::endl;
+	/* merged neighbours have the same protection already */
+	perms.set(mapping.offset, mapping.end(), accessProt(mapping));
+	if (code_log != nullptr && (mapping.req_prot & PROT_EXEC))
+		code_log->noteCode(mapping.offset, mapping.end());
+
+	/* sorted loads land past everything; nothing to cut */
+	if (!maps.empty() && (--maps.cend())->end() <= mapping.offset)
+		pos = maps.end();
+	else
+		pos = clearRange(mapping.offset, mapping.end());
+
+	if (coalesce_maps)
+		pos = absorbNeighbours(pos, mapping);
+
+	maps.insert(pos, mapping);
+	indexName(mapping);
+	tableChanged();
 }
 
-/* TODO: some kind of check to see if we blew out address space
-   thats ok in 64-bit, or possibly using the host mapping capability
-   to just find something higher than the rebase */
-bool GuestMem::findFreeRegion(size_t len, Mapping& m) const
+void GuestMem::appendMapping(
+	std::vector<Mapping>& v, const Mapping& m, bool merge) const
 {
-	void	*addr;
-	int	flags;
+	if (merge && !v.empty() && canCoalesce(v.back(), m))
+		v.back().length += m.length;
+	else
+		v.push_back(m);
+}
 
-	if (!force_flat)
-		return findFreeRegionByMaps(len, m);
+/* replace the whole table with 'v' (sorted) and redo the name index */
+void GuestMem::rebuildMappings(const std::vector<Mapping>& v)
+{
+	maps.assign(v.begin(), v.end());
+
+	mapping_names.clear();
+	perms.clear();
+	for (const auto &m : maps) {
+		indexName(m);
+		perms.set(m.offset, m.end(), accessProt(m));
+		if (code_log != nullptr && (m.req_prot & PROT_EXEC))
+			code_log->noteCode(m.offset, m.end());
+	}
+	tableChanged();
+}
 
-	flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
-	if (is_32_bit) flags |= MAP_32BIT;
+void GuestMem::setSharedReads(bool on)
+{
+	maptab_t	*old;
 
-	addr = sys_mmap(0, len, 0, flags, -1, 0);
-	if (addr == MAP_FAILED)
-		return false;
-	sys_munmap(addr, len);
+	if (on == shared_reads)
+		return;
 
-	m.offset = guest_ptr((uintptr_t)addr - (uintptr_t)getBase());
-	m.length = len;
-	return true;
+	shared_reads = on;
+	if (on) {
+		pub_maps.store(new maptab_t(maps));
+		return;
+	}
+
+	old = pub_maps.exchange(NULL);
+	Rcu::synchronize();
+	delete old;
 }
 
-bool GuestMem::findFreeRegionByMaps(size_t len, Mapping& m) const
+/* publish the new version; the old one goes once nobody can still be
+   looking at it. Versions share chunks, so this copies next to nothing */
+void GuestMem::tableChanged(void)
 {
-	guest_ptr			current(0x100000);
-	mapmap_t::const_iterator	it;
-
-	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE -1);
+	maptab_t	*old;
 
-	if (current < reserve_brick)
-		current = reserve_brick;
+	if (!shared_reads || publish_held)
+		return;
 
-	it = maps.lower_bound(current);
+	old = pub_maps.exchange(new maptab_t(maps));
+	Rcu::synchronize();
+	delete old;
+}
 
-	if (it != maps.begin()) --it;
-	while (it != maps.end() && it->second->end() < current)
-		++it;
+void GuestMem::diffLayouts(const maptab_t& a, const maptab_t& b,
+	std::vector<Mapping>& gone, std::vector<Mapping>& added)
+{
+	a.diff(b, [&] (const Mapping& m, bool in_b) {
+		(in_b ? added : gone).push_back(m); });
+}
 
-	if (it != maps.end() && it->second->offset <= current) {
-		current = it->second->end();
-		++it;
-	}
+void GuestMem::restoreLayout(const maptab_t& l)
+{
+	std::vector<Mapping>	gone, added;
 
-	for (; it != maps.end(); ++it) {
-		if (it->second->offset - current > len) {
-			m.offset = current;
-			m.length = len;
-			return true;
-		}
+	assert (!host_backed && "host mappings can't be restored");
 
-		current = it->second->end();
+	diffLayouts(maps, l, gone, added);
+	for (const auto &m : gone) {
+		unindexName(m);
+		perms.set(m.offset, m.end(), 0);
+	}
+	for (const auto &m : added) {
+		indexName(m);
+		perms.set(m.offset, m.end(), accessProt(m));
+		if (code_log != nullptr && (m.req_prot & PROT_EXEC))
+			code_log->noteCode(m.offset, m.end());
 	}
 
-	m.offset = current;
-	m.length = len;
-	assert (!is_32_bit || m.offset.o < 0xFFFFFFFFULL);
-	return true;
+	maps = l;
+	tableChanged();
 }
 
-void GuestMem::print(std::ostream& os) const
+/* what a checked access may do to m's pages. A syspage has no host
+   pages unless we're rebased; scanGuest() reads it from syspage_data */
+int GuestMem::accessProt(const Mapping& m) const
 {
-	os << "Guest Mem (" << maps.size() << ") entries: \n";
-	foreach (it, maps.begin(), maps.end()) {
-		it->second->print(os);
-	}
-	os << "\n";
+	if (m.type == Mapping::VSYSPAGE && getBase() == NULL)
+		return 0;
+	return m.cur_prot;
 }
 
-int GuestMem::mmap(guest_ptr& result, guest_ptr addr,
-	size_t len, int prot, int flags, int fd, off_t offset)
+void GuestMem::recordMappings(std::vector<Mapping>& batch)
 {
-	void	*desired, *at;
-
-	result = guest_ptr(0);
+	std::vector<Mapping>		out;
+	maptab_t::const_iterator	it;
+	Mapping				old;
+	bool				have_old;
+	guest_ptr			last_end(0);
+
+	for (auto &m : batch) {
+		assert(((uintptr_t)m.offset & (PAGE_SIZE - 1)) == 0 &&
+			"Mapping offset not page-aligned");
+		m.length += (PAGE_SIZE - 1);
+		m.length &= ~(PAGE_SIZE - 1);
+		assert (m.offset >= last_end && "unsorted mapping batch");
+		if (m.length) last_end = m.end();
+		if (m.length && m.offset != base_brick)
+			trimBrk(m.offset, m.end());
+		if (m.name != NULL)
+			m.name = internName(*m.name);
+	}
 
-	if (fd >= 0 && (offset & (PAGE_SIZE - 1))) return -EINVAL;
-	if (fd >= 0 && (addr.o & (PAGE_SIZE - 1))) return -EINVAL;
-	if ((addr & (PAGE_SIZE - 1))) return -EINVAL;
+	/* a handful of updates to a big table are cheaper one by one */
+	if (batch.size() * 8 < maps.size()) {
+		publish_held = true;
+		for (auto &m : batch) recordMapping(m);
+		publish_held = false;
+		tableChanged();
+		return;
+	}
 
-	// /* we are fixing these up as long as a file mapping isn't involved.
-	//    does this match the linux kernel implementation? */
-	// len += addr.o & ~(PAGE_SIZE - 1);
-	// addr.o &= ~(PAGE_SIZE - 1);
-	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE -1);
+	/* merge the two sorted runs; the batch wins where they overlap */
+	auto next_old = [&] () {
+		have_old = (it != maps.cend());
+		if (have_old) {
+			old = *it;
+			++it;
+		}
+	};
 
-	Mapping m(addr, len, prot);
-	if (addr == 0 && !(flags & MAP_FIXED)) {
-		if (!findFreeRegion(m.length, m))
-			return -ENOMEM;
-	}
+	out.reserve(maps.size() + batch.size());
+	it = maps.cbegin();
+	next_old();
+	for (const auto &m : batch) {
+		if (m.length == 0)
+			continue;
 
-	if (m.req_prot & PROT_WRITE) m.cur_prot &= ~PROT_EXEC;
+		while (have_old && old.end() <= m.offset) {
+			appendMapping(out, old, coalesce_maps);
+			next_old();
+		}
 
-	desired = getHostPtr(m.offset);
+		if (have_old && old.offset < m.offset) {
+			Mapping	head(old);
+			head.length = m.offset - old.offset;
+			appendMapping(out, head, coalesce_maps);
+		}
 
-	at = sys_mmap(desired, m.length, m.cur_prot, flags & ~MAP_FIXED, fd, offset);
-	if (at == desired) goto success;
+		appendMapping(out, m, coalesce_maps);
 
-	/* tear down incorrect allocation, if given */
-	if (at != MAP_FAILED) sys_munmap(at, m.length);
+		while (have_old && old.end() <= m.end())
+			next_old();
 
-	/* Memory at desired location is not available through suggestion.
-	 * Presumably, this means it is already allocated. */
-	if ((flags & MAP_FIXED) == 0) {
-		/* If it's not a fixed mapping, we can try to relocate it */
-		if (!findFreeRegion(m.length, m))
-			return -ENOMEM;
-	} else {
-		assert (flags & MAP_FIXED);
-		if (!canUseRange(addr, len))
-			return -ENOMEM;
+		if (have_old && old.offset < m.end()) {
+			old.length = old.end() - m.end();
+			old.offset = m.end();
+		}
 	}
 
-	desired = getHostPtr(m.offset);
-	at = sys_mmap(desired, m.length, m.cur_prot, flags, fd, offset);
-	if (at == MAP_FAILED) return -errno;
-	if (at != desired) {
-		sys_munmap(at, m.length);
-		return -errno;
-	}
+	for (; have_old; next_old())
+		appendMapping(out, old, coalesce_maps);
 
-success:
-	result = m.offset;
-	recordMapping(m);
-	return 0;
+	rebuildMappings(out);
 }
 
-bool GuestMem::canUseRange(guest_ptr base, unsigned int len) const
+void GuestMem::coalesceMappings(void)
 {
-	guest_ptr	cur_ptr(base);
-	guest_ptr	end_ptr(base + len);
+	std::vector<Mapping>	out;
 
-	while (cur_ptr < end_ptr) {
-		const Mapping	*m;
-		unsigned int	test_len;
-		void		*test_addr;
+	out.reserve(maps.size());
+	for (const auto &m : maps)
+		appendMapping(out, m, true);
 
-		/* mapping exists in guest? */
-		m = findOwner(cur_ptr);
-		if (m != NULL) {
-			assert (cur_ptr.o >= m->offset.o);
-			cur_ptr.o += m->length - (cur_ptr.o - m->offset.o);
-			continue;
-		}
+	if (out.size() != maps.size())
+		rebuildMappings(out);
+}
 
-		/* check to see if mapping isn't present in host */
-		m = findNextMapping(cur_ptr);
-		test_len = end_ptr - cur_ptr;
-		if (m != NULL) {
-			unsigned int	gap;
-			assert (m->offset > cur_ptr);
-			gap = m->offset - cur_ptr;
-			if (gap < test_len) test_len = gap;
-		}
+void GuestMem::removeMapping(Mapping& mapping)
+{
+	mapping.length += (PAGE_SIZE - 1);
+	mapping.length &= ~(PAGE_SIZE - 1);
+	clearRange(mapping.offset, mapping.end());
+	perms.set(mapping.offset, mapping.end(), 0);
+	tableChanged();
+}
 
-		test_addr = sys_mmap(
-			getHostPtr(base),
-			test_len,
-			PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS,
-			-1,
-			0);
-		if (test_addr != MAP_FAILED) sys_munmap(test_addr, test_len);
-		if (test_addr != getHostPtr(base))
-			return false;
+bool GuestMem::lookupMapping(guest_ptr addr, Mapping& mapping) const
+{
+	TabReader		t(*this);
+	const GuestMem::Mapping	*m;
 
-		cur_ptr.o += test_len;
-	}
+	if ((m = t->find(addr)) == NULL)
+		return false;
 
+	mapping = *m;
 	return true;
 }
 
-int GuestMem::mprotect(guest_ptr p, size_t len, int prot)
+bool GuestMem::lookupMapping(const char* name, Mapping& mapping) const
 {
-	int	err;
+	namemap_t::const_iterator	it;
+	const Mapping			*m;
 
-	if ((p & (PAGE_SIZE - 1))) return -EINVAL;
-	if ((len & (PAGE_SIZE - 1))) return -EINVAL;
+	/* the name index changes with the table; walk the copy instead.
+	   names in it are interned, so one lookup and then pointers */
+	if (shared_reads) {
+		const std::string	*key = findName(name);
+		TabReader		t(*this);
 
-	/* TODO make sure this is a real mapped region in a better
-	   way then if mprotect fails? */
+		if (key == NULL)
+			return false;
+		for (const auto &tm : *t) {
+			if (tm.name == key) {
+				mapping = tm;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	it = mapping_names.find(name);
+	if (it == mapping_names.end() || it->second.empty())
+		return false;
+
+	m = maps.find(*it->second.begin());
+	assert (m != NULL && "stale mapping name index");
+	mapping = *m;
+	return true;
+}
+
+std::list<GuestMem::Mapping> GuestMem::lookupMappings(const char* name) const
+{
+	namemap_t::const_iterator	it;
+	std::list<Mapping>		ret;
+
+	if (shared_reads) {
+		const std::string	*key = findName(name);
+		TabReader		t(*this);
+
+		if (key == NULL)
+			return ret;
+		for (const auto &m : *t)
+			if (m.name == key)
+				ret.push_back(m);
+		return ret;
+	}
+
+	it = mapping_names.find(name);
+	if (it == mapping_names.end())
+		return ret;
+
+	for (const auto p : it->second)
+		ret.push_back(*maps.find(p));
+
+	return ret;
+}
+
+/* return mapping that contains addr */
+const GuestMem::Mapping* GuestMem::lookupMapping(guest_ptr addr) const
+{ return maps.find(addr); }
+
+/* find mapping (if any) that contains the given address */
+const GuestMem::Mapping* GuestMem::findOwner(guest_ptr addr) const
+{ return maps.find(addr); }
+
+/* return mapping that follows directly after 'addr' (but does not contain it) */
+const GuestMem::Mapping* GuestMem::findNextMapping(guest_ptr addr) const
+{
+	maptab_t::const_iterator	it;
+
+	it = maps.lowerBound(addr);
+	if (it == maps.end())
+		return NULL;
+
+	if (it->contains(addr))
+		++it;
+
+	if (it == maps.end()) return NULL;
+
+	return &*it;
+}
+
+GuestMem::MapRange GuestMem::getMappings(const MapFilter& f) const
+{
+	namemap_t::const_iterator	it;
+	const std::string		*name_key = NULL;
+
+	/* all names in the table are interned, so compare pointers */
+	if (f.name != NULL) {
+		it = mapping_names.find(f.name);
+		if (it != mapping_names.end())
+			name_key = internName(it->first);
+	}
+
+	return MapRange(maps, f, name_key);
+}
+
+std::list<GuestMem::Mapping> GuestMem::getMaps(void) const
+{
+	TabReader		t(*this);
+	std::list<Mapping>	ret;
+
+	for (const auto &m : MapRange(*t, MapFilter(PROT_READ), NULL))
+		ret.push_back(m);
+
+	return ret;
+}
+
+void GuestMem::Mapping::print(std::ostream& os) const
+{
+	os	<< "Addr: " << (void*)offset.o << "--" << (void*)end().o;
+
+	if (name != NULL) os << ". Name=" << *name;
+
+	os	<< ". ReqProt=" << std::hex << req_prot
+		<< ". CurProt=" << cur_prot
+		<< std::endl;
+}
+
+/* TODO: some kind of check to see if we blew out address space
+   thats ok in 64-bit, or possibly using the host mapping capability
+   to just find something higher than the rebase */
+bool GuestMem::findFreeRegion(size_t len, Mapping& m) const
+{
+	if (!force_flat || !window.empty())
+		return findFreeRegionByMaps(len, m);
+	return findFreeRegionByView(len, m);
+}
+
+/* top-down first fit under mmapTop(), like the kernel does it. Nothing
+   is claimed; the caller maps with MAP_FIXED_NOREPLACE */
+bool GuestMem::findFreeRegionByView(size_t len, Mapping& m) const
+{
+	const hostview_t		&v = hostView();
+	hostview_t::const_iterator	it, prev;
+	uintptr_t			top, floor, align, hi, lo;
+
+	len = (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+	align = wantsHuge(len) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+
+	if (is_32_bit) {
+		top = 0x80000000;
+		floor = 0x40000000;
+	} else {
+		top = mmapTop();
+		floor = MMAP_FLOOR;
+	}
+
+	for (unsigned pass = 0; pass < 2; pass++) {
+		hi = top;
+		if (pass == 0 && view_hint > floor && view_hint < top)
+			hi = view_hint;
+
+		it = v.upperEnd(hi);
+		if (it != v.end() && it->offset < hi)
+			hi = it->offset;
+
+		while (hi > floor) {
+			lo = floor;
+			prev = it;
+			if (it != v.begin() && (--prev)->end() > lo)
+				lo = prev->end();
+
+			if (hi >= lo + len && ((hi - len) & ~(align - 1)) >= lo) {
+				m.offset = guest_ptr((hi - len) & ~(align - 1));
+				m.length = len;
+				view_hint = m.offset;
+				return true;
+			}
+
+			if (it == v.begin())
+				break;
+			it = prev;
+			hi = it->offset;
+		}
+	}
+
+	return false;
+}
+
+/* the guest side of the kernel's mmap_base: below the stack and the room
+   it has to grow */
+guest_ptr GuestMem::mmapTop(void) const
+{
+	struct rlimit	rl;
+	uintptr_t	gap = MMAP_MIN_GAP, top;
+
+	if (mmap_top != 0)
+		return mmap_top;
+
+	if (	getrlimit(RLIMIT_STACK, &rl) == 0 &&
+		rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > gap)
+	{
+		gap = std::min<uintptr_t>(rl.rlim_cur, MMAP_MAX_GAP);
+	}
+
+	top = ((uintptr_t)__libc_stack_end - gap) & ~((uintptr_t)PAGE_SIZE - 1);
+	mmap_top = guest_ptr(top - (uintptr_t)getBase());
+	return mmap_top;
+}
+
+/* the table only knows the guest; step over host mappings in the way */
+bool GuestMem::findFreeRegionByMaps(size_t len, Mapping& m) const
+{
+	guest_ptr	floor(0x100000);
+	const HostSpan	*busy;
+
+	for (;;) {
+		if (!firstFitByMaps(len, floor, m))
+			return false;
+		if ((busy = hostBusy(m.offset, m.length)) == NULL)
+			return true;
+		floor = busy->end();
+	}
+}
+
+bool GuestMem::firstFitByMaps(size_t len, guest_ptr floor, Mapping& m) const
+{
+	guest_ptr			current(floor);
+	maptab_t::const_iterator	it;
+	size_t				want;
+
+	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE -1);
+
+	/* a hole this big always has an aligned start that fits len */
+	want = len;
+	if (wantsHuge(len)) want += HUGE_PAGE_SIZE - PAGE_SIZE;
+
+	if (current < reserve_brick)
+		current = reserve_brick;
+
+	it = maps.upperEnd(current);
+	if (it != maps.end() && it->offset <= current) {
+		current = it->end();
+		++it;
+	}
+
+	/* first-fit; the hole before 'it' is clipped by current, the rest
+	   come straight out of the gap index */
+	if (it != maps.end() && it->offset - current > want) {
+		m.offset = current;
+		goto done;
+	}
+
+	if (it != maps.end()) {
+		it = maps.firstGap(++it, want);
+		if (it != maps.end()) {
+			m.offset = (--it)->end();
+			goto done;
+		}
+
+		current = (--maps.end())->end();
+	}
+
+	m.offset = current;
+done:
+	if (want != len) m.offset = alignHuge(m.offset);
+	m.length = len;
+	assert (!is_32_bit || m.offset.o < 0xFFFFFFFFULL);
+	return true;
+}
+
+void GuestMem::print(std::ostream& os) const
+{
+	os << "Guest Mem (" << maps.size() << ") entries: \n";
+	foreach (it, maps.begin(), maps.end()) {
+		it->print(os);
+	}
+	os << "\n";
+}
+
+int GuestMem::mmap(guest_ptr& result, guest_ptr addr,
+	size_t len, int prot, int flags, int fd, off_t offset)
+{
+	void	*at;
+	off_t	file_off = -1;
+	bool	anon;
+
+	result = guest_ptr(0);
+	holdWindow();
+
+	if (fd >= 0 && (offset & (PAGE_SIZE - 1))) return -EINVAL;
+	if (fd >= 0 && (addr.o & (PAGE_SIZE - 1))) return -EINVAL;
+	if ((addr & (PAGE_SIZE - 1))) return -EINVAL;
+
+	// /* we are fixing these up as long as a file mapping isn't involved.
+	//    does this match the linux kernel implementation? */
+	// len += addr.o & ~(PAGE_SIZE - 1);
+	// addr.o &= ~(PAGE_SIZE - 1);
+	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE -1);
+
+	Mapping m(addr, len, prot);
+
+	if (m.req_prot & PROT_WRITE) m.cur_prot &= ~PROT_EXEC;
+
+	anon = fd < 0 && (flags & MAP_ANONYMOUS) && !(flags & MAP_HUGETLB);
+
+	/* private anonymous memory comes out of the arena. nobody else maps
+	   the extent, so the guest can't tell it's shared */
+	if (	memfd_backed && host_backed && fd < 0 &&
+		(flags & MAP_ANONYMOUS) &&
+		(flags & MAP_TYPE) == MAP_PRIVATE &&
+		!(flags & (MAP_GROWSDOWN | MAP_HUGETLB)))
+	{
+		file_off = arena->alloc(m.length, arena_holds);
+		if (file_off >= 0) {
+			flags &= ~(MAP_ANONYMOUS | MAP_TYPE);
+			flags |= MAP_SHARED;
+			fd = arena->getFd();
+			offset = file_off;
+		}
+	}
+
+	if (flags & MAP_FIXED) {
+		at = placeFixed(m.offset, m.length, m.cur_prot, flags, fd, offset);
+		if (at == MAP_FAILED) return -errno;
+		goto success;
+	}
+
+	/* a hint is taken only if nothing's there */
+	flags &= ~MAP_FIXED_NOREPLACE;
+	if (addr != 0) {
+		at = placeFree(m.offset, m.length, m.cur_prot, flags, fd, offset);
+		if (at != MAP_FAILED) goto success;
+	}
+
+	/* the host's own pick is as good as ours in flat mode, and it's
+	   never working off a stale view */
+	if (force_flat && host_backed && window.empty() && !wantsHuge(m.length)) {
+		at = sys_mmap(NULL, m.length, m.cur_prot,
+			flags | (is_32_bit ? MAP_32BIT : 0), fd, offset);
+		if (at == MAP_FAILED) return -errno;
+		m.offset = guest_ptr((char*)at - getBase());
+		goto success;
+	}
+
+	for (unsigned i = 0; i < 2; i++) {
+		if (!findFreeRegion(m.length, m))
+			return -ENOMEM;
+
+		at = placeFree(m.offset, m.length, m.cur_prot, flags, fd, offset);
+		if (at != MAP_FAILED) goto success;
+
+		/* something the view didn't know about; look again */
+		viewStale();
+	}
+	return -ENOMEM;
+
+success:
+	result = m.offset;
+	clearBacking(m.offset, m.end());
+	dropShadow(m.offset, m.end());
+	if (file_off >= 0)
+		addBacking(m.offset, m.length, file_off, true);
+	trimBrk(m.offset, m.end());
+	if (anon && wantsHuge(m.length))
+		adviseHuge(m.offset, m.length);
+	noteChanged(m.offset, m.length);
+	recordMapping(m);
+	return 0;
+}
+
+bool GuestMem::wantsHuge(size_t len) const
+{ return huge_pages && len >= HUGE_PAGE_SIZE; }
+
+/* rounds up so the host address, not the guest one, is aligned */
+guest_ptr GuestMem::alignHuge(guest_ptr p) const
+{
+	uintptr_t	h = (uintptr_t)getHostPtr(p);
+
+	h = (h + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+	return guest_ptr(h - (uintptr_t)getBase());
+}
+
+void GuestMem::adviseHuge(guest_ptr p, size_t len) const
+{
+	/* best effort; kernels without THP just say no */
+	madvise(getHostPtr(p), len, MADV_HUGEPAGE);
+}
+
+GuestMem::HugeStats GuestMem::getHugeStats(void) const
+{
+	HugeStats	hs = {0, 0};
+	FILE		*f;
+	char		line[512];
+	bool		ours = false;
+	size_t		vma_len = 0;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (f == NULL)
+		return hs;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long	start, end, kb;
+
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			uintptr_t		b = (uintptr_t)getBase();
+			maptab_t::const_iterator	it;
+
+			ours = false;
+			vma_len = end - start;
+			if (start < b)
+				continue;
+			it = maps.upperEnd(start - b);
+			ours = (it != maps.end() && it->offset.o < end - b);
+			continue;
+		}
+
+		if (!ours)
+			continue;
+
+		if (	sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+			sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+			sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1)
+		{
+			hs.huge += kb * 1024;
+		} else if (strncmp(line, "VmFlags:", 8) == 0) {
+			if (	strstr(line, " hg ") != NULL ||
+				strstr(line, " hg\n") != NULL)
+				hs.advised += vma_len;
+		}
+	}
+
+	fclose(f);
+	return hs;
+}
+
+/* true if the host view has nothing but the guest in [base, base+len) */
+bool GuestMem::canUseRange(guest_ptr base, size_t len) const
+{
+	guest_ptr	cur_ptr(base);
+	guest_ptr	end_ptr(base + len);
+
+	while (cur_ptr < end_ptr) {
+		const Mapping	*m;
+		size_t		test_len;
+
+		/* mapping exists in guest? */
+		m = findOwner(cur_ptr);
+		if (m != NULL) {
+			assert (cur_ptr.o >= m->offset.o);
+			cur_ptr.o += m->length - (cur_ptr.o - m->offset.o);
+			continue;
+		}
+
+		/* the heap's slack and reservation give way */
+		if (top_brick != 0 && cur_ptr >= heapEnd() && cur_ptr < brkEnd()) {
+			cur_ptr = brkEnd();
+			continue;
+		}
+
+		/* check to see if mapping isn't present in host */
+		m = findNextMapping(cur_ptr);
+		test_len = end_ptr - cur_ptr;
+		if (m != NULL) {
+			size_t	gap;
+			assert (m->offset > cur_ptr);
+			gap = m->offset - cur_ptr;
+			if (gap < test_len) test_len = gap;
+		}
+		if (top_brick != 0 && heapEnd() > cur_ptr &&
+			heapEnd() - cur_ptr < test_len)
+		{
+			test_len = heapEnd() - cur_ptr;
+		}
+
+		if (hostBusy(cur_ptr, test_len) != NULL)
+			return false;
+
+		cur_ptr.o += test_len;
+	}
+
+	return true;
+}
+
+/* MAP_FIXED for the guest: it may replace its own memory but never
+   anything else the host has there. A range that's all the guest's or
+   all free is one host call; a mix stakes out the free parts first */
+void* GuestMem::placeFixed(guest_ptr p, size_t len, int prot, int flags,
+	int fd, off_t off)
+{
+	std::vector<guest_ptr>	gaps;
+	guest_ptr		cur(p), e(p + len);
+	void			*desired, *at;
+	size_t			gap_len = 0;
+
+	while (cur < e) {
+		const Mapping	*m;
+		guest_ptr	nx(e), w;
+
+		if ((m = findOwner(cur)) != NULL) {
+			nx = std::min(m->end(), e);
+		} else if (top_brick != 0 && cur >= heapEnd() && cur < brkEnd()) {
+			nx = std::min(brkEnd(), e);
+		} else if ((w = windowEnd(cur)) != 0) {
+			/* held for us; nobody else can be there */
+			nx = std::min(w, e);
+		} else {
+			m = findNextMapping(cur);
+			if (m != NULL && m->offset < nx)
+				nx = m->offset;
+			if (top_brick != 0 && heapEnd() > cur && heapEnd() < nx)
+				nx = heapEnd();
+			gaps.push_back(cur);
+			gaps.push_back(nx);
+			gap_len += nx - cur;
+		}
+		cur = nx;
+	}
+
+	desired = getHostPtr(p);
+	flags &= ~MAP_FIXED;
+
+	if (gaps.empty())
+		return sys_mmap(desired, len, prot, flags | MAP_FIXED, fd, off);
+
+	if (gap_len == len) {
+		at = sys_mmap(desired, len, prot,
+			flags | MAP_FIXED_NOREPLACE, fd, off);
+		if (at == desired)
+			return at;
+		/* kernels before 4.17 take it as a hint */
+		if (at != MAP_FAILED)
+			sys_munmap(at, len);
+		goto busy;
+	}
+
+	if (!canUseRange(p, len)) {
+		viewStale();
+		if (!canUseRange(p, len))
+			goto busy;
+	}
+
+	for (unsigned i = 0; i < gaps.size(); i += 2) {
+		void	*g = getHostPtr(gaps[i]);
+		size_t	g_len = gaps[i+1] - gaps[i];
+
+		at = sys_mmap(g, g_len, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			MAP_FIXED_NOREPLACE, -1, 0);
+		if (at == g)
+			continue;
+
+		if (at != MAP_FAILED)
+			sys_munmap(at, g_len);
+		while (i) {
+			i -= 2;
+			sys_munmap(getHostPtr(gaps[i]), gaps[i+1] - gaps[i]);
+		}
+		goto busy;
+	}
+
+	at = sys_mmap(desired, len, prot, flags | MAP_FIXED, fd, off);
+	if (at == MAP_FAILED) {
+		for (unsigned i = 0; i < gaps.size(); i += 2)
+			sys_munmap(getHostPtr(gaps[i]), gaps[i+1] - gaps[i]);
+	}
+	return at;
+
+busy:
+	viewStale();
+	errno = ENOMEM;
+	return MAP_FAILED;
+}
+
+/* map at exactly 'p' if nothing's there, or fail with EEXIST */
+void* GuestMem::placeFree(guest_ptr p, size_t len, int prot, int flags,
+	int fd, off_t off)
+{
+	void	*desired = getHostPtr(p), *at;
+
+	if (inWindow(p, len)) {
+		if (!guestFree(p, len)) {
+			errno = EEXIST;
+			return MAP_FAILED;
+		}
+		return sys_mmap(desired, len, prot, flags | MAP_FIXED, fd, off);
+	}
+
+	at = sys_mmap(desired, len, prot, flags | MAP_FIXED_NOREPLACE, fd, off);
+	if (at == desired || at == MAP_FAILED)
+		return at;
+
+	/* kernels before 4.17 take it as a hint */
+	sys_munmap(at, len);
+	errno = EEXIST;
+	return MAP_FAILED;
+}
+
+/* no guest mapping or heap reservation in [p, p+len) */
+bool GuestMem::guestFree(guest_ptr p, size_t len) const
+{
+	const Mapping	*m;
+
+	if (findOwner(p) != NULL)
+		return false;
+
+	m = findNextMapping(p);
+	if (m != NULL && m->offset < p + len)
+		return false;
+
+	return top_brick == 0 || p >= brkEnd() || p + len <= heapEnd();
+}
+
+/* every page of [p, p+len) in some guest mapping; the host holding
+   them (the window, the heap's slack and reservation) isn't enough */
+bool GuestMem::guestMapped(guest_ptr p, size_t len) const
+{
+	maptab_t::const_iterator	it;
+	guest_ptr			e(p + len);
+
+	for (it = maps.upperEnd(p); p < e; ++it) {
+		if (it == maps.end() || it->offset > p)
+			return false;
+		p = it->end();
+	}
+	return true;
+}
+
+int GuestMem::mprotect(guest_ptr p, size_t len, int prot)
+{
+	int	err;
+
+	if ((p & (PAGE_SIZE - 1))) return -EINVAL;
+	if ((len & (PAGE_SIZE - 1))) return -EINVAL;
+
+	if (!guestMapped(p, len)) return -ENOMEM;
 
 	Mapping m(p, len, prot);
 	if (m.req_prot & PROT_WRITE)
 		m.cur_prot &= ~PROT_EXEC;
 
-	err = sys_mprotect(getHostPtr(p), len, m.cur_prot);
-	if (err < 0) return -errno;
+	err = sys_mprotect(getHostPtr(p), len, m.cur_prot);
+	if (err < 0) return -errno;
+
+	noteChanged(p, len);
+	recordMapping(m);
+	return 0;
+}
+
+int GuestMem::munmap(guest_ptr addr, size_t len)
+{
+	Mapping m(addr, len, 0);
+	Mapping cur_mapping;
+	int	err;
+
+	if ((addr & (PAGE_SIZE - 1))) return -EINVAL;
+
+	// old behavior was to return an -EINVAL on a
+	// non-multiple of PAGE_SIZE, correct behavior is given by man page:
+	// "All pages containing a part of the indicated range are unmapped"
+	len = (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+
+	/* TODO make sure this is a real mapped region in a better
+	   way then if munmap fails? */
+	if (!isMapped(addr)) {
+		std::cerr << "[Guest] trying to munmap missing mapping: ";
+		m.print(std::cerr);
+	}
+
+	err = releaseHost(addr, len);
+	if (err < 0)
+		return -errno;
+
+	clearBacking(addr, addr + len);
+	dropShadow(addr, addr + len);
+	trimBrk(addr, addr + len);
+	noteChanged(addr, len);
+	removeMapping(m);
+	return 0;
+}
+
+void* GuestMem::sys_mmap(void* p, size_t len, int prot, int fl,
+	int fd, off_t off) const
+{
+	void	*at = ::mmap(p, len, prot, fl, fd, off);
+	if (at != MAP_FAILED) viewAdd(at, len);
+	return at;
+}
+
+int GuestMem::sys_munmap(void* p, size_t len) const
+{
+	int	err = ::munmap(p, len);
+	if (err == 0) viewDel(p, len);
+	return err;
+}
+
+int GuestMem::sys_mprotect(void* p, size_t len, int prot) const
+{ return ::mprotect(p, len, prot); }
+
+void* GuestMem::sys_mremap(
+	void* old, size_t oldsz, size_t newsz, int fl, void* new_addr) const
+{
+	void	*at = ::mremap(old, oldsz, newsz, fl, new_addr);
+	if (at != MAP_FAILED) {
+		viewDel(old, oldsz);
+		viewAdd(at, newsz);
+	}
+	return at;
+}
+
+const GuestMem::hostview_t& GuestMem::hostView(void) const
+{
+	std::vector<GuestArena::HostMap>	hms;
+
+	if (!view_stale)
+		return host_view;
+
+	host_view.clear();
+	if (!GuestArena::readHostMaps(hms))
+		return host_view;
+
+	view_stale = false;
+	for (const auto &hm : hms)
+		viewAdd((void*)hm.start, hm.end - hm.start);
+	return host_view;
+}
+
+/* first thing the host has in [p, p+len), if the view knows of any */
+const GuestMem::HostSpan* GuestMem::hostBusy(guest_ptr p, size_t len) const
+{
+	hostview_t::const_iterator	it;
+
+	if (!host_backed)
+		return NULL;
+
+	const hostview_t	&v = hostView();
+
+	/* what we hold for the window doesn't count */
+	for (it = v.upperEnd(p); it != v.end() && it->offset < p + len; ++it) {
+		guest_ptr	b(std::max(it->offset, p));
+		guest_ptr	e(std::min(it->end(), p + len));
+
+		if (!inWindow(b, e - b))
+			return &*it;
+	}
+
+	return NULL;
+}
+
+/* hold the guest's 4GB from the host, PROT_NONE and uncommitted, so
+   nothing else can land in it. In flat mode the low 4GB is the host's
+   too, so only what's free gets held, clear of its brk */
+void GuestMem::reserveWindow(void)
+{
+	std::vector<guest_ptr>		gaps;
+	hostview_t::const_iterator	it;
+	guest_ptr			lo(MMAP_FLOOR), hi(WINDOW_END), cur;
+
+	want_window = false;
+	if (!host_backed || !window.empty())
+		return;
+
+	if (getBase() == NULL) {
+		uintptr_t	host_brk = (uintptr_t)::sbrk(0);
+		if (host_brk < hi)
+			lo = std::max(lo, pageUp(guest_ptr(host_brk + BRK_RESERVE)));
+		if (lo >= hi)
+			return;
+	}
+
+	if (holdSpan(lo, hi - lo))
+		return;
+
+	/* something's in there already; hold what's around it */
+	viewStale();
+	const hostview_t	&v = hostView();
+
+	cur = lo;
+	for (it = v.upperEnd(lo); it != v.end() && it->offset < hi; ++it) {
+		if (it->offset > cur) {
+			gaps.push_back(cur);
+			gaps.push_back(it->offset);
+		}
+		cur = it->end();
+	}
+	if (cur < hi) {
+		gaps.push_back(cur);
+		gaps.push_back(hi);
+	}
+
+	for (unsigned i = 0; i < gaps.size(); i += 2)
+		holdSpan(gaps[i], gaps[i+1] - gaps[i]);
+}
+
+bool GuestMem::holdSpan(guest_ptr p, size_t len)
+{
+	void	*d = getHostPtr(p), *at;
+
+	at = sys_mmap(d, len, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+		MAP_FIXED_NOREPLACE, -1, 0);
+	if (at != d) {
+		if (at != MAP_FAILED) sys_munmap(at, len);
+		return false;
+	}
+
+	window.insert(window.upperEnd(p), HostSpan{p, len});
+	return true;
+}
+
+/* the host dropped [p, p+len); take back the parts in the window */
+void GuestMem::rehold(guest_ptr p, size_t len)
+{
+	hostview_t::const_iterator	it;
+	guest_ptr			e(p + len);
+
+	for (it = window.upperEnd(p); it != window.end() && it->offset < e; ++it) {
+		guest_ptr	b(std::max(it->offset, p));
+		guest_ptr	we(std::min(it->end(), e));
+
+		sys_mmap(getHostPtr(b), we - b, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			MAP_FIXED, -1, 0);
+	}
+}
+
+/* unmap [p, p+len) for the guest; in the window the pages go back to
+   the hold instead of the host */
+int GuestMem::releaseHost(guest_ptr p, size_t len)
+{
+	void	*at;
+
+	if (inWindow(p, len)) {
+		at = sys_mmap(getHostPtr(p), len, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			MAP_FIXED, -1, 0);
+		return (at == MAP_FAILED) ? -1 : 0;
+	}
+
+	if (sys_munmap(getHostPtr(p), len) < 0)
+		return -1;
+	rehold(p, len);
+	return 0;
+}
+
+/* end of the window span holding 'p', or 0 */
+guest_ptr GuestMem::windowEnd(guest_ptr p) const
+{
+	const HostSpan	*w = window.find(p);
+	return (w != NULL) ? w->end() : guest_ptr(0);
+}
+
+void GuestMem::viewAdd(const void* p, size_t len) const
+{
+	uintptr_t		b = (uintptr_t)p, e, base = (uintptr_t)getBase();
+	hostview_t::iterator	it;
+
+	if (view_stale)
+		return;
+
+	viewDel(p, len);
+
+	e = b + ((len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1));
+	if (e <= base)
+		return;
+	b = std::max(b, base);
+
+	it = host_view.upperEnd(b - base);
+	host_view.insert(it, HostSpan{guest_ptr(b - base), e - b});
+}
+
+void GuestMem::viewDel(const void* p, size_t len) const
+{
+	uintptr_t		b = (uintptr_t)p, e, base = (uintptr_t)getBase();
+	hostview_t::iterator	it;
+	guest_ptr		gb, ge;
+
+	if (view_stale)
+		return;
+
+	e = b + ((len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1));
+	if (e <= base)
+		return;
+	gb = guest_ptr(std::max(b, base) - base);
+	ge = guest_ptr(e - base);
+
+	it = host_view.upperEnd(gb);
+	if (it == host_view.end())
+		return;
+
+	if (it->offset < gb) {
+		if (it->end() > ge) {
+			HostSpan	tail{ge, it->end() - ge};
+
+			it->length = gb - it->offset;
+			host_view.update(it);
+			host_view.insert(++it, tail);
+			return;
+		}
+
+		it->length = gb - it->offset;
+		host_view.update(it);
+		++it;
+	}
+
+	while (it != host_view.end() && it->end() <= ge)
+		it = host_view.erase(it);
+
+	if (it != host_view.end() && it->offset < ge) {
+		it->length -= ge - it->offset;
+		it->offset = ge;
+		host_view.update(it);
+	}
+}
+
+
+/* move 'm' somewhere it fits as 'n'. The new spot is staked out before
+   MREMAP_FIXED goes over it, so a stale view can't clobber anything */
+void* GuestMem::relocate(const Mapping& m, Mapping& n)
+{
+	void	*src = getHostPtr(m.offset), *d, *at;
+
+	if (force_flat && host_backed && window.empty() && !wantsHuge(n.length))
+		return sys_mremap(src, m.length, n.length, MREMAP_MAYMOVE);
+
+	for (unsigned i = 0; i < 2; i++) {
+		if (!findFreeRegion(n.length, n))
+			break;
+
+		/* the window's hold is staked out already */
+		d = getHostPtr(n.offset);
+		if (inWindow(n.offset, n.length))
+			return sys_mremap(src, m.length, n.length,
+				MREMAP_MAYMOVE | MREMAP_FIXED, d);
+
+		at = sys_mmap(d, n.length, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			MAP_FIXED_NOREPLACE, -1, 0);
+		if (at == d) {
+			at = sys_mremap(src, m.length, n.length,
+				MREMAP_MAYMOVE | MREMAP_FIXED, d);
+			if (at == MAP_FAILED)
+				sys_munmap(d, n.length);
+			return at;
+		}
+
+		if (at != MAP_FAILED)
+			sys_munmap(at, n.length);
+		viewStale();
+	}
+
+	errno = ENOMEM;
+	return MAP_FAILED;
+}
+
+/* XXX I haven't audited this, so it's very likely that it's wrong. -AJR */
+int GuestMem::mremap(
+	guest_ptr& result, guest_ptr old_offset,
+	size_t old_length, size_t new_length, int flags, guest_ptr new_offset)
+{
+	void	*desired, *at;
+	Mapping	m;
+	bool	zero_tail, tail_held;
+
+	if ((old_offset & (PAGE_SIZE - 1))) return -EINVAL;
+	if ((old_length & (PAGE_SIZE - 1))) return -EINVAL;
+	if ((new_length & (PAGE_SIZE - 1))) return -EINVAL;
+
+	if (flags & MREMAP_FIXED && (new_offset & (PAGE_SIZE - 1)))
+		return -EINVAL;
+
+	bool fixed = flags & MREMAP_FIXED;
+	bool maymove = flags & MREMAP_MAYMOVE;
+
+	if (!maymove && fixed && old_offset != new_offset)
+		return -EINVAL;
+
+	if (!lookupMapping(old_offset, m))
+		return -EINVAL;
+
+	if (old_offset != m.offset) return -EINVAL;
+	if (old_length != m.length) return -EINVAL;
+
+	Mapping n = m;
+	/* the next mapping over, if growing in place would run into it */
+	maptab_t::const_iterator next = cmaps().lowerBound(m.end());
+	bool in_the_way = next != maps.cend() &&
+		next->offset < m.offset + new_length;
+
+	if(!fixed && !maymove) {
+		if (in_the_way)
+			return -ENOMEM;
+		n.length = new_length;
+	} else if (fixed) {
+		n.offset = new_offset;
+		n.length = new_length;
+	} else if (maymove) {
+		/* try in place first; the host picking some other
+		   spot would leave the guest address behind */
+		n.length = new_length;
+		flags &= ~MREMAP_MAYMOVE;
+	}
+
+	/* growing a mapping of the arena pulls in whatever follows it in
+	   the file; the guest expects fresh zeroes */
+	zero_tail = n.length > m.length &&
+		backing.find(m.end() - PAGE_SIZE) != NULL;
+
+	/* growing in place over the window's hold needs it let go first */
+	tail_held = n.offset == m.offset && n.length > m.length &&
+		inWindow(m.end(), n.length - m.length) &&
+		guestFree(m.end(), n.length - m.length);
+	if (tail_held)
+		sys_munmap(getHostPtr(m.end()), n.length - m.length);
+
+	/* the host won't remap across protections; watched pages and
+	   clean ones under mprotect dirty tracking split it */
+	if (dirty_log != nullptr)
+		dirty_log->release(m.offset, m.length);
+	if (code_log != nullptr)
+		code_log->unwatch(m.offset, m.end());
+	if (watch_log != nullptr)
+		watch_log->drop(m.offset, m.end(), true);
+
+	desired = getHostPtr(n.offset);
+	at = MAP_FAILED;
+	errno = ENOMEM;
+	if (!(maymove && !fixed && in_the_way))
+		at = sys_mremap(getHostPtr(m.offset), m.length, n.length,
+			flags, desired);
+
+	if (at == MAP_FAILED && tail_held) {
+		int	err = errno;
+		rehold(m.end(), n.length - m.length);
+		errno = err;
+	}
+
+	/* host memory in the way; move after all */
+	if (at == MAP_FAILED && errno == ENOMEM && maymove && !fixed)
+		at = relocate(m, n);
+
+	if (at == MAP_FAILED)
+		return -errno;
+	assert ((at == desired || (maymove && !fixed)) && "mremap moved");
+	n.offset = guest_ptr((char*)at - getBase());
+
+	/* whatever the host let go of in the window is held again */
+	if (n.offset != m.offset)
+		rehold(m.offset, m.length);
+	else if (n.length < m.length)
+		rehold(n.end(), m.length - n.length);
+
+	if (n.length < m.length) {
+		clearBacking(m.offset + n.length, m.end());
+		dropShadow(m.offset + n.length, m.end());
+	}
+	if (n.offset != m.offset) {
+		moveBacking(m.offset, std::min(m.length, n.length), n.offset);
+		moveShadow(m.offset, std::min(m.length, n.length), n.offset);
+	}
+	if (n.length > m.length) {
+		clearBacking(n.offset + m.length, n.end());
+		dropShadow(n.offset + m.length, n.end());
+	}
+
+	if (zero_tail) {
+		at = mapAnon(
+			n.offset + m.length,
+			n.length - m.length,
+			n.cur_prot,
+			MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS);
+		assert (at != MAP_FAILED && "could not clear grown tail");
+	}
+
+	result = n.offset;
+	noteChanged(m.offset, m.length);
+	noteChanged(n.offset, n.length);
+	/* readers see the move all at once */
+	publish_held = true;
+	removeMapping(m);
+	recordMapping(n);
+	publish_held = false;
+	tableChanged();
+	return 0;
+}
+
+void GuestMem::setType(guest_ptr addr, GuestMem::Mapping::MapType mt)
+{
+	maptab_t::iterator	it;
+	Mapping			*m;
+
+	assert (mt != Mapping::VSYSPAGE);
+
+	it = maps.lowerBound(addr);
+	assert (it != maps.end() && "Setting type for unmapped guest addr");
+
+	m = &*it;
+	m->type = mt;
+
+	if (mt == Mapping::HEAP) {
+		base_brick = m->offset;
+		top_brick = commit_brick = m->end();
+	}
+	tableChanged();
+}
+
+const void* GuestMem::getSysHostAddr(guest_ptr p) const
+{
+	const Mapping	*owner;
+
+	owner = findOwner(p);
+	if (owner == NULL) return NULL;
+	if (owner->type != Mapping::VSYSPAGE) return NULL;
+
+	return (const void*)(syspage_data + (p.o - owner->offset.o));
+}
+
+void GuestMem::addSysPage(guest_ptr p, char* host_data, size_t len)
+{
+	GuestMem::Mapping	m(p, len, PROT_READ | PROT_EXEC);
+	void			*mmap_ret;
+
+//	assert (host_data && syspage_data == NULL);
+	if (syspage_data == NULL) {
+		syspage_data = host_data;
+		syspage_len = len;
+	}
+
+	m.type = Mapping::VSYSPAGE;
+	recordMapping(m);
+
+	if (getBase() == NULL)
+		return;
+
+	/* try to map it in if relocated */
+	holdWindow();
+	mmap_ret = sys_mmap(
+		getHostPtr(m.offset),
+		len,
+		PROT_READ | PROT_EXEC | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS |
+			(inWindow(m.offset, len) ? MAP_FIXED : 0),
+		-1,
+		0);
+	assert (mmap_ret != MAP_FAILED);
+	memcpy(m.offset, host_data, len);
+}
+
+/* hands [p, p+len) to f(host, off, n) one readable piece at a time. f
+   returns how much of its piece it got through; stopping short ends the
+   scan. returns the total, or -EFAULT on hitting unreadable memory */
+template <typename F>
+ssize_t GuestMem::scanGuest(guest_ptr p, size_t len, F f) const
+{
+	TabReader	t(*this);
+	char		buf[SCAN_CHUNK];
+	size_t		off = 0;
+
+	while (off < len) {
+		const Mapping	*m;
+		const char	*h;
+		guest_ptr	cur(p + off);
+		size_t		n, used;
+
+		m = t->find(cur);
+		if (m == NULL || !(m->cur_prot & PROT_READ))
+			return -EFAULT;
+
+		n = std::min(len - off, (size_t)(m->end() - cur));
+		if (m->type == Mapping::VSYSPAGE && syspage_data != NULL) {
+			h = syspage_data + (cur - m->offset);
+		} else if (host_backed) {
+			h = base + cur.o;
+		} else {
+			n = std::min(n, sizeof(buf));
+			memcpy(buf, cur, n);
+			h = buf;
+		}
+
+		used = f(h, off, n);
+		off += used;
+		if (used < n)
+			break;
+	}
+
+	return off;
+}
+
+/* libc's memchr/memcmp are already vectorized; the work here is in
+   handing them whole mapping-sized runs */
+ssize_t GuestMem::strnlen(guest_ptr p, size_t max) const
+{ return memchr(p, 0, max); }
+
+ssize_t GuestMem::memchr(guest_ptr p, int c, size_t len) const
+{
+	return scanGuest(p, len,
+		[c] (const char* h, size_t off, size_t n) -> size_t {
+			const char *hit = (const char*)::memchr(h, c, n);
+			return hit ? hit - h : n;
+		});
+}
+
+ssize_t GuestMem::readString(guest_ptr p, char* buf, size_t len) const
+{
+	ssize_t	n;
+	size_t	got = 0;
+
+	if (len == 0)
+		return -EINVAL;
+
+	n = scanGuest(p, len - 1,
+		[buf, &got] (const char* h, size_t off, size_t n) -> size_t {
+			const char	*nul = (const char*)::memchr(h, 0, n);
+			size_t		c = nul ? nul - h : n;
+			::memcpy(buf + off, h, c);
+			got = off + c;
+			return c;
+		});
+
+	/* terminated even on a fault, so callers can keep the prefix */
+	buf[got] = '\0';
+	return (n < 0) ? n : (ssize_t)got;
+}
+
+std::string GuestMem::readString(guest_ptr p) const
+{
+	std::string	ret;
+	char		buf[256];
+	ssize_t		n;
+
+	do {
+		n = readString(p + ret.size(), buf, sizeof(buf));
+		if (n < 0) {
+			ret.append(buf);
+			break;
+		}
+		ret.append(buf, n);
+	} while (n == sizeof(buf) - 1);
+
+	return ret;
+}
+
+int GuestMem::memcmp(guest_ptr p, const void* s, size_t len, int& diff) const
+{
+	ssize_t	n;
+
+	diff = 0;
+	n = scanGuest(p, len,
+		[s, &diff] (const char* h, size_t off, size_t n) -> size_t {
+			diff = ::memcmp(h, (const char*)s + off, n);
+			return diff ? 0 : n;
+		});
+
+	return (n < 0) ? n : 0;
+}
+
+int GuestMem::readNatives(guest_ptr p, uintptr_t* out, unsigned n) const
+{
+	int	err = 0;
+
+	withWidth([&] (auto v) {
+		typedef typename decltype(v)::word_t	word_t;
+		ssize_t	got;
+
+		got = scanGuest(p, (size_t)n * sizeof(word_t),
+			[out] (const char* h, size_t off, size_t c) -> size_t {
+				::memcpy((char*)out + off, h, c);
+				return c;
+			});
+		if (got < 0) {
+			err = got;
+			return;
+		}
+
+		/* widen in place, back to front */
+		if (sizeof(word_t) != sizeof(*out)) {
+			for (unsigned i = n; i > 0; i--) {
+				word_t	w;
+				::memcpy(&w, (const char*)out + (i-1)*sizeof(w), sizeof(w));
+				out[i-1] = w;
+			}
+		}
+	});
+
+	return err;
+}
+
+int GuestMem::readNativeChecked(guest_ptr p, uintptr_t& v, int idx) const
+{
+	if (is_32_bit)
+		return GuestView<uint32_t, const GuestMem>(*this)
+			.readNativeChecked(p, v, idx);
+	return GuestView<uint64_t, const GuestMem>(*this)
+		.readNativeChecked(p, v, idx);
+}
+
+/* all or nothing; no partial copies */
+int GuestMem::memcpyChecked(void* dest, guest_ptr src, size_t len) const
+{
+	if (!perms.allows(src, len, PROT_READ))
+		return -EFAULT;
+	memcpy(dest, src, len);
+	return 0;
+}
 
-	recordMapping(m);
+int GuestMem::memcpyChecked(guest_ptr dest, const void* src, size_t len)
+{
+	if (!perms.allows(dest, len, PROT_WRITE))
+		return -EFAULT;
+	memcpy(dest, src, len);
 	return 0;
 }
 
-int GuestMem::munmap(guest_ptr addr, size_t len)
+void GuestMem::nameMapping(guest_ptr addr, const std::string& s)
 {
-	Mapping m(addr, len, 0);
-	Mapping cur_mapping;
-	int	err;
+	GuestMem::Mapping* m;
 
-	if ((addr & (PAGE_SIZE - 1))) return -EINVAL;
+	if (s.size() == 0)
+		return;
 
-	// old behavior was to return an -EINVAL on a
-	// non-multiple of PAGE_SIZE, correct behavior is given by man page:
-	// "All pages containing a part of the indicated range are unmapped"
-	len = (len + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+	if ((m = maps.find(addr)) == NULL)
+		return;
 
-	/* TODO make sure this is a real mapped region in a better
-	   way then if munmap fails? */
-	if (!isMapped(addr)) {
-		std::cerr << "[Guest] trying to munmap missing mapping: ";
-		m.print(std::cerr);
+	unindexName(*m);
+	m->name = internName(s);
+	indexName(*m);
+	tableChanged();
+}
+
+void GuestMem::import(GuestMem* m) { assert (0 == 1 && "STUB"); }
+
+bool GuestMem::setMemfdBacking(bool on)
+{
+	if (on && arena == nullptr && (arena = GuestArena::create()) == nullptr)
+		return false;
+
+	memfd_backed = on;
+	return true;
+}
+
+int GuestMem::getBackingFd(guest_ptr p, off_t& off) const
+{
+	const Backing	*bk;
+
+	bk = backing.find(p);
+	if (bk == NULL || !bk->live)
+		return -1;
+
+	off = bk->file_off + (p - bk->offset);
+	return arena->getFd();
+}
+
+/* bytes from h, up to n, before a page that is (or isn't) all zero */
+static size_t pageRun(const char* h, size_t n, bool zero)
+{
+	size_t	off;
+
+	for (off = 0; off < n; off += PAGE_SIZE) {
+		size_t	c = std::min<size_t>(PAGE_SIZE, n - off);
+		bool	z = h[off] == 0 && ::memcmp(h + off, h + off + 1, c - 1) == 0;
+		if (z != zero)
+			break;
 	}
 
-	err = sys_munmap(getHostPtr(addr), len);
-	if (err < 0)
-		return -errno;
+	return std::min(off, n);
+}
+
+int GuestMem::copyToFile(
+	int fd, off_t fd_off, guest_ptr p, size_t len, bool sparse) const
+{
+	char	buf[SCAN_CHUNK * 8];
+	off_t	fd_end = fd_off + len;
+
+	while (len) {
+		backtab_t::const_iterator	it;
+		size_t				n = len;
+		ssize_t				sz;
+
+		/* our own arena pages go file to file */
+		it = backing.upperEnd(p);
+		if (it != backing.end() && it->offset <= p && it->live) {
+			n = std::min<size_t>(len, it->end() - p);
+			if (arena->copyOut(it->file_off + (p - it->offset),
+				fd, fd_off, n) == 0)
+			{
+				p.o += n;
+				fd_off += n;
+				len -= n;
+				continue;
+			}
+		} else if (it != backing.end() && it->offset < p + len)
+			n = it->offset - p;
+
+		if (host_backed) {
+			const char	*h = (const char*)getHostPtr(p);
+
+			if (sparse && (sz = pageRun(h, n, true)) != 0) {
+				/* zero pages stay a hole */
+			} else {
+				if (sparse)
+					n = pageRun(h, n, false);
+				sz = pwrite(fd, h, n, fd_off);
+				if (sz <= 0)
+					return (sz < 0) ? -errno : -EIO;
+			}
+		} else {
+			sz = std::min<size_t>(n, sizeof(buf));
+			memcpy(buf, p, sz);
+			sz = pwrite(fd, buf, sz, fd_off);
+			if (sz <= 0)
+				return (sz < 0) ? -errno : -EIO;
+		}
+
+		p.o += sz;
+		fd_off += sz;
+		len -= sz;
+	}
+
+	/* trailing holes */
+	if (sparse) {
+		struct stat	s;
+		if (fstat(fd, &s) != 0)
+			return -errno;
+		if (s.st_size < fd_end && ftruncate(fd, fd_end) != 0)
+			return -errno;
+	}
 
-	removeMapping(m);
 	return 0;
 }
 
-void* GuestMem::sys_mmap(void* p, size_t len, int prot, int fl,
-	int fd, off_t off) const
-{ return ::mmap(p, len, prot, fl, fd, off); }
+/* fresh private anonymous memory; out of the arena if memfd backing
+   is on */
+void* GuestMem::mapAnon(guest_ptr p, size_t len, int prot, int flags)
+{
+	off_t	off = -1;
+	void	*at;
+
+	if (memfd_backed && host_backed)
+		off = arena->alloc(len, arena_holds);
+	if (off < 0)
+		return sys_mmap(getHostPtr(p), len, prot,
+			flags | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	flags &= ~(MAP_ANONYMOUS | MAP_TYPE);
+	at = sys_mmap(getHostPtr(p), len, prot, flags | MAP_SHARED,
+		arena->getFd(), off);
+	if (at == MAP_FAILED)
+		return at;
+
+	p = guest_ptr((char*)at - getBase());
+	clearBacking(p, p + len);
+	addBacking(p, len, off, true);
+	return at;
+}
 
-int GuestMem::sys_munmap(void* p, unsigned len) const
-{ return ::munmap(p, len); }
+void GuestMem::addBacking(guest_ptr p, size_t len, off_t file_off, bool live)
+{
+	backtab_t::iterator	it;
 
-int GuestMem::sys_mprotect(void* p, size_t len, int prot) const
-{ return ::mprotect(p, len, prot); }
+	it = backing.upperEnd(p);
+	if (it != backing.begin()) {
+		backtab_t::iterator	prev(it);
 
-void* GuestMem::sys_mremap(
-	void* old, size_t oldsz, size_t newsz, int fl, void* new_addr) const
-{ return ::mremap(old, oldsz, newsz, fl, new_addr); }
+		--prev;
+		if (	prev->end() == p && prev->live == live &&
+			prev->file_off + (off_t)prev->length == file_off)
+		{
+			prev->length += len;
+			backing.update(prev);
+			return;
+		}
+	}
 
+	backing.insert(it, Backing{p, len, file_off, live});
+}
 
-/* XXX I haven't audited this, so it's very likely that it's wrong. -AJR */
-int GuestMem::mremap(
-	guest_ptr& result, guest_ptr old_offset,
-	size_t old_length, size_t new_length, int flags, guest_ptr new_offset)
+/* forget [b, e); file pages only we could see go back to the host */
+void GuestMem::clearBacking(guest_ptr b, guest_ptr e, bool punch)
 {
-	void	*desired, *at;
-	Mapping	m;
+	backtab_t::iterator	it;
 
-	if ((old_offset & (PAGE_SIZE - 1))) return -EINVAL;
-	if ((old_length & (PAGE_SIZE - 1))) return -EINVAL;
-	if ((new_length & (PAGE_SIZE - 1))) return -EINVAL;
+	if (backing.empty())
+		return;
 
-	if (flags & MREMAP_FIXED && (new_offset & (PAGE_SIZE - 1)))
-		return -EINVAL;
+	auto drop = [this, punch] (const Backing& bk, guest_ptr lo, guest_ptr hi) {
+		if (punch && bk.live)
+			arena->punch(bk.file_off + (lo - bk.offset), hi - lo);
+	};
 
-	bool fixed = flags & MREMAP_FIXED;
-	bool maymove = flags & MREMAP_MAYMOVE;
+	it = backing.upperEnd(b);
+	if (it == backing.end())
+		return;
 
-	if (!maymove && fixed && old_offset != new_offset)
-		return -EINVAL;
+	if (it->offset < b) {
+		if (it->end() > e) {
+			Backing	tail(*it);
+
+			drop(*it, b, e);
+			tail.offset = e;
+			tail.length = it->end() - e;
+			tail.file_off += e - it->offset;
+			it->length = b - it->offset;
+			backing.update(it);
+			backing.insert(++it, tail);
+			return;
+		}
 
-	if (!lookupMapping(old_offset, m))
-		return -EINVAL;
+		drop(*it, b, it->end());
+		it->length = b - it->offset;
+		backing.update(it);
+		++it;
+	}
 
-	if (old_offset != m.offset) return -EINVAL;
-	if (old_length != m.length) return -EINVAL;
+	while (it != backing.end() && it->end() <= e) {
+		drop(*it, it->offset, it->end());
+		it = backing.erase(it);
+	}
 
-	Mapping n = m;
-	if(!fixed && !maymove) {
-		mapmap_t::iterator it = maps.lower_bound(m.offset + new_length);
-		if (	it != maps.end() &&
-			it->second->offset < m.offset + new_length)
-		{
-			return -ENOMEM;
+	if (it != backing.end() && it->offset < e) {
+		drop(*it, it->offset, e);
+		it->file_off += e - it->offset;
+		it->length -= e - it->offset;
+		it->offset = e;
+		backing.update(it);
+	}
+}
+
+/* the host moved [from, from+len) to 'to'; file offsets go with it */
+void GuestMem::moveBacking(guest_ptr from, size_t len, guest_ptr to)
+{
+	std::vector<Backing>	moved;
+	guest_ptr		e(from + len);
+
+	for (	auto it = backing.upperEnd(from);
+		it != backing.end() && it->offset < e;
+		++it)
+	{
+		Backing	bk(*it);
+
+		if (bk.offset < from) {
+			bk.file_off += from - bk.offset;
+			bk.length -= from - bk.offset;
+			bk.offset = from;
 		}
-		n.length = new_length;
-	} else if (fixed) {
-		n.offset = new_offset;
-		n.length = new_length;
-	} else if (maymove) {
-		mapmap_t::iterator i =
-			maps.lower_bound(m.offset + new_length);
-		if(i != maps.end() &&
-			i->second->offset < m.offset + new_length)
-		{
-			if(!findFreeRegion(new_length, n)) {
-				return -ENOMEM;
-			}
+		if (bk.end() > e)
+			bk.length = e - bk.offset;
+		moved.push_back(bk);
+	}
+
+	clearBacking(from, e, false);
+	clearBacking(to, to + len);
+	for (const auto &bk : moved)
+		addBacking(to + (bk.offset - from), bk.length,
+			bk.file_off, bk.live);
+}
+
+GuestShadow* GuestMem::addShadow(size_t page_bytes)
+{
+	shadows.emplace_back(new GuestShadow(page_bytes));
+	return shadows.back().get();
+}
+
+void GuestMem::removeShadow(GuestShadow* s)
+{
+	for (auto it = shadows.begin(); it != shadows.end(); ++it) {
+		if (it->get() == s) {
+			shadows.erase(it);
+			return;
 		}
-		fixed = true;
-		flags |= MREMAP_FIXED;
 	}
+	assert (0 == 1 && "not our shadow");
+}
 
-	desired = getHostPtr(n.offset);
-	at = sys_mremap(getHostPtr(m.offset), m.length, n.length, flags, desired);
+void GuestMem::dropShadow(guest_ptr b, guest_ptr e)
+{ for (auto &s : shadows) s->drop(b, e); }
 
-	/* if something was allowed to move, then it would have become
-	   fixed, so this can only be map failed or the correct address */
-	if (at != desired) {
-		assert(at == MAP_FAILED);
-		return -errno;
+void GuestMem::moveShadow(guest_ptr from, size_t len, guest_ptr to)
+{ for (auto &s : shadows) s->move(from, len, to); }
+
+/* hand [p, p+len) to clone 'c' through the arena. Pages not already in
+   the arena are copied in and, unless the host mapping is shared, we
+   switch over to the arena copy too */
+int GuestMem::cloneRange(GuestMem& c, const GuestArena::HostMap& hm,
+	char* p, size_t len, int prot, int pagemap_fd)
+{
+	guest_ptr	g(p - getBase());
+	off_t		off = -1;
+	void		*at;
+	int		err;
+
+	if (arena->owns(hm)) {
+		off = hm.off + (p - (char*)hm.start);
+		if (!hm.shared && GuestArena::hasPrivatePages(pagemap_fd, p, len))
+			off = -1;
 	}
 
-	result = n.offset;
-	removeMapping(m);
-	recordMapping(n);
+	if (off < 0) {
+		bool	fresh = !hm.shared || arena->owns(hm);
+
+		off = arena->alloc(len, fresh ? arena_holds : c.arena_holds);
+		if (off < 0)
+			return off;
+
+		if (!(hm.prot & PROT_READ))
+			sys_mprotect(p, len, hm.prot | PROT_READ);
+		/* untouched anonymous pages are zero; leave them as holes */
+		err = arena->copyIn(off, p, len, (hm.ino == 0) ? pagemap_fd : -1);
+		if (!(hm.prot & PROT_READ))
+			sys_mprotect(p, len, hm.prot);
+		if (err < 0)
+			return err;
+
+		if (fresh) {
+			at = sys_mmap(p, len, hm.prot,
+				MAP_PRIVATE | MAP_FIXED, arena->getFd(), off);
+			if (at == MAP_FAILED)
+				return -errno;
+			clearBacking(g, g + len, false);
+			addBacking(g, len, off, false);
+		}
+	} else if (hm.shared) {
+		/* nobody may write through to pages a clone can see */
+		at = sys_mmap(p, len, hm.prot,
+			MAP_PRIVATE | MAP_FIXED, arena->getFd(), off);
+		if (at == MAP_FAILED)
+			return -errno;
+		clearBacking(g, g + len, false);
+		addBacking(g, len, off, false);
+	}
+
+	at = c.sys_mmap(c.getHostPtr(g), len, prot,
+		MAP_PRIVATE | MAP_FIXED, arena->getFd(), off);
+	if (at == MAP_FAILED)
+		return -errno;
+
+	arena->hold(off, c.arena_holds);
+	c.addBacking(g, len, off, false);
 	return 0;
 }
 
-void GuestMem::setType(guest_ptr addr, GuestMem::Mapping::MapType mt)
+GuestMem* GuestMem::clone(void)
 {
-	mapmap_t::iterator	it;
-	Mapping			*m;
+	std::vector<GuestArena::HostMap>		hms;
+	std::vector<GuestArena::HostMap>::const_iterator	hm;
+	std::vector<Mapping>				v;
+	maptab_t::const_iterator			it;
+	GuestMem					*c;
+	guest_ptr					lo, hi, keep;
+	char						*res;
+	void						*at;
+	size_t						span;
+	int						pm_fd, err = 0;
+
+	if (!host_backed)
+		return NULL;
 
-	assert (mt != Mapping::VSYSPAGE);
+	/* the null page is only bookkeeping; leave it out of the span */
+	it = maps.cbegin();
+	if (it != maps.cend() && it->offset == 0)
+		++it;
+	if (it == maps.cend())
+		return NULL;
 
-	it = maps.lower_bound(addr);
-	assert (it != maps.end() && "Setting type for unmapped guest addr");
+	if (arena == nullptr && (arena = GuestArena::create()) == nullptr)
+		return NULL;
 
-	m = it->second;
-	m->type = mt;
+	lo = it->offset;
+	hi = (--maps.cend())->end();
+	if (!window.empty()) {
+		lo = std::min(lo, window.begin()->offset);
+		hi = std::max(hi, (--window.end())->end());
+	}
+	span = hi - lo;
 
-	if (mt == Mapping::HEAP) {
-		base_brick = m->offset;
-		top_brick = m->end();
+	/* one piece of host address space for everything, so the guest
+	   layout carries over as is */
+	res = (char*)::mmap(NULL, span, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (res == MAP_FAILED)
+		return NULL;
+
+	pm_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (pm_fd < 0 || !GuestArena::readHostMaps(hms)) {
+		if (pm_fd >= 0) close(pm_fd);
+		::munmap(res, span);
+		return NULL;
+	}
+
+	c = new GuestMem();
+	c->want_window = false;
+	c->base = res - lo.o;
+	c->force_flat = false;
+	c->arena = arena;
+	c->huge_pages = huge_pages;
+
+	/* host mappings are sorted like ours; walk both together */
+	hm = hms.begin();
+	for (const auto &m : maps) {
+		char	*b = (char*)getHostPtr(m.offset);
+		char	*e = b + m.length;
+
+		if (m.offset < lo)
+			continue;
+
+		while (hm != hms.end() && hm->end <= (uintptr_t)b)
+			++hm;
+
+		for (auto h = hm; h != hms.end() && h->start < (uintptr_t)e; ++h) {
+			char	*pb = std::max(b, (char*)h->start);
+			char	*pe = std::min(e, (char*)h->end);
+
+			err = cloneRange(*c, *h, pb, pe - pb, m.cur_prot, pm_fd);
+			if (err < 0)
+				break;
+		}
+
+		if (err < 0)
+			break;
+	}
+	close(pm_fd);
+
+	if (err < 0) {
+		::munmap(res, span);
+		c->maps.clear();
+		delete c;
+		return NULL;
+	}
+
+	/* the rest of the reservation goes back, except under mappings
+	   that had no host pages (the clone unmaps those itself) and
+	   where it stands in for our window */
+	auto give_back = [&](guest_ptr b, guest_ptr e) {
+		for (const auto &w : window) {
+			if (w.offset > b)
+				::munmap(c->getHostPtr(b),
+					std::min(w.offset, e) - b);
+			b = std::max(b, w.end());
+			if (b >= e)
+				return;
+		}
+		::munmap(c->getHostPtr(b), e - b);
+	};
+
+	keep = lo;
+	for (const auto &m : maps) {
+		if (m.offset < lo)
+			continue;
+		if (m.offset > keep) give_back(keep, m.offset);
+		keep = m.end();
+	}
+	if (hi > keep) give_back(keep, hi);
+
+	for (const auto &w : window)
+		c->window.insert(c->window.end(), w);
+
+	/* hold the null page too, or the clone would unmap whatever
+	   happens to sit there when it goes away */
+	at = ::mmap(c->getBase(), PAGE_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (at != MAP_FAILED && at != c->getBase()) {
+		::munmap(at, PAGE_SIZE);
+		at = MAP_FAILED;
+	}
+
+	v.reserve(maps.size());
+	for (const auto &m : maps) {
+		if (m.offset < lo && at == MAP_FAILED)
+			continue;
+		v.push_back(m);
+	}
+	c->rebuildMappings(v);
+
+	c->top_brick = top_brick;
+	c->base_brick = base_brick;
+	c->reserve_brick = reserve_brick;
+	if (top_brick != 0) {
+		/* heap slack past brk isn't carried over; the reservation
+		   is, if the clone can get it */
+		c->commit_brick = heapEnd();
+		if (	reserve_brick > c->commit_brick &&
+			!c->mapBrk(c->commit_brick,
+				reserve_brick - c->commit_brick,
+				PROT_NONE, MAP_FIXED_NOREPLACE))
+		{
+			c->reserve_brick = c->commit_brick;
+		}
+	}
+	c->is_32_bit = is_32_bit;
+	c->coalesce_maps = coalesce_maps;
+	c->memfd_backed = memfd_backed;
+	if (syspage_data != NULL) {
+		c->syspage_data = new char[syspage_len];
+		::memcpy(c->syspage_data, syspage_data, syspage_len);
+		c->syspage_len = syspage_len;
 	}
+
+	return c;
 }
 
-const void* GuestMem::getSysHostAddr(guest_ptr p) const
+bool GuestMem::setDirtyTracking(bool on)
 {
-	const Mapping	*owner;
+	if (!on) {
+		dirty_log.reset();
+		return true;
+	}
 
-	owner = findOwner(p);
-	if (owner == NULL) return NULL;
-	if (owner->type != Mapping::VSYSPAGE) return NULL;
+	if (dirty_log == nullptr) {
+		dirty_log.reset(DirtyTracker::create(*this));
+		if (dirty_log == nullptr)
+			return false;
+		/* write-protecting can't share pages with watches */
+		if (	dirty_log->protectsPages() &&
+			(getNumWatches() != 0 ||
+			(code_log != nullptr && code_log->getNumWatched() != 0)))
+		{
+			dirty_log.reset();
+			return false;
+		}
+		dirty_log->checkpoint();
+	}
 
-	return (const void*)(syspage_data + (p.o - owner->offset.o));
+	return true;
 }
 
-void GuestMem::addSysPage(guest_ptr p, char* host_data, unsigned int len)
+void GuestMem::checkpoint(void)
 {
-	GuestMem::Mapping	m(p, len, PROT_READ | PROT_EXEC);
-	void			*mmap_ret;
+	assert (dirty_log != nullptr && "dirty tracking is off");
+	dirty_log->checkpoint();
+}
 
-//	assert (host_data && syspage_data == NULL);
-	if (syspage_data == NULL)
-		syspage_data = host_data;
+std::vector<GuestMem::pagerun_t> GuestMem::getDirtyPages(void) const
+{
+	std::vector<pagerun_t>	ret;
 
-	m.type = Mapping::VSYSPAGE;
-	recordMapping(m);
+	assert (dirty_log != nullptr && "dirty tracking is off");
+	dirty_log->getDirty(ret);
+	return ret;
+}
 
-	if (getBase() == NULL)
+void GuestMem::noteChanged(guest_ptr p, size_t len)
+{
+	if (dirty_log != nullptr)
+		dirty_log->noteChanged(p, len);
+	if (code_log != nullptr)
+		code_log->noteChanged(p, p + len);
+	if (watch_log != nullptr)
+		watch_log->drop(p, p + len, false);
+}
+
+void GuestMem::setCodeTracking(bool on)
+{
+	if (!on) {
+		code_log.reset();
 		return;
+	}
 
-	/* try to map it in if relocated */
-	mmap_ret = sys_mmap(
-		getHostPtr(m.offset),
-		len,
-		PROT_READ | PROT_EXEC | PROT_WRITE,
-		MAP_PRIVATE | MAP_ANONYMOUS,
-		-1,
-		0);
-	assert (mmap_ret != MAP_FAILED);
-	memcpy(m.offset, host_data, len);
+	if (code_log != nullptr)
+		return;
+
+	code_log.reset(new CodeTracker(*this));
+	for (const auto &m : maps)
+		if (m.req_prot & PROT_EXEC)
+			code_log->noteCode(m.offset, m.end());
 }
 
-void GuestMem::nameMapping(guest_ptr addr, const std::string& s)
+uint64_t GuestMem::watchCode(guest_ptr p)
 {
-	const GuestMem::Mapping* m;
+	const Mapping	*m;
+
+	assert (code_log != nullptr && "code tracking is off");
+	m = findOwner(p);
+	if (m == NULL || !host_backed || !(m->req_prot & PROT_EXEC))
+		return code_log->getGen(p);
+	/* each would put back its own saved protection over the other */
+	if (dirty_log != nullptr && dirty_log->protectsPages())
+		return code_log->getGen(p);
+	if (watch_log != nullptr && watch_log->isWatched(p))
+		return code_log->getGen(p);
+	return code_log->watch(p, m->cur_prot);
+}
 
-	if (s.size() == 0)
-		return;
+void GuestMem::setCodeHook(code_hook_t h)
+{
+	assert (code_log != nullptr && "code tracking is off");
+	code_log->setHook(h);
+}
 
-	if ((m = lookupMapping(addr)) == NULL)
-		return;
+int GuestMem::watchWrites(guest_ptr p, size_t len)
+{
+	const Mapping	*m;
 
-	mapping_names.push_back(std::make_unique<std::string>(s));
+	if (!host_backed || !WatchTracker::isSupported())
+		return -ENOSYS;
 
-	/* fuck it */
-	const_cast<GuestMem::Mapping*>(m)->name = mapping_names.back().get();
+	m = findOwner(p);
+	if (m == NULL || p + len > m->end())
+		return -EFAULT;
+
+	/* each would put back its own saved protection over the other */
+	if (dirty_log != nullptr && dirty_log->protectsPages())
+		return -EBUSY;
+	if (code_log != nullptr && code_log->isWatched(p))
+		return -EBUSY;
+
+	if (watch_log == nullptr)
+		watch_log.reset(new WatchTracker(*this));
+	return watch_log->watch(p, len, m->cur_prot);
 }
 
-void GuestMem::import(GuestMem* m) { assert (0 == 1 && "STUB"); }
+int GuestMem::unwatchWrites(guest_ptr p)
+{
+	if (watch_log == nullptr)
+		return -ENOENT;
+	return watch_log->unwatch(p);
+}
+
+void GuestMem::setWatchHook(watch_hook_t h)
+{
+	if (watch_log == nullptr)
+		watch_log.reset(new WatchTracker(*this));
+	watch_log->setHook(h);
+}
 
 
-/* XXX: dumb */
-uint64_t GuestMem::chksumMapping(Mapping& m) const
+/* 'buf' is a page of scratch for memory that can't be hashed in place */
+PageHash GuestMem::hashPage(const Mapping& m, guest_ptr p, char* buf) const
 {
-	uint64_t	*p;
-	uint64_t	ret = 0;
+	const void	*h;
 
-	p = (uint64_t*)getHostPtr(m.offset);
-	for (unsigned i = 0; i < m.length/sizeof(*p); i++) {
-		ret += (i+1)*p[i];
+	if (!(m.cur_prot & PROT_READ))
+		return PageHash();
+
+	if (m.type == Mapping::VSYSPAGE && syspage_data != NULL) {
+		h = syspage_data + (p - m.offset);
+	} else if (host_backed) {
+		h = base + p.o;
+	} else {
+		memcpy(buf, p, PAGE_SIZE);
+		h = buf;
 	}
 
-	return ret;
+	return PageHash::compute(h, PAGE_SIZE);
+}
+
+uint64_t GuestMem::chksumMapping(const Mapping& m) const
+{
+	std::vector<PageHash>	pages(m.length / PAGE_SIZE);
+	char			buf[PAGE_SIZE];
+
+	if (!(m.cur_prot & PROT_READ))
+		return 0;
+
+	for (unsigned i = 0; i < pages.size(); i++)
+		pages[i] = hashPage(m, m.offset + i*PAGE_SIZE, buf);
+
+	return PageHash::compute(
+		pages.data(), pages.size()*sizeof(PageHash)).lo;
 }
 
 std::list<GuestMem::mapchksum_t> GuestMem::getChksums(void) const
 {
 	std::list<mapchksum_t>	l;
-	foreach (it, maps.begin(), maps.end()) {
-		l.push_back(mapchksum_t(
-			*(it->second), chksumMapping(*(it->second))));
-	}
+	for (const auto &mh : getPageHashes())
+		l.push_back(mapchksum_t(mh.m, mh.hash.lo));
 	return l;
 }
+
+std::vector<GuestMem::MapHash> GuestMem::getPageHashes(unsigned workers) const
+{
+	/* (mapping, first page) of each unit of work */
+	std::vector<std::pair<unsigned, unsigned>>	work;
+	std::vector<MapHash>				ret(maps.size());
+	std::vector<std::thread>			threads;
+	std::atomic<unsigned>				next_work(0);
+	unsigned					i = 0;
+
+	for (const auto &m : maps) {
+		MapHash	&mh(ret[i]);
+
+		mh.m = m;
+		if (m.cur_prot & PROT_READ) {
+			mh.pages.resize(m.length / PAGE_SIZE);
+			for (unsigned pg = 0; pg < mh.pages.size(); pg += HASH_BATCH)
+				work.push_back(std::make_pair(i, pg));
+		}
+		i++;
+	}
+
+	/* pages are batched so one huge mapping still spreads out */
+	auto run = [&] () {
+		char		buf[PAGE_SIZE];
+		unsigned	w;
+
+		while ((w = next_work++) < work.size()) {
+			MapHash		&mh(ret[work[w].first]);
+			unsigned	pg = work[w].second;
+			unsigned	end = std::min<size_t>(
+				pg + HASH_BATCH, mh.pages.size());
+
+			for (; pg < end; pg++) {
+				mh.pages[pg] = hashPage(
+					mh.m, mh.m.offset + pg*PAGE_SIZE, buf);
+			}
+		}
+	};
+
+	if (workers == 0 && getenv("GUEST_HASH_WORKERS") != NULL)
+		workers = atoi(getenv("GUEST_HASH_WORKERS"));
+	if (workers == 0)
+		workers = std::thread::hardware_concurrency();
+	/* ptrace only answers the tracing thread */
+	if (!host_backed)
+		workers = 1;
+	workers = std::max(1U, std::min<unsigned>(workers, work.size()));
+
+	for (i = 1; i < workers; i++)
+		threads.push_back(std::thread(run));
+	run();
+	for (auto &t : threads)
+		t.join();
+
+	for (auto &mh : ret) {
+		if (mh.pages.empty()) continue;
+		mh.hash = PageHash::compute(
+			mh.pages.data(), mh.pages.size()*sizeof(PageHash));
+	}
+
+	return ret;
+}
+
+const GuestMem::mapmap_t GuestMem::getMapMap(void) const
+{
+	mapmap_t	ret;
+	for (const auto &m : maps)
+		ret.insert(std::make_pair(m.offset, &m));
+	return ret;
+}
@@ -1,15 +1,32 @@
 #ifndef GUESTMEM_H
 #define GUESTMEM_H
 
+#include <atomic>
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <string.h>
 #include <sys/types.h>
 #include <assert.h>
 
 #include "Sugar.h"
 #include "guestptr.h"
+#include "guestmaptab.h"
+#include "pagehash.h"
+#include "guestarena.h"
+#include "pageperms.h"
+#include "guestshadow.h"
+#include "codetracker.h"
+#include "watchtracker.h"
+#include "rcu.h"
+
+class DirtyTracker;
 
 /* oh good, MAP_32BIT isn't defined in the ARM headers */
 #if defined(__arm__)
@@ -26,7 +43,13 @@ class Mapping
 public:
 	enum MapType { REG = 0, STACK = 1, HEAP = 2, UNMAPPED = 3, VSYSPAGE = 4 };
 
-	Mapping(void) : offset(0), length(0), type(REG) {}
+	Mapping(void)
+	: offset(0)
+	, length(0)
+	, req_prot(0)
+	, cur_prot(0)
+	, type(REG)
+	, name(NULL) {}
 
 	Mapping(guest_ptr in_off, size_t in_len, int prot,
 		const std::string* _name=0)
@@ -44,7 +67,7 @@ public:
 	bool contains(guest_ptr p) const
 	{ return (p >= offset && p < offset + length); }
 
-	unsigned int getBytes(void) const { return length; }
+	size_t getBytes(void) const { return length; }
 	int getReqProt(void) const { return req_prot; }
 	int getCurProt(void) const { return cur_prot; }
 	void print(std::ostream& os) const;
@@ -53,6 +76,13 @@ public:
 
 	bool isValid() const { return offset && length; }
 
+	bool operator==(const Mapping& m) const
+	{
+		return	offset == m.offset && length == m.length &&
+			req_prot == m.req_prot && cur_prot == m.cur_prot &&
+			type == m.type && name == m.name;
+	}
+
 	guest_ptr		offset;
 	size_t			length;
 	int			req_prot;
@@ -61,26 +91,216 @@ public:
 	const std::string	*name;
 };
 
+typedef GuestMapTab<Mapping> maptab_t;
+
+/* picks out mappings for getMappings(); by default, everything */
+class MapFilter
+{
+public:
+	explicit MapFilter(int _prot = 0)
+	: prot(_prot), types(0), name(NULL) {}
+
+	/* requested protection must include all of 'p' */
+	MapFilter& hasProt(int p) { prot |= p; return *this; }
+	/* may be given several times to accept several types */
+	MapFilter& isType(Mapping::MapType t)
+	{ types |= 1U << t; return *this; }
+	MapFilter& hasName(const char* n) { name = n; return *this; }
+
+	int		prot;
+	unsigned	types;
+	const char	*name;
+};
+
+/* iterates the mapping table in place; no copies. Only good until the
+ * next mapping update */
+class MapRange
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(const MapRange* _r, maptab_t::const_iterator _it)
+		: r(_r), it(_it) { skip(); }
+		const Mapping& operator*() const { return *it; }
+		const Mapping* operator->() const { return &*it; }
+		iterator& operator++() { ++it; skip(); return *this; }
+		bool operator!=(const iterator& i) const { return it != i.it; }
+		bool operator==(const iterator& i) const { return it == i.it; }
+	private:
+		void skip(void)
+		{ while (it != r->last && !r->matches(*it)) ++it; }
+		const MapRange			*r;
+		maptab_t::const_iterator	it;
+	};
+
+	MapRange(const maptab_t& t, const MapFilter& _f,
+		const std::string* _name_key)
+	: f(_f), name_key(_name_key)
+	, first(t.begin()), last(t.end())
+	{ if (f.name != NULL && name_key == NULL) first = last; }
+
+	iterator begin(void) const { return iterator(this, first); }
+	iterator end(void) const { return iterator(this, last); }
+
+	bool matches(const Mapping& m) const
+	{
+		if ((m.req_prot & f.prot) != f.prot) return false;
+		if (f.types && !(f.types & (1U << m.type))) return false;
+		/* no key: nothing has that name */
+		if (f.name && (name_key == NULL || m.name != name_key))
+			return false;
+		return true;
+	}
+
+private:
+	MapFilter			f;
+	const std::string		*name_key;
+	maptab_t::const_iterator	first, last;
+};
+
+/* groups a run of mapping updates (e.g., loading a snapshot). Coalescing
+ * is held off until the batch goes away and then done in one sweep, so
+ * setType()/nameMapping() on fresh mappings still see them unmerged */
+class MapBatch
+{
+public:
+	MapBatch(GuestMem* _mem)
+	: mem(_mem), was_coalescing(_mem->coalesce_maps)
+	{ mem->coalesce_maps = false; }
+
+	~MapBatch(void)
+	{
+		mem->coalesce_maps = was_coalescing;
+		if (was_coalescing) mem->coalesceMappings();
+	}
+private:
+	GuestMem	*mem;
+	bool		was_coalescing;
+};
+
 	GuestMem(void);
 	virtual ~GuestMem(void);
 
 	void nameMapping(guest_ptr addr, const std::string& s);
 	void recordMapping(Mapping& mapping);
+	/* same as recording each in turn, but 'batch' must be sorted and
+	   non-overlapping; the table is rebuilt in a single pass */
+	void recordMappings(std::vector<Mapping>& batch);
+
+	/* merge neighbours with identical protection, type, and name.
+	   off by default: mremap() wants a mapping's exact original extent */
+	void setCoalescing(bool on) { coalesce_maps = on; }
+	bool isCoalescing(void) const { return coalesce_maps; }
+	void coalesceMappings(void);
+
+	/* let other threads look things up while this one changes the
+	   address space. Lookups, checked accesses, getMaps(), and the
+	   string helpers then read a published copy of the table; each
+	   update publishes a fresh one and waits out readers of the old.
+	   Updates pay for a table copy, so it's off by default. Switch it
+	   while no other thread is reading */
+	void setSharedReads(bool on);
+	bool isSharedReads(void) const { return shared_reads; }
+
 	bool lookupMapping(guest_ptr addr, Mapping& mapping) const;
 	bool isMapped(guest_ptr addr) const {
-		return (lookupMapping(addr) != NULL);
+		return (TabReader(*this)->find(addr) != NULL);
 	}
 
 
 	bool lookupMapping(const char* name, Mapping& mapping) const;
+	/* every mapping with the given name (e.g., all of libc's segments) */
+	std::list<Mapping> lookupMappings(const char* name) const;
 
 	typedef std::pair<Mapping, uint64_t> mapchksum_t;
 	std::list<mapchksum_t> getChksums(void) const;
 
+	/* content hash of every mapping and each of its pages; compare
+	   against an earlier capture to find what changed. unreadable
+	   mappings hash to zero */
+	struct MapHash
+	{
+		Mapping			m;
+		PageHash		hash;	/* over 'pages' */
+		std::vector<PageHash>	pages;
+	};
+	/* 0 workers means GUEST_HASH_WORKERS or one per cpu */
+	std::vector<MapHash> getPageHashes(unsigned workers = 0) const;
+
+	/* (start, bytes) */
+	typedef std::pair<guest_ptr, size_t> pagerun_t;
+
+	/* log pages written since the last checkpoint(); host-backed
+	   memory only. false if it can't be done here, or it would have
+	   to write-protect pages and watches hold some */
+	bool setDirtyTracking(bool on);
+	bool isTrackingDirty(void) const { return dirty_log != nullptr; }
+	void checkpoint(void);
+	/* sorted runs of pages written since the last checkpoint() */
+	std::vector<pagerun_t> getDirtyPages(void) const;
+
+	/* code generations for caches of decoded guest code. Each page of
+	   a PROT_EXEC mapping has a stamp that moves on whenever the page
+	   might have changed: a mapping or protection change over it, or
+	   a write caught by watchCode(). Stamps never come back, so a cache
+	   keeps the one it decoded under and drops only blocks whose page
+	   moved on. 0 means never code. See CodeTracker */
+	void setCodeTracking(bool on);
+	bool isTrackingCode(void) const { return code_log != nullptr; }
+	uint64_t getCodeGen(guest_ptr p) const {
+		assert (code_log != nullptr && "code tracking is off");
+		return code_log->getGen(p);
+	}
+	/* getCodeGen(), and if the page is writable, write-protect it on
+	   the host until its next write; host-backed memory only. Not
+	   while mprotect dirty tracking is on or watchWrites() has the
+	   page: its writes go unseen then */
+	uint64_t watchCode(guest_ptr p);
+	/* told of pages moving on; in signal context for caught writes */
+	void setCodeHook(code_hook_t h);
+
+	/* write watchpoints for in-process guests: each write to a watched
+	   [p, p+len) (up to 8 bytes, inside a page) reaches the hook with
+	   the value left there, at near native speed for everything else.
+	   A watch lasts until its page's protection is replaced. Host-backed
+	   memory on x86-64 hosts only; see WatchTracker. -EBUSY while
+	   watchCode() or mprotect dirty tracking protects the page */
+	int watchWrites(guest_ptr p, size_t len);
+	int unwatchWrites(guest_ptr p);
+	size_t getNumWatches(void) const
+	{ return (watch_log != nullptr) ? watch_log->getNumWatches() : 0; }
+	/* in signal context */
+	void setWatchHook(watch_hook_t h);
+
+	/* a tool's own per-page metadata, 'page_bytes' for each guest
+	   page; see GuestShadow. We keep it, and it follows the guest's
+	   pages through mmap, munmap, mremap and brk. Clones start
+	   without any */
+	GuestShadow* addShadow(size_t page_bytes);
+	void removeShadow(GuestShadow* s);
+
+	/* the mapping table as it stands, in O(1): versions share what
+	   neither has changed since, so keeping thousands costs memory
+	   for the changes alone. Restoring puts back the table, its name
+	   index, and checked-access permissions, redoing only mappings
+	   that differ. Memory contents and the heap are left alone.
+	   Host mappings aren't touched either, so this is for memory
+	   that isn't host-backed (sinks, ptrace): here it would mark
+	   pages accessible that the host has since unmapped, and checked
+	   accesses would fault the host. The updating thread only */
+	maptab_t captureLayout(void) const { return maps; }
+	void restoreLayout(const maptab_t& l);
+	/* mappings only in 'a' go to 'gone', only in 'b' to 'added' */
+	static void diffLayouts(const maptab_t& a, const maptab_t& b,
+		std::vector<Mapping>& gone, std::vector<Mapping>& added);
+
 	std::list<Mapping> getMaps(void) const;
+	/* iterates the live table; the updating thread only */
+	MapRange getMappings(const MapFilter& f = MapFilter()) const;
 	void setType(guest_ptr addr, Mapping::MapType);
 
-	void mark32Bit() { is_32_bit = true; }
+	void mark32Bit() { is_32_bit = true; want_window = true; }
 	bool is32Bit() const { return is_32_bit; }
 
 	char* getBase() const { return base; }
@@ -91,12 +311,63 @@ public:
 	friend class GuestPTMem;
 	virtual void import(GuestMem* m);
 
+	/* independent copy of the address space. Pages are shared
+	   copy-on-write through a memfd, so only what either side writes
+	   from here on costs memory; the first clone moves touched pages
+	   into the memfd. The copy sits at its own host base, so the
+	   guest's span of mappings must fit elsewhere in the host. NULL if
+	   it doesn't or memory isn't host-backed. Not while the guest runs */
+	GuestMem* clone(void);
+
+	/* keep private anonymous memory made from here on in a memfd
+	   (GUEST_MEMFD). Snapshots copy it in the kernel, the first clone
+	   needn't move it, and other processes can map it too. A host
+	   fork() shares it instead of copying. false if there's no memfd */
+	bool setMemfdBacking(bool on);
+	bool isMemfdBacked(void) const { return memfd_backed; }
+	/* memfd and file offset holding the page at p, if it's only ours;
+	   -1 otherwise */
+	int getBackingFd(guest_ptr p, off_t& off) const;
+	/* write [p, p+len) to fd at fd_off; 0 or -errno. 'sparse' says the
+	   file holds nothing past fd_off yet, so zero pages are left as
+	   holes and the file is only extended to cover them */
+	int copyToFile(int fd, off_t fd_off, guest_ptr p, size_t len,
+		bool sparse = false) const;
+
+	/* put big anonymous mappings and the heap on transparent huge
+	   pages (GUEST_HUGEPAGES): they're placed on 2MB boundaries and
+	   advised. The guest still sees 4KB pages. memfd-backed memory
+	   only goes huge if the host allows it for shmem */
+	void setHugePages(bool on) { huge_pages = on; }
+	bool isHugePages(void) const { return huge_pages; }
+
+	struct HugeStats
+	{
+		size_t	advised;	/* bytes of guest memory advised huge */
+		size_t	huge;		/* bytes actually on huge pages */
+	};
+	/* walks /proc/self/smaps; not for hot paths */
+	HugeStats getHugeStats(void) const;
+
 	virtual void* getData(const Mapping& m) const
 	{ return (void*)(base + m.offset.o); }
 
-	/* access small bits of guest memory */
+	/* access small bits of guest memory; plain host-backed memory
+	   is accessed in place, anything else through read8..write64 */
 	template <typename T>
 	T read(guest_ptr offset) const {
+		if (host_backed) return *(const T*)(base + offset.o);
+		return readVirt<T>(offset);
+	}
+
+	template <typename T>
+	void write(guest_ptr offset, const T& t) {
+		if (host_backed) *(T*)(base + offset.o) = t;
+		else writeVirt<T>(offset, t);
+	}
+
+	template <typename T>
+	T readVirt(guest_ptr offset) const {
 		switch(sizeof(T)) {
 		case 1: return (T)read8(offset);
 		case 2: return (T)read16(offset);
@@ -108,8 +379,7 @@ public:
 	}
 
 	template <typename T>
-	void write(guest_ptr offset, const T& t) {
-		*(T*)(base + offset.o) = t;
+	void writeVirt(guest_ptr offset, const T& t) {
 		switch(sizeof(T)) {
 		case 1: write8(offset, t); break;
 		case 2: write16(offset, t); break;
@@ -119,6 +389,57 @@ public:
 		}
 	}
 
+	/* true when guest memory is just host memory at 'base'; subclasses
+	   that override the accessors clear it */
+	bool isHostBacked(void) const { return host_backed; }
+
+	/* accessors with the backing fixed at compile time. Code templated
+	   on the view (see withView()) has no virtual calls or host_backed
+	   tests left in its inner loops */
+	class HostView
+	{
+	public:
+		explicit HostView(char* _base) : base(_base) {}
+		template <typename T> T read(guest_ptr p) const
+		{ return *(const T*)(base + p.o); }
+		template <typename T> void write(guest_ptr p, const T& t) const
+		{ *(T*)(base + p.o) = t; }
+	private:
+		char	*base;
+	};
+
+	class VirtView
+	{
+	public:
+		explicit VirtView(GuestMem& _mem) : mem(_mem) {}
+		template <typename T> T read(guest_ptr p) const
+		{ return mem.readVirt<T>(p); }
+		template <typename T> void write(guest_ptr p, const T& t) const
+		{ mem.writeVirt<T>(p, t); }
+	private:
+		GuestMem	&mem;
+	};
+
+	HostView getHostView(void) const
+	{
+		assert (host_backed && "no direct view of this memory");
+		return HostView(base);
+	}
+
+	/* runs f(view) with whichever view fits; 'f' is normally a generic
+	   lambda, so it is instantiated once per backing */
+	template <typename F>
+	void withView(F f)
+	{
+		if (host_backed) f(HostView(base));
+		else f(VirtView(*this));
+	}
+
+	/* runs f(view) with the GuestView for the guest's word size; like
+	   withView(), 'f' is instantiated once per width */
+	template <typename F> void withWidth(F f);
+	template <typename F> void withWidth(F f) const;
+
 
 	#define DEFREAD(x)	\
 	virtual uint##x##_t read##x(guest_ptr offset) const \
@@ -138,14 +459,16 @@ public:
 	DEFWRITE(64)
 	#undef DEFWRITE
 
+	/* guest words; code reading many should take a GuestView (see
+	   withWidth()) instead of testing the width on every one */
 	uintptr_t readNative(guest_ptr offset, int idx = 0) {
-		if(is_32_bit) return read32(guest_ptr(offset.o + idx*4));
-		return read64(guest_ptr(offset.o + idx*8));
+		if(is_32_bit) return read<uint32_t>(guest_ptr(offset.o + idx*4));
+		return read<uint64_t>(guest_ptr(offset.o + idx*8));
 	}
 
 	void writeNative(guest_ptr offset, uintptr_t t) {
-		if(is_32_bit) write32(offset, t);
-		else write64(offset, t);
+		if(is_32_bit) write<uint32_t>(offset, t);
+		else write<uint64_t>(offset, t);
 	}
 
 	/* access large blocks of guest memory */
@@ -161,17 +484,54 @@ public:
 	virtual int strlen(guest_ptr p) const { return ::strlen(base + p.o); }
 	void* getHostPtr(guest_ptr p) const { return (void*)(base + p.o); }
 
-	std::string readString(guest_ptr p) const {
-		int		l = strlen(p);
-		std::string	s(l, 'x');
-		memcpy(const_cast<char*>(s.data()), p, l);
-		return s;
+	/* stops at unreadable memory, keeping what was read before it */
+	std::string readString(guest_ptr p) const;
+
+	/* bounded accesses checked against the mapping table; they cross
+	   mapping boundaries and return -EFAULT on reaching memory that
+	   isn't readable instead of faulting */
+
+	/* length of string at p, or 'max' if there's no NUL before it */
+	ssize_t strnlen(guest_ptr p, size_t max) const;
+	/* copy out at most len-1 chars plus NUL; returns string length.
+	   on -EFAULT, buf still has the readable prefix, terminated */
+	ssize_t readString(guest_ptr p, char* buf, size_t len) const;
+	/* offset of the first 'c' from p, or 'len' if there isn't one */
+	ssize_t memchr(guest_ptr p, int c, size_t len) const;
+	/* 'diff' gets what ::memcmp would say; returns 0 or -EFAULT */
+	int memcmp(guest_ptr p, const void* s, size_t len, int& diff) const;
+	/* n consecutive guest words, widened to host pointers */
+	int readNatives(guest_ptr p, uintptr_t* out, unsigned n) const;
+
+	/* checked accesses: every page touched is probed in a bitmap kept
+	   with the mapping table, so a bad guest pointer gets -EFAULT and
+	   nothing is done. Cheap enough for hot loops */
+	bool canAccess(guest_ptr p, size_t len, int prot) const
+	{ return perms.allows(p, len, prot); }
+
+	template <typename T>
+	int readChecked(guest_ptr p, T& t) const {
+		if (!perms.allows(p, sizeof(T), PROT_READ)) return -EFAULT;
+		t = read<T>(p);
+		return 0;
+	}
+
+	template <typename T>
+	int writeChecked(guest_ptr p, const T& t) {
+		if (!perms.allows(p, sizeof(T), PROT_WRITE)) return -EFAULT;
+		write<T>(p, t);
+		return 0;
 	}
 
+	int readNativeChecked(guest_ptr p, uintptr_t& v, int idx = 0) const;
+	int memcpyChecked(void* dest, guest_ptr src, size_t len) const;
+	int memcpyChecked(guest_ptr dest, const void* src, size_t len);
+
 	/* virtual memory handling, these update the mappings as
 	   necessary and also do the proper protection to
 	   distinguish between self-modifying/generating code
-	   and normal data writes */
+	   and normal data writes; setCodeTracking() says which
+	   code pages changed */
 	guest_ptr brk() const { return top_brick; }
 	virtual bool sbrk(guest_ptr new_top);
 	virtual int mmap(guest_ptr& result, guest_ptr addr, size_t length,
@@ -185,50 +545,248 @@ public:
 		int flags, guest_ptr new_offset);
 
 	const void* getSysHostAddr(guest_ptr p) const;
-	void addSysPage(guest_ptr p, char* host_data, unsigned int len);
+	void addSysPage(guest_ptr p, char* host_data, size_t len);
 
 	unsigned getNumMaps(void) const { return maps.size(); }
 
 
-	typedef std::map<guest_ptr, Mapping*> mapmap_t;
-	const mapmap_t getMapMap(void) const { return maps; }
+	/* pointers are only good until the next mapping update; the
+	   updating thread only */
+	typedef std::map<guest_ptr, const Mapping*> mapmap_t;
+	const mapmap_t getMapMap(void) const;
 protected:
 	virtual void* sys_mmap(void*, size_t len, int prot, int fl,
 		int fd, off_t off) const;
 	virtual int sys_mprotect(void*, size_t len, int prot) const;
-	virtual int sys_munmap(void* p, unsigned len) const;
+	virtual int sys_munmap(void* p, size_t len) const;
 	virtual void* sys_mremap(
 		void* old, size_t oldsz, size_t newsz, int fl,
 		void* new_addr = NULL) const;
 
 	bool sbrkInitial();
 	bool sbrkInitial(guest_ptr new_top);
-
+	static guest_ptr pageUp(guest_ptr p);
+	guest_ptr heapEnd(void) const;
+	guest_ptr brkEnd(void) const;
+	void trimBrk(guest_ptr b, guest_ptr e);
+	bool mapBrk(guest_ptr p, size_t len, int prot, int flags);
+	bool commitBrk(guest_ptr end);
+	bool decommitBrk(guest_ptr end);
+
+	/* lookups through this don't unshare chunks with captured layouts */
+	const maptab_t& cmaps(void) const { return maps; }
 	void removeMapping(Mapping& mapping);
+	maptab_t::iterator clearRange(guest_ptr b, guest_ptr e);
+	maptab_t::iterator eraseMapping(maptab_t::iterator it);
+	bool canCoalesce(const Mapping& a, const Mapping& b) const;
+	maptab_t::iterator absorbNeighbours(
+		maptab_t::iterator pos, Mapping& m);
+	void appendMapping(std::vector<Mapping>& v, const Mapping& m,
+		bool merge) const;
+	void rebuildMappings(const std::vector<Mapping>& v);
+	int accessProt(const Mapping& m) const;
+
+	/* the table lookups should use, held for as long as we're in scope */
+	class TabReader
+	{
+	public:
+		explicit TabReader(const GuestMem& g)
+		: lk(g.shared_reads)
+		, t(lk.held() ? g.pub_maps.load() : &g.maps) {}
+		const maptab_t& operator*() const { return *t; }
+		const maptab_t* operator->() const { return t; }
+	private:
+		Rcu::ReadLock	lk;
+		const maptab_t	*t;
+	};
+	/* after any change to 'maps' */
+	void tableChanged(void);
+
+	static const std::string* internName(const std::string& s);
+	/* the interned copy if there is one; NULL means nothing was ever
+	   named 's' */
+	static const std::string* findName(const std::string& s);
+	void indexName(const Mapping& m);
+	void unindexName(const Mapping& m);
 
 	const Mapping* lookupMapping(guest_ptr addr) const;
 	const Mapping* findNextMapping(guest_ptr addr) const;
 	const Mapping* findOwner(guest_ptr addr) const;
 	bool findFreeRegionByMaps(size_t len, Mapping& m) const;
-
-	bool canUseRange(guest_ptr base, unsigned int len) const;
-
-	uint64_t chksumMapping(Mapping& mapping) const;
-
-
-	mapmap_t	maps;
+	bool firstFitByMaps(size_t len, guest_ptr floor, Mapping& m) const;
+	bool findFreeRegionByView(size_t len, Mapping& m) const;
+	bool wantsHuge(size_t len) const;
+	guest_ptr alignHuge(guest_ptr p) const;
+	void adviseHuge(guest_ptr p, size_t len) const;
+
+	bool canUseRange(guest_ptr base, size_t len) const;
+	void* placeFixed(guest_ptr p, size_t len, int prot, int flags,
+		int fd, off_t off);
+	void* relocate(const Mapping& m, Mapping& n);
+	void* placeFree(guest_ptr p, size_t len, int prot, int flags,
+		int fd, off_t off);
+	bool guestFree(guest_ptr p, size_t len) const;
+	bool guestMapped(guest_ptr p, size_t len) const;
+
+	/* what the host has mapped, in guest addresses. Our own sys_*
+	   calls keep it current; anything else in the process shows up
+	   when a MAP_FIXED_NOREPLACE placement trips over it */
+	struct HostSpan
+	{
+		guest_ptr	offset;
+		size_t		length;
+		guest_ptr end(void) const { return offset + length; }
+	};
+	typedef GuestMapTab<HostSpan> hostview_t;
+	const hostview_t& hostView(void) const;
+	const HostSpan* hostBusy(guest_ptr p, size_t len) const;
+	void viewAdd(const void* p, size_t len) const;
+	void viewDel(const void* p, size_t len) const;
+	void viewStale(void) const { view_stale = true; }
+	guest_ptr mmapTop(void) const;
+
+	/* host address space held PROT_NONE for the guest; in there the
+	   table is the whole story and placement is always MAP_FIXED */
+	void holdWindow(void) { if (want_window) reserveWindow(); }
+	void reserveWindow(void);
+	bool holdSpan(guest_ptr p, size_t len);
+	void rehold(guest_ptr p, size_t len);
+	int releaseHost(guest_ptr p, size_t len);
+	guest_ptr windowEnd(guest_ptr p) const;
+	bool inWindow(guest_ptr p, size_t len) const
+	{ return !window.empty() && windowEnd(p) >= p + len; }
+
+	int cloneRange(GuestMem& c, const GuestArena::HostMap& hm,
+		char* p, size_t len, int prot, int pagemap_fd);
+
+	/* arena file range behind a stretch of guest memory */
+	struct Backing
+	{
+		guest_ptr	offset;
+		size_t		length;
+		off_t		file_off;
+		bool		live;	/* mapped shared, by us alone */
+		guest_ptr end() const { return offset + length; }
+	};
+	typedef GuestMapTab<Backing> backtab_t;
+
+	void* mapAnon(guest_ptr p, size_t len, int prot, int flags);
+	void addBacking(guest_ptr p, size_t len, off_t file_off, bool live);
+	void clearBacking(guest_ptr b, guest_ptr e, bool punch = true);
+	void moveBacking(guest_ptr from, size_t len, guest_ptr to);
+	/* pages gone or moved, as far as shadows care */
+	void dropShadow(guest_ptr b, guest_ptr e);
+	void moveShadow(guest_ptr from, size_t len, guest_ptr to);
+
+	uint64_t chksumMapping(const Mapping& mapping) const;
+	void noteChanged(guest_ptr p, size_t len);
+	PageHash hashPage(const Mapping& m, guest_ptr p, char* buf) const;
+
+	template <typename F>
+	ssize_t scanGuest(guest_ptr p, size_t len, F f) const;
+
+
+	maptab_t	maps;
 	char*		base;
+	/* what checked accesses may do; follows 'maps' */
+	PagePerms	perms;
+	ptr_vec_t<GuestShadow>	shadows;
 
 	guest_ptr	top_brick;
 	guest_ptr	base_brick;
-	guest_ptr	reserve_brick;
+	guest_ptr	reserve_brick;	/* end of PROT_NONE held past the heap */
+	guest_ptr	commit_brick;	/* end of host heap that's read/write */
 
 	bool		is_32_bit;
 	bool		force_flat;
+	bool		coalesce_maps;
+	bool		host_backed;
+	bool		huge_pages;
 
 	char*		syspage_data;
+	size_t		syspage_len;
+
+	/* mapping offsets using each name. A Mapping's name points into a
+	   process-wide pool (see internName()), so records can be shared
+	   with other GuestMems' tables as they are */
+	typedef std::unordered_map<std::string, std::set<guest_ptr>> namemap_t;
+	namemap_t	mapping_names;
+
+	std::unique_ptr<DirtyTracker>	dirty_log;
+	std::unique_ptr<CodeTracker>	code_log;
+	std::unique_ptr<WatchTracker>	watch_log;
+
+	/* shared with clones; extents we map are held until we go away */
+	std::shared_ptr<GuestArena>	arena;
+	GuestArena::holds_t		arena_holds;
+	backtab_t			backing;
+	bool				memfd_backed;
+
+	mutable hostview_t		host_view;
+	mutable bool			view_stale;
+	/* top-down searches pick up below the last spot handed out */
+	mutable guest_ptr		view_hint;
+	mutable guest_ptr		mmap_top;
+
+	hostview_t			window;
+	bool				want_window;
+
+	/* readers' version of 'maps' when sharing; see TabReader */
+	bool				shared_reads;
+	bool				publish_held;
+	std::atomic<maptab_t*>		pub_maps;
+};
+
+/* guest memory with the guest word size fixed at compile time; W is
+ * uint32_t or uint64_t. Stack, argv, symbol and ABI code templated on it
+ * has no width tests left per word. M is const GuestMem for read-only
+ * views */
+template <typename W, typename M = GuestMem>
+class GuestView
+{
+public:
+	typedef W word_t;
+	static const unsigned WORD_BYTES = sizeof(W);
+
+	explicit GuestView(M& _mem) : mem(_mem) {}
+
+	M& getMem(void) const { return mem; }
+
+	/* word idx past p, widened to a host pointer */
+	uintptr_t readNative(guest_ptr p, int idx = 0) const
+	{ return mem.template read<W>(guest_ptr(p.o + idx*sizeof(W))); }
 
-	ptr_list_t<std::string>	mapping_names;
+	void writeNative(guest_ptr p, uintptr_t v) const
+	{ mem.template write<W>(p, (W)v); }
+
+	int readNativeChecked(guest_ptr p, uintptr_t& v, int idx = 0) const
+	{
+		W	w = 0;
+		int	err = mem.readChecked(guest_ptr(p.o + idx*sizeof(W)), w);
+		v = w;
+		return err;
+	}
+
+	/* a host value cut down to what fits a guest word */
+	static uintptr_t trunc(uint64_t v) { return (W)v; }
+	static bool fits(uint64_t v) { return v == (W)v; }
+
+private:
+	M	&mem;
 };
 
+template <typename F>
+void GuestMem::withWidth(F f)
+{
+	if (is_32_bit) f(GuestView<uint32_t>(*this));
+	else f(GuestView<uint64_t>(*this));
+}
+
+template <typename F>
+void GuestMem::withWidth(F f) const
+{
+	if (is_32_bit) f(GuestView<uint32_t, const GuestMem>(*this));
+	else f(GuestView<uint64_t, const GuestMem>(*this));
+}
+
 #endif
@@ -4,6 +4,7 @@ GuestMemDual::GuestMemDual(GuestMem* gm0, GuestMem* gm1)
 {
 	m[0] = gm0;
 	m[1] = gm1;
+	host_backed = false;
 }
 
 GuestMemDual::~GuestMemDual(void) { maps.clear(); }
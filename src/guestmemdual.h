@@ -12,7 +12,7 @@ public:
 	static GuestMemDual* createImported(GuestMem* gm0, GuestMem* gm1)
 	{
 		GuestMemDual* gmd = new GuestMemDual(gm0, gm1);
-		gmd->maps = gm0->getMapMap();
+		gmd->restoreLayout(gm0->captureLayout());
 		return gmd;
 	}
 	GuestMemDual(GuestMem* gm0, GuestMem* gm1);
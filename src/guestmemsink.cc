@@ -1,8 +1,7 @@
 #include "guestmemsink.h"
 #include "Sugar.h"
 
-GuestMemSink::GuestMemSink(void)
-{}
+GuestMemSink::GuestMemSink(void) { host_backed = false; }
 
 void* GuestMemSink::sys_mmap(
 	void* p, size_t len, int prot, int fl, int fd, off_t off) const
@@ -12,7 +11,7 @@ void* GuestMemSink::sys_mmap(
 	abort();
 }
 
-int GuestMemSink::sys_munmap(void* p, unsigned len) const
+int GuestMemSink::sys_munmap(void* p, size_t len) const
 { return 0; }
 
 int GuestMemSink::sys_mprotect(void* p, size_t len, int prot) const
@@ -28,6 +27,5 @@ void* GuestMemSink::sys_mremap(
 
 GuestMemSink::~GuestMemSink(void)
 {
-	for (auto& p : maps) delete p.second;
 	maps.clear();
 }
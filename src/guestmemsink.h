@@ -38,7 +38,7 @@ public:
 protected:
 	virtual void* sys_mmap(void*, size_t len, int prot, int fl,
 		int fd, off_t off) const;
-	virtual int sys_munmap(void* p, unsigned len) const;
+	virtual int sys_munmap(void* p, size_t len) const;
 	virtual void* sys_mremap(
 		void* old, size_t oldsz, size_t newsz,
 		int fl, void* new_addr = NULL) const;
@@ -12,6 +12,7 @@
 #include <sstream>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <set>
 #include "Sugar.h"
 
@@ -383,17 +384,17 @@ void GuestPTImg::slurpArgPtrs(char *const argv[])
 #endif
 
 	for (int i = 0; i < argc; i++) {
-		int	arg_len;
+		ssize_t	arg_len;
 		char	argbuf[1024];
 
 		argv_ptrs.push_back(in_argv);
 
-		arg_len = strlen(argv[i]);
-		assert (arg_len < 1024 && "arg_len larger than argbuf");
-
-		mem->memcpy(argbuf, in_argv, arg_len+1);
-		assert (strncmp(argbuf, argv[i], arg_len) == 0);
-		in_argv.o += mem->strlen(in_argv) + 1;
+		arg_len = mem->readString(in_argv, argbuf, sizeof(argbuf));
+		assert (arg_len >= 0 && "argv string not in guest memory");
+		assert (arg_len < (ssize_t)sizeof(argbuf) &&
+			"arg_len larger than argbuf");
+		assert (strcmp(argbuf, argv[i]) == 0);
+		in_argv.o += arg_len + 1;
 	}
 #else
 	std::cerr << "[GuestPTImg] can not get argv for current arch\n";
@@ -420,7 +421,7 @@ void GuestPTImg::slurpThreads(void)
 	std::vector<int>		t_pids;
 
 	/* get thread pids from stack names */
-	for (const auto& m : mem->getMaps()) {
+	for (const auto& m : mem->getMappings(GuestMem::MapFilter(PROT_READ))) {
 		int	t_pid, c;
 		c = sscanf(m.getName().c_str(), "[stack:%d]", &t_pid);
 		if (c != 1) continue;
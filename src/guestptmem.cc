@@ -11,12 +11,12 @@ GuestPTMem::GuestPTMem(GuestPTImg* gpimg, pid_t in_pid)
 , pid(in_pid)
 { /* should I bother with tracking the memory maps?*/
 	assert (pid != 0);
+	host_backed = false;
 }
 
 
 GuestPTMem::~GuestPTMem(void)
 {
-	foreach (it, maps.begin(), maps.end()) delete it->second;
 	maps.clear();
 }
 
@@ -149,15 +149,10 @@ void GuestPTMem::import(GuestMem* m)
 	top_brick = m->top_brick;
 	base_brick = m->base_brick;
 	reserve_brick = m->reserve_brick;
+	commit_brick = m->commit_brick;
 	force_flat = m->force_flat;
 	// syspage_data = m->syspage_data;
 
-	foreach (it, m->maps.begin(), m->maps.end()) {
-		guest_ptr	p(it->first);
-		Mapping		*m(it->second);
-
-		recordMapping(*m);
-		if (m->name != NULL)
-			nameMapping(p, *m->name);
-	}
+	/* shares m's table until one of us changes it */
+	restoreLayout(m->captureLayout());
 }
@@ -0,0 +1,433 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "guestsearch.h"
+#include "guestmem.h"
+
+/* positions or words tested together before looking for a candidate */
+#define SEARCH_BLOCK	64
+/* every pattern goes over this much before the next piece, so the
+   piece stays in cache across them */
+#define SEARCH_PIECE	(64 * 1024)
+/* unit of work handed to a worker */
+#define SEARCH_CHUNK	(4 * 1024 * 1024)
+/* chunks per worker per batch of hits */
+#define SEARCH_BATCH	4
+#define MAX_PATTERN	4096
+
+typedef GuestSearch::Hit	Hit;
+
+/* a chunk and the bytes after it that a match starting in it may run
+   into; 'host' is NULL if it must be copied out */
+struct Unit
+{
+	const char	*host;
+	guest_ptr	p;
+	size_t		n;	/* match starts */
+	size_t		avail;	/* bytes readable from p */
+};
+
+class GuestSearch::Scan
+{
+public:
+	Scan(const GuestSearch& _s);
+
+	bool fill(void);
+	void scanUnit(const Unit& u, char* buf, std::vector<Hit>& out) const;
+
+	const GuestSearch	&s;
+	std::vector<Unit>	units;
+	size_t			next_unit;
+	unsigned		workers;
+	std::vector<Hit>	hits;
+	size_t			pos;
+};
+
+GuestSearch::GuestSearch(const GuestMem& _mem)
+: mem(_mem)
+, max_len(0)
+, range_lo(0)
+, range_hi(~0UL)
+, workers(0)
+{}
+
+/* how often a byte turns up in guest memory, roughly; anchors go on
+   rare ones */
+static int commonness(uint8_t b)
+{
+	if (b == 0x00) return 3;
+	if (b == 0xff) return 2;
+	if (b >= 0x20 && b < 0x7f) return 1;
+	return 0;
+}
+
+unsigned GuestSearch::addBytes(const void* pat, size_t len, const void* mask)
+{
+	Pattern		p;
+	int		best0 = -1, best1 = -1;
+
+	assert (len > 0 && len <= MAX_PATTERN);
+
+	p.kind = BYTES;
+	p.bytes = len;
+	p.v = p.span = 0;
+	p.pat.assign((const uint8_t*)pat, (const uint8_t*)pat + len);
+	if (mask != NULL)
+		p.mask.assign((const uint8_t*)mask, (const uint8_t*)mask + len);
+	else
+		p.mask.assign(len, 0xff);
+
+	/* the two best anchors: most bits compared, then rarest */
+	p.a0 = p.a1 = 0;
+	for (unsigned i = 0; i < len; i++) {
+		int	score;
+
+		p.pat[i] &= p.mask[i];
+		score = __builtin_popcount(p.mask[i]) * 4 -
+			commonness(p.pat[i]);
+		if (score > best0) {
+			best1 = best0;
+			p.a1 = p.a0;
+			best0 = score;
+			p.a0 = i;
+		} else if (score > best1) {
+			best1 = score;
+			p.a1 = i;
+		}
+	}
+	if (best1 < 0)
+		p.a1 = p.a0;
+
+	max_len = std::max(max_len, len);
+	pats.push_back(p);
+	return pats.size() - 1;
+}
+
+unsigned GuestSearch::addValue(uint64_t v, unsigned bytes)
+{
+	Pattern	p;
+
+	assert (bytes == 4 || bytes == 8);
+	p.kind = VALUE;
+	p.bytes = bytes;
+	p.v = v;
+	p.span = 0;
+	p.a0 = p.a1 = 0;
+
+	max_len = std::max<size_t>(max_len, bytes);
+	pats.push_back(p);
+	return pats.size() - 1;
+}
+
+unsigned GuestSearch::addPointers(guest_ptr lo, guest_ptr hi, unsigned bytes)
+{
+	Pattern	p;
+
+	if (bytes == 0)
+		bytes = mem.is32Bit() ? 4 : 8;
+	assert (bytes == 4 || bytes == 8);
+	assert (lo <= hi);
+
+	p.kind = POINTER;
+	p.bytes = bytes;
+	p.v = lo.o;
+	p.span = hi - lo;
+	p.a0 = p.a1 = 0;
+	if (bytes == 4) {
+		/* nothing past 4GB fits in a 32-bit word */
+		p.v = std::min<uint64_t>(p.v, 1ULL << 32);
+		p.span = std::min<uint64_t>(hi.o, 1ULL << 32) - p.v;
+	}
+
+	max_len = std::max<size_t>(max_len, bytes);
+	pats.push_back(p);
+	return pats.size() - 1;
+}
+
+/* starts in [0, n) matching 'p'; 'avail' bytes can be read from h */
+static void scanBytes(
+	const uint8_t* h, size_t n, size_t avail,
+	guest_ptr at, unsigned what, const uint8_t* pat, const uint8_t* mask,
+	size_t len, unsigned a0, unsigned a1, std::vector<Hit>& out)
+{
+	const uint8_t	m0 = mask[a0], v0 = pat[a0];
+	const uint8_t	m1 = mask[a1], v1 = pat[a1];
+	size_t		i = 0;
+
+	if (avail < len)
+		return;
+	n = std::min(n, avail - len + 1);
+
+	auto check = [&] (size_t s) {
+		for (size_t j = 0; j < len; j++)
+			if ((h[s + j] & mask[j]) != pat[j])
+				return;
+		out.push_back(Hit{at + s, what, 0});
+	};
+
+	for (; i + SEARCH_BLOCK <= n; i += SEARCH_BLOCK) {
+		const uint8_t	*b0 = h + i + a0, *b1 = h + i + a1;
+		uint8_t		acc = 0;
+
+		for (unsigned k = 0; k < SEARCH_BLOCK; k++)
+			acc |= ((b0[k] & m0) == v0) & ((b1[k] & m1) == v1);
+		if (acc == 0)
+			continue;
+
+		for (unsigned k = 0; k < SEARCH_BLOCK; k++)
+			if ((b0[k] & m0) == v0 && (b1[k] & m1) == v1)
+				check(i + k);
+	}
+
+	for (; i < n; i++)
+		if ((h[i + a0] & m0) == v0 && (h[i + a1] & m1) == v1)
+			check(i);
+}
+
+/* aligned words of [0, n) with match(word) */
+template <typename W, typename F>
+static void scanWords(
+	const uint8_t* h, size_t n, size_t avail, guest_ptr at,
+	unsigned what, F match, std::vector<Hit>& out)
+{
+	const size_t	per_block = SEARCH_BLOCK / sizeof(W);
+	size_t		skip = (-at.o) & (sizeof(W) - 1);
+	const W		*w = (const W*)(h + skip);
+	size_t		nw, i = 0;
+
+	if (avail < sizeof(W))
+		return;
+	n = std::min(n, avail - sizeof(W) + 1);
+	if (n <= skip)
+		return;
+	nw = (n - skip + sizeof(W) - 1) / sizeof(W);
+	at = at + skip;
+
+	for (; i + per_block <= nw; i += per_block) {
+		W	acc = 0;
+
+		for (unsigned k = 0; k < per_block; k++)
+			acc |= match(w[i + k]);
+		if (acc == 0)
+			continue;
+
+		for (unsigned k = 0; k < per_block; k++)
+			if (match(w[i + k]))
+				out.push_back(Hit{
+					at + (i + k)*sizeof(W), what, w[i + k]});
+	}
+
+	for (; i < nw; i++)
+		if (match(w[i]))
+			out.push_back(Hit{at + i*sizeof(W), what, w[i]});
+}
+
+template <typename W>
+static void scanWords(
+	const uint8_t* h, size_t n, size_t avail, guest_ptr at,
+	unsigned what, bool range, uint64_t v, uint64_t span,
+	std::vector<Hit>& out)
+{
+	/* inclusive, so all 4GB of a 32-bit range (span 1<<32) still fits */
+	const W	wv = v, wlast = span - 1;
+
+	/* as W, so 32-bit compares stay 32 bits wide */
+	if (range) {
+		if (span == 0)
+			return;
+		scanWords<W>(h, n, avail, at, what,
+			[wv, wlast] (W x) -> W { return (W)(x - wv) <= wlast; },
+			out);
+	} else
+		scanWords<W>(h, n, avail, at, what,
+			[wv] (W x) -> W { return x == wv; }, out);
+}
+
+GuestSearch::Scan::Scan(const GuestSearch& _s)
+: s(_s)
+, next_unit(0)
+, pos(0)
+{
+	const GuestMem	&mem(s.mem);
+	guest_ptr	run_p(0);
+	size_t		run_len = 0;
+	const char	*run_host = NULL;
+	bool		run_copy = !mem.isHostBacked();
+
+	/* cut a run into chunks, each overlapping the next by the longest
+	   pattern, less a byte */
+	auto cut = [&] () {
+		for (size_t off = 0; off < run_len; off += SEARCH_CHUNK) {
+			Unit	u;
+
+			u.p = run_p + off;
+			u.host = (run_host != NULL) ? run_host + off : NULL;
+			u.n = std::min<size_t>(SEARCH_CHUNK, run_len - off);
+			u.avail = std::min(run_len - off, u.n + s.max_len - 1);
+			units.push_back(u);
+		}
+		run_len = 0;
+	};
+
+	for (const auto &m : mem.getMaps()) {
+		guest_ptr	b(std::max(m.offset, s.range_lo));
+		guest_ptr	e(std::min(m.end(), s.range_hi));
+		const char	*sys = NULL;
+
+		if (!(m.cur_prot & PROT_READ) || b >= e)
+			continue;
+
+		/* the syspage may only be in our own copy */
+		if (m.type == GuestMem::Mapping::VSYSPAGE) {
+			sys = (const char*)mem.getSysHostAddr(m.offset);
+			if (sys == NULL)
+				continue;
+		}
+
+		if (sys == NULL && run_len != 0 && run_p + run_len == b) {
+			run_len += e - b;
+			continue;
+		}
+
+		if (run_len != 0)
+			cut();
+		run_p = b;
+		run_len = e - b;
+		if (sys != NULL) {
+			run_host = sys + (b - m.offset);
+			cut();
+		} else
+			run_host = run_copy ? NULL : (const char*)mem.getHostPtr(b);
+	}
+	if (run_len != 0)
+		cut();
+
+	workers = s.workers;
+	if (workers == 0 && getenv("GUEST_SEARCH_WORKERS") != NULL)
+		workers = atoi(getenv("GUEST_SEARCH_WORKERS"));
+	if (workers == 0)
+		workers = std::thread::hardware_concurrency();
+	/* ptrace only answers the tracing thread */
+	if (run_copy)
+		workers = 1;
+	workers = std::max(1U, workers);
+}
+
+void GuestSearch::Scan::scanUnit(
+	const Unit& u, char* buf, std::vector<Hit>& out) const
+{
+	const uint8_t	*h = (const uint8_t*)u.host;
+
+	if (h == NULL) {
+		/* keep the words' alignment */
+		char	*dst = buf + (u.p.o & (SEARCH_BLOCK - 1));
+		s.mem.memcpy(dst, u.p, u.avail);
+		h = (const uint8_t*)dst;
+	}
+
+	for (size_t off = 0; off < u.n; off += SEARCH_PIECE) {
+		size_t		n = std::min<size_t>(SEARCH_PIECE, u.n - off);
+		size_t		avail = u.avail - off;
+		guest_ptr	at(u.p + off);
+
+		for (unsigned i = 0; i < s.pats.size(); i++) {
+			const Pattern	&p(s.pats[i]);
+
+			if (p.kind == BYTES) {
+				scanBytes(h + off, n, avail, at, i,
+					p.pat.data(), p.mask.data(), p.bytes,
+					p.a0, p.a1, out);
+			} else if (p.bytes == 4) {
+				scanWords<uint32_t>(h + off, n, avail, at, i,
+					p.kind == POINTER, p.v, p.span, out);
+			} else {
+				scanWords<uint64_t>(h + off, n, avail, at, i,
+					p.kind == POINTER, p.v, p.span, out);
+			}
+		}
+	}
+
+	std::sort(out.begin(), out.end(), [] (const Hit& a, const Hit& b) {
+		return (a.p != b.p) ? a.p < b.p : a.what < b.what; });
+}
+
+/* the next batch of chunks with any hits in them; false at the end */
+bool GuestSearch::Scan::fill(void)
+{
+	hits.clear();
+	pos = 0;
+
+	while (hits.empty() && next_unit < units.size()) {
+		size_t					first = next_unit;
+		size_t					batch;
+		std::vector<std::vector<Hit>>		out;
+		std::vector<std::thread>		threads;
+		std::atomic<size_t>			next_work(0);
+		unsigned				n;
+
+		batch = std::min<size_t>(
+			workers * SEARCH_BATCH, units.size() - first);
+		out.resize(batch);
+		next_unit += batch;
+
+		auto run = [&] () {
+			std::vector<char>	buf;
+			size_t			w;
+
+			if (!s.mem.isHostBacked())
+				buf.resize(SEARCH_CHUNK + MAX_PATTERN +
+					SEARCH_BLOCK);
+			while ((w = next_work++) < batch)
+				scanUnit(units[first + w], buf.data(), out[w]);
+		};
+
+		n = std::min<size_t>(workers, batch);
+		for (unsigned i = 1; i < n; i++)
+			threads.push_back(std::thread(run));
+		run();
+		for (auto &t : threads)
+			t.join();
+
+		for (auto &o : out)
+			hits.insert(hits.end(), o.begin(), o.end());
+	}
+
+	return !hits.empty();
+}
+
+GuestSearch::iterator GuestSearch::begin(void) const
+{
+	iterator	it;
+
+	it.scan = std::make_shared<Scan>(*this);
+	if (!it.scan->fill())
+		it.scan.reset();
+	return it;
+}
+
+const Hit& GuestSearch::iterator::operator*(void) const
+{
+	assert (scan != nullptr && "past the end");
+	return scan->hits[scan->pos];
+}
+
+GuestSearch::iterator& GuestSearch::iterator::operator++(void)
+{
+	assert (scan != nullptr && "past the end");
+	if (++scan->pos == scan->hits.size() && !scan->fill())
+		scan.reset();
+	return *this;
+}
+
+std::vector<Hit> GuestSearch::findAll(void) const
+{
+	std::vector<Hit>	ret;
+	for (const auto &h : *this)
+		ret.push_back(h);
+	return ret;
+}
@@ -0,0 +1,113 @@
+/* searching all of guest memory for many patterns at once */
+#ifndef GUESTSEARCH_H
+#define GUESTSEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "guestptr.h"
+
+class GuestMem;
+
+/* Patterns are added up front; each add returns the index its hits
+ * carry. Byte patterns take an optional mask (bits to compare), values
+ * and pointers are 4 or 8 bytes at aligned addresses. Every readable
+ * mapping is cut into chunks handed to worker threads a batch at a time,
+ * and iterating streams the hits out in address order, batch by batch,
+ * so stopping early doesn't pay for the rest. Matches lie wholly inside
+ * a run of adjacent readable mappings (and the range, if one is set).
+ *
+ * Inner loops test a block of positions at once against a couple of
+ * anchor bytes or the words sought, with no early exit inside a block,
+ * so they vectorize with plain SSE2/NEON; only blocks with a candidate
+ * get looked at a position at a time.
+ *
+ * The search reads memory as it is while iterating; the GuestMem and
+ * this must outlive any iterator, and the mapping table mustn't change
+ * under one unless shared reads are on */
+class GuestSearch
+{
+public:
+	/* for values and pointers, 'val' is the word found */
+	struct Hit
+	{
+		guest_ptr	p;
+		unsigned	what;
+		uint64_t	val;
+	};
+
+	explicit GuestSearch(const GuestMem& _mem);
+
+	/* 'mask' (len bytes, or NULL for all bits) picks bits to compare */
+	unsigned addBytes(const void* pat, size_t len, const void* mask = NULL);
+	unsigned addString(const std::string& s)
+	{ return addBytes(s.data(), s.size()); }
+	/* 'bytes' is 4 or 8 */
+	unsigned addValue(uint64_t v, unsigned bytes = 8);
+	/* words in [lo, hi); the guest's word size if 'bytes' is 0 */
+	unsigned addPointers(guest_ptr lo, guest_ptr hi, unsigned bytes = 0);
+
+	/* only look in [lo, hi) */
+	void setRange(guest_ptr lo, guest_ptr hi) { range_lo = lo; range_hi = hi; }
+	/* 0 means GUEST_SEARCH_WORKERS or one per cpu */
+	void setWorkers(unsigned n) { workers = n; }
+
+	class Scan;
+
+	class iterator
+	{
+	public:
+		typedef std::input_iterator_tag	iterator_category;
+		typedef Hit			value_type;
+		typedef ptrdiff_t		difference_type;
+		typedef const Hit*		pointer;
+		typedef const Hit&		reference;
+
+		iterator(void) {}
+		const Hit& operator*(void) const;
+		const Hit* operator->(void) const { return &**this; }
+		iterator& operator++(void);
+		bool operator==(const iterator& it) const
+		{ return scan == it.scan; }
+		bool operator!=(const iterator& it) const
+		{ return scan != it.scan; }
+	private:
+		friend class GuestSearch;
+		std::shared_ptr<Scan>	scan;
+	};
+
+	/* starts a fresh pass every time */
+	iterator begin(void) const;
+	iterator end(void) const { return iterator(); }
+
+	/* everything at once */
+	std::vector<Hit> findAll(void) const;
+
+private:
+	friend class Scan;
+
+	enum Kind { BYTES, VALUE, POINTER };
+
+	struct Pattern
+	{
+		Kind			kind;
+		std::vector<uint8_t>	pat;	/* already masked */
+		std::vector<uint8_t>	mask;
+		unsigned		a0, a1;	/* anchor offsets into pat */
+		unsigned		bytes;
+		uint64_t		v;	/* value, or low end of range */
+		uint64_t		span;	/* up to 1<<32 for 4 bytes */
+	};
+
+	const GuestMem		&mem;
+	std::vector<Pattern>	pats;
+	size_t			max_len;
+	guest_ptr		range_lo, range_hi;
+	unsigned		workers;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "guestshadow.h"
+
+GuestShadow::GuestShadow(size_t _page_bytes)
+: page_bytes(_page_bytes)
+, page_c(0)
+{
+	assert (page_bytes != 0);
+}
+
+GuestShadow::~GuestShadow(void) { clear(); }
+
+void GuestShadow::place(uintptr_t pg, uint8_t* s)
+{
+	*tab.get(pg) = s;
+	page_c++;
+}
+
+uint8_t* GuestShadow::alloc(uintptr_t pg)
+{
+	uint8_t	*s;
+
+	if (pg >= tab_t::MAX_PAGES)
+		return NULL;
+
+	s = (uint8_t*)calloc(1, page_bytes);
+	assert (s != NULL);
+	place(pg, s);
+	return s;
+}
+
+/* pull every page of [pg, end) with shadow out of the table and hand
+   it to f */
+template <typename F>
+void GuestShadow::take(uintptr_t pg, uintptr_t end, F f)
+{
+	if (page_c == 0)
+		return;
+
+	tab.each(pg, end, false, [this, &f] (uintptr_t p, uint8_t*& s) {
+		if (s == NULL)
+			return;
+		f(p, s);
+		s = NULL;
+		page_c--;
+	});
+}
+
+void GuestShadow::drop(guest_ptr b, guest_ptr e)
+{
+	take(	tab_t::pageOf(b), tab_t::pageEnd(e),
+		[] (uintptr_t, uint8_t* s) { free(s); });
+}
+
+void GuestShadow::move(guest_ptr from, size_t len, guest_ptr to)
+{
+	std::vector<std::pair<uintptr_t, uint8_t*>>	moved;
+	uintptr_t	from_pg = tab_t::pageOf(from);
+	uintptr_t	to_pg = tab_t::pageOf(to);
+
+	assert (!(from.o & (tab_t::PAGE_BYTES - 1)));
+	assert (!(to.o & (tab_t::PAGE_BYTES - 1)));
+	if (page_c == 0 || from == to)
+		return;
+
+	/* out with all of them first; the ranges may overlap */
+	take(	from_pg, tab_t::pageEnd(from + len),
+		[&] (uintptr_t pg, uint8_t* s) {
+			moved.emplace_back(to_pg + (pg - from_pg), s); });
+
+	drop(to, to + len);
+	for (const auto &m : moved) {
+		if (m.first >= tab_t::MAX_PAGES)
+			free(m.second);
+		else
+			place(m.first, m.second);
+	}
+}
+
+void GuestShadow::clear(void)
+{
+	take(0, tab_t::MAX_PAGES, [] (uintptr_t, uint8_t* s) { free(s); });
+}
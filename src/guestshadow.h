@@ -0,0 +1,74 @@
+/* per-page metadata kept alongside guest memory, for analysis tools */
+#ifndef GUESTSHADOW_H
+#define GUESTSHADOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pagetable.h"
+
+/* Each guest page gets 'page_bytes' of zeroed shadow the first time it
+ * is asked for; a byte per guest byte for taint, a bit per byte (512) for
+ * definedness, a small struct for allocation tracking. Page pointers sit
+ * in a PageTable, so finding a page's shadow is three loads, and pages
+ * no one asked for cost nothing.
+ *
+ * GuestMem drops a page's shadow when the page goes away (munmap, an mmap
+ * over it, the heap shrinking) and moves it along with mremap. Addresses
+ * past 48 bits have no shadow. Not thread safe; use it from the thread
+ * updating the guest */
+class GuestShadow
+{
+public:
+	explicit GuestShadow(size_t page_bytes);
+	~GuestShadow(void);
+
+	size_t getPageBytes(void) const { return page_bytes; }
+	/* pages with shadow */
+	size_t getPageCount(void) const { return page_c; }
+
+	/* shadow of p's page, NULL if it has none yet */
+	uint8_t* peek(guest_ptr p) const
+	{
+		uint8_t	*const *s = tab.find(tab_t::pageOf(p));
+		return (s != NULL) ? *s : NULL;
+	}
+
+	/* shadow of p's page, zeroed on first use; NULL past 48 bits */
+	uint8_t* get(guest_ptr p)
+	{
+		uint8_t	*s = peek(p);
+		return (s != NULL) ? s : alloc(tab_t::pageOf(p));
+	}
+
+	/* where guest byte p falls in its page's shadow */
+	size_t offsetOf(guest_ptr p) const
+	{
+		return ((p.o & (tab_t::PAGE_BYTES - 1)) * page_bytes)
+			>> tab_t::PG_BITS;
+	}
+
+	/* forget the shadow of every page touching [b, e) */
+	void drop(guest_ptr b, guest_ptr e);
+	/* pages of [from, from+len) now live at 'to'; shadow there
+	   before is dropped */
+	void move(guest_ptr from, size_t len, guest_ptr to);
+	void clear(void);
+
+private:
+	GuestShadow(const GuestShadow&) = delete;
+	GuestShadow& operator=(const GuestShadow&) = delete;
+
+	typedef PageTable<uint8_t*>	tab_t;
+
+	uint8_t* alloc(uintptr_t pg);
+	void place(uintptr_t pg, uint8_t* s);
+	template <typename F>
+	void take(uintptr_t pg, uintptr_t end, F f);
+
+	size_t	page_bytes;
+	size_t	page_c;
+	tab_t	tab;
+};
+
+#endif
@@ -131,6 +131,7 @@ void GuestSnapshot::loadMappings(void)
 		break;
 	}
 
+	GuestMem::MapBatch	batch(mem);
 	while (fgets(buf, BUFSZ, f) != NULL) {
 		guest_ptr			begin, end, mmap_addr;
 		size_t				length;
@@ -180,7 +181,7 @@ void GuestSnapshot::loadMappings(void)
 			begin,
 			length,
 			prot,
-			MAP_PRIVATE | MAP_FIXED,
+			MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
 			fd,
 			0);
 
@@ -345,11 +346,60 @@ static void saveSymbolsDiff(
 	(void)err;
 }
 
-void saveMappingsDiff(
+/* does 'm' have any pages in the (sorted) dirty run list? */
+static bool hasDirty(
+	const std::vector<GuestMem::pagerun_t>& dirty,
+	const GuestMem::Mapping& m)
+{
+	auto it = std::upper_bound(dirty.begin(), dirty.end(), m.offset,
+		[] (guest_ptr p, const GuestMem::pagerun_t& r)
+		{ return p < r.first + r.second; });
+	return it != dirty.end() && it->first < m.end();
+}
+
+/* start 'path' off as a copy of the last capture of the mapping, so
+   only dirty pages need writing. the kernel can share extents on
+   filesystems that support it. returns the fd, or -1 */
+static int cloneLastMapping(const char* last_path, const char* path, size_t len)
+{
+	struct stat	s;
+	int		src_fd, dst_fd;
+	loff_t		off_in = 0, off_out = 0;
+
+	src_fd = open(last_path, O_RDONLY | O_CLOEXEC);
+	if (src_fd < 0)
+		return -1;
+
+	if (fstat(src_fd, &s) != 0 || (size_t)s.st_size != len) {
+		close(src_fd);
+		return -1;
+	}
+
+	dst_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	assert (dst_fd >= 0 && "Couldn't open mem range file");
+
+	while ((size_t)off_out < len) {
+		ssize_t	sz = copy_file_range(
+			src_fd, &off_in, dst_fd, &off_out,
+			len - off_out, 0);
+		if (sz <= 0) {
+			close(src_fd);
+			close(dst_fd);
+			unlink(path);
+			return -1;
+		}
+	}
+
+	close(src_fd);
+	return dst_fd;
+}
+
+static void saveMappingsDiff(
 	const Guest* g,
 	const char* dirpath,
 	const char* last_dirname,
-	const std::set<guest_ptr>& changed_maps)
+	const std::set<guest_ptr>& changed_maps,
+	const std::vector<GuestMem::pagerun_t>* dirty)
 {
 	/* save guestmem to mapinfo file */
 	SETUP_F_W("mapinfo")
@@ -359,11 +409,10 @@ void saveMappingsDiff(
 	mkdir(buf, 0755);
 
 	/* add mappings */
-	list<GuestMem::Mapping> maps = g->getMem()->getMaps();
-	for (const auto& mapping : g->getMem()->getMaps()) {
-		FILE		*map_f;
-		ssize_t		sz;
-		char		*buffer;
+	for (const auto& mapping :
+		g->getMem()->getMappings(GuestMem::MapFilter(PROT_READ)))
+	{
+		int		map_fd, err;
 		char		last_buf[BUFSZ];
 		struct stat	s;
 
@@ -382,10 +431,12 @@ void saveMappingsDiff(
 			last_dirname,
 			(void*)mapping.offset.o);
 
+		bool changed = (dirty != NULL)
+			? hasDirty(*dirty, mapping)
+			: changed_maps.count(mapping.offset) != 0;
+
 		/* no change and exists in diff? setup symlink */
-		if (	changed_maps.count(mapping.offset) == 0 &&
-			stat(last_buf, &s) == 0)
-		{
+		if (!changed && stat(last_buf, &s) == 0) {
 			char	real_p[BUFSZ];
 			ssize_t	rl_sz;
 
@@ -398,17 +449,40 @@ void saveMappingsDiff(
 				continue;
 		}
 
+		/* only dirty pages differ from the last capture */
+		map_fd = (dirty != NULL)
+			? cloneLastMapping(last_buf, buf, mapping.length)
+			: -1;
+		if (map_fd >= 0) {
+			auto it = std::upper_bound(
+				dirty->begin(), dirty->end(), mapping.offset,
+				[] (guest_ptr p, const GuestMem::pagerun_t& r)
+				{ return p < r.first + r.second; });
+
+			for (; it != dirty->end() && it->first < mapping.end(); ++it) {
+				guest_ptr	b(std::max<uintptr_t>(
+					it->first, mapping.offset));
+				guest_ptr	e(std::min<uintptr_t>(
+					it->first + it->second, mapping.end()));
+
+				err = g->getMem()->copyToFile(
+					map_fd, b - mapping.offset, b, e - b);
+				assert (err == 0 && "Failed to write mapping");
+			}
+
+			close(map_fd);
+			continue;
+		}
+
 		/* changed / doesn't exist in prior sshot, write out */
-		map_f = fopen(buf, "w");
-		assert (map_f && "Couldn't open mem range file");
+		map_fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		assert (map_fd >= 0 && "Couldn't open mem range file");
 
-		buffer = new char[mapping.length];
-		g->getMem()->memcpy(buffer, mapping.offset, mapping.length);
-		sz = fwrite(buffer, mapping.length, 1, map_f);
-		delete [] buffer;
-		assert (sz == 1 && "Failed to write mapping");
+		err = g->getMem()->copyToFile(
+			map_fd, 0, mapping.offset, mapping.length, true);
+		assert (err == 0 && "Failed to write mapping");
 
-		fclose(map_f);
+		close(map_fd);
 	}
 
 	END_F()
@@ -420,6 +494,23 @@ void GuestSnapshot::saveDiff(
 	const char* dirname,
 	const char* last_dirname,
 	const std::set<guest_ptr>& changed_maps)
+{ saveDiff(g, dirname, last_dirname, changed_maps, NULL); }
+
+void GuestSnapshot::saveDiff(
+	const Guest* g, const char* dirname, const char* last_dirname)
+{
+	std::vector<GuestMem::pagerun_t>	dirty;
+
+	dirty = g->getMem()->getDirtyPages();
+	saveDiff(g, dirname, last_dirname, std::set<guest_ptr>(), &dirty);
+}
+
+void GuestSnapshot::saveDiff(
+	const Guest* g,
+	const char* dirname,
+	const char* last_dirname,
+	const std::set<guest_ptr>& changed_maps,
+	const std::vector<GuestMem::pagerun_t>* dirty)
 {
 	char	full_last_dir[512];
 
@@ -434,7 +525,7 @@ void GuestSnapshot::saveDiff(
 	}
 
 	saveSundries(g, dirname);
-	saveMappingsDiff(g, dirname, full_last_dir, changed_maps);
+	saveMappingsDiff(g, dirname, full_last_dir, changed_maps, dirty);
 	saveSymbolsDiff(dirname, full_last_dir, "syms");
 	saveSymbolsDiff(dirname, full_last_dir, "dynsyms");
 }
@@ -467,9 +558,10 @@ static void saveMappings(const Guest* g, const char* dirpath)
 	mkdir(buf, 0755);
 
 	/* add mappings */
-	for (const auto& mapping : g->getMem()->getMaps()) {
-		FILE	*map_f;
-		ssize_t	sz;
+	for (const auto& mapping :
+		g->getMem()->getMappings(GuestMem::MapFilter(PROT_READ)))
+	{
+		int	map_fd;
 
 		/* range, prot, type, name */
 		fprintf(f, "%p-%p %d %d %s\n",
@@ -481,23 +573,22 @@ static void saveMappings(const Guest* g, const char* dirpath)
 
 		snprintf(buf, BUFSZ, "%s/maps/%p", dirpath,
 			(void*)mapping.offset.o);
-		map_f = fopen(buf, "w");
-		assert (map_f && "Couldn't open mem range file");
+		map_fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		assert (map_fd >= 0 && "Couldn't open mem range file");
 
 		const void *syspage_buf;
 		syspage_buf = g->getMem()->getSysHostAddr(mapping.offset);
 		if (!syspage_buf) {
-			char* buffer = new char[mapping.length];
-			g->getMem()->memcpy(buffer, mapping.offset, mapping.length);
-			sz = fwrite(buffer, mapping.length, 1, map_f);
-			delete [] buffer;
+			int err = g->getMem()->copyToFile(
+				map_fd, 0, mapping.offset, mapping.length, true);
+			assert (err == 0 && "Failed to write mapping");
 		} else {
-			sz = fwrite(syspage_buf, mapping.length, 1, map_f);
+			ssize_t sz = write(map_fd, syspage_buf, mapping.length);
+			assert (sz == (ssize_t)mapping.length &&
+				"Failed to write mapping");
 		}
 
-		assert (sz == 1 && "Failed to write mapping");
-
-		fclose(map_f);
+		close(map_fd);
 	}
 
 	END_F()
@@ -505,7 +596,7 @@ static void saveMappings(const Guest* g, const char* dirpath)
 
 
 char* GuestSnapshot::readMemory(
-	const char* dirpath, guest_ptr p, unsigned int len)
+	const char* dirpath, guest_ptr p, size_t len)
 {
 	char			*read_mem;
 	FILE			*f;
@@ -9,7 +9,7 @@ class GuestSnapshot : public Guest
 {
 public:
 	static GuestSnapshot* create(const char* dirname);
-	static char* readMemory(const char* dirname, guest_ptr p, unsigned int len);
+	static char* readMemory(const char* dirname, guest_ptr p, size_t len);
 	virtual ~GuestSnapshot(void);
 	static void save(const Guest*, const char* dirname);
 	static void saveDiff(
@@ -17,6 +17,12 @@ public:
 		const char* dirname,
 		const char* last_dirname,
 		const std::set<guest_ptr>& changed_maps);
+	/* takes what changed from the guest memory's dirty page log and
+	   copies out only written pages; checkpoint() the memory after */
+	static void saveDiff(
+		const Guest*,
+		const char* dirname,
+		const char* last_dirname);
 
 	guest_ptr getEntryPoint(void) const override { return entry_pt; }
 	Arch::Arch getArch(void) const override { return arch; }
@@ -38,6 +44,12 @@ protected:
 	std::unique_ptr<Symbols> loadDynSymbols(void) const override;
 
 private:
+	static void saveDiff(
+		const Guest*,
+		const char* dirname,
+		const char* last_dirname,
+		const std::set<guest_ptr>& changed_maps,
+		const std::vector<GuestMem::pagerun_t>* dirty);
 	static void saveSymbols(
 		const Symbols& g_syms,
 		const char* dirpath,
@@ -0,0 +1,68 @@
+#include <string.h>
+
+#include "pagehash.h"
+
+#define HASH_LANES	8
+#define STRIPE_SZ	(HASH_LANES * sizeof(uint64_t))
+/* moves the per-lane keys along so identical stripes at different
+   offsets don't cancel out */
+#define KEY_STEP	0x9e3779b97f4a7c15ULL
+
+static const uint64_t lane_keys[HASH_LANES] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+	0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+	0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL };
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+PageHash PageHash::compute(const void* p, size_t len)
+{
+	const char	*b = (const char*)p;
+	uint64_t	acc[HASH_LANES], key[HASH_LANES];
+	uint64_t	tail[HASH_LANES];
+	size_t		stripes = len / STRIPE_SZ, rem;
+	PageHash	h(len ^ 0x27d4eb2f165667c5ULL, ~len);
+
+	for (unsigned i = 0; i < HASH_LANES; i++) {
+		acc[i] = lane_keys[HASH_LANES - 1 - i];
+		key[i] = lane_keys[i];
+	}
+
+	for (size_t s = 0; s < stripes; s++, b += STRIPE_SZ) {
+		uint64_t	d[HASH_LANES];
+
+		memcpy(d, b, STRIPE_SZ);
+		for (unsigned i = 0; i < HASH_LANES; i++) {
+			uint64_t	dk = d[i] ^ key[i];
+			acc[i] += d[i] + (dk & 0xffffffffULL) * (dk >> 32);
+			key[i] += KEY_STEP;
+		}
+	}
+
+	/* zero-padded last stripe; len is already folded in */
+	rem = len % STRIPE_SZ;
+	if (rem) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, b, rem);
+		for (unsigned i = 0; i < HASH_LANES; i++) {
+			uint64_t	dk = tail[i] ^ key[i];
+			acc[i] += tail[i] + (dk & 0xffffffffULL) * (dk >> 32);
+		}
+	}
+
+	for (unsigned i = 0; i < HASH_LANES; i++) {
+		h.lo = fmix64(h.lo ^ acc[i]);
+		h.hi = fmix64(h.hi + acc[i] * 0x9fb21c651e98df25ULL);
+	}
+
+	return h;
+}
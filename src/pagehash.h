@@ -0,0 +1,26 @@
+/* content hashes for telling what changed between captures */
+#ifndef PAGEHASH_H
+#define PAGEHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* 128-bit, fast, not cryptographic. The inner loop only needs 64-bit
+ * add/xor and 32x32->64 multiplies across eight independent lanes, so it
+ * vectorizes with plain SSE2/NEON. */
+class PageHash
+{
+public:
+	PageHash(void) : lo(0), hi(0) {}
+	PageHash(uint64_t _lo, uint64_t _hi) : lo(_lo), hi(_hi) {}
+
+	static PageHash compute(const void* p, size_t len);
+
+	bool operator==(const PageHash& h) const
+	{ return lo == h.lo && hi == h.hi; }
+	bool operator!=(const PageHash& h) const { return !(*this == h); }
+
+	uint64_t	lo, hi;
+};
+
+#endif
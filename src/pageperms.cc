@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "pageperms.h"
+
+/* 'prot' repeated for all 32 pages of a word */
+static const uint64_t fill_words[4] = {
+	0, 0x5555555555555555ULL, 0xaaaaaaaaaaaaaaaaULL, ~0ULL };
+
+void PagePerms::set(guest_ptr b, guest_ptr e, int prot)
+{
+	prot &= PROT_READ | PROT_WRITE;
+
+	/* leaves are only made for pages that get some access */
+	tab.eachLeaf(tab_t::pageOf(b), tab_t::pageEnd(e), prot != 0,
+		[this, prot] (word_t* leaf, uintptr_t base, uintptr_t pg,
+			uintptr_t end) {
+			fillLeaf(leaf, pg - base, end - base, prot); });
+}
+
+/* pages [b, e) of one leaf; whole words are stored outright */
+void PagePerms::fillLeaf(word_t* leaf, uintptr_t b, uintptr_t e, int prot)
+{
+	uint64_t	fill = fill_words[prot];
+
+	while (b < e) {
+		size_t		w = b / PAGES_PER_WORD;
+		unsigned	lo = b % PAGES_PER_WORD;
+		unsigned	n = std::min<uintptr_t>(e - b, PAGES_PER_WORD - lo);
+		uint64_t	mask, old;
+
+		if (n == PAGES_PER_WORD) {
+			for (; e - b >= PAGES_PER_WORD; b += PAGES_PER_WORD)
+				leaf[b / PAGES_PER_WORD].store(
+					fill, std::memory_order_relaxed);
+			continue;
+		}
+
+		mask = ((1ULL << (n * 2)) - 1) << (lo * 2);
+		old = leaf[w].load(std::memory_order_relaxed);
+		leaf[w].store((old & ~mask) | (fill & mask),
+			std::memory_order_relaxed);
+		b += n;
+	}
+}
+
+void PagePerms::clear(void)
+{
+	tab.eachLeaf(0, tab_t::MAX_PAGES, false,
+		[] (word_t* leaf, uintptr_t, uintptr_t, uintptr_t) {
+			for (size_t w = 0; w < tab_t::LEAF_ENTS; w++)
+				leaf[w].store(0, std::memory_order_relaxed);
+		});
+}
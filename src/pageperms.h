@@ -0,0 +1,69 @@
+/* read/write permission of every guest page, two bits apiece */
+#ifndef PAGEPERMS_H
+#define PAGEPERMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "pagetable.h"
+
+/* Kept in step with the mapping table so accesses can be checked with a
+ * couple of loads per page instead of a table search. Words of 32 pages
+ * sit in a PageTable; anything above 48 bits is never accessible.
+ * get()/allows() are safe against one thread calling set() at the same
+ * time */
+class PagePerms
+{
+public:
+	PagePerms(void) {}
+
+	/* [b, e) becomes 'prot' (PROT_READ and PROT_WRITE only) */
+	void set(guest_ptr b, guest_ptr e, int prot);
+	/* everything inaccessible */
+	void clear(void);
+
+	int get(guest_ptr p) const
+	{
+		uintptr_t	pg = tab_t::pageOf(p);
+		const word_t	*w = tab.find(pg);
+
+		if (w == NULL)
+			return 0;
+		return (w->load(std::memory_order_relaxed)
+			>> ((pg % PAGES_PER_WORD) * 2)) & 3;
+	}
+
+	/* every page of [p, p+len) has all of 'prot'; one probe a page */
+	bool allows(guest_ptr p, size_t len, int prot) const
+	{
+		uintptr_t	pg, last;
+
+		if (len == 0)
+			return true;
+		if (p.o + len < p.o)
+			return false;
+
+		last = tab_t::pageOf(guest_ptr(p.o + len - 1));
+		for (pg = tab_t::pageOf(p); pg <= last; pg++)
+			if ((get(guest_ptr(pg << tab_t::PG_BITS)) & prot) != prot)
+				return false;
+		return true;
+	}
+
+private:
+	PagePerms(const PagePerms&) = delete;
+	PagePerms& operator=(const PagePerms&) = delete;
+
+	static const unsigned PAGES_PER_WORD = 32;
+
+	typedef std::atomic<uint64_t>			word_t;
+	typedef PageTable<word_t, PAGES_PER_WORD>	tab_t;
+
+	void fillLeaf(word_t* leaf, uintptr_t b, uintptr_t e, int prot);
+
+	tab_t	tab;
+};
+
+#endif
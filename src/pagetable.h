@@ -0,0 +1,163 @@
+/* an entry for every guest page, found straight from the address */
+#ifndef PAGETABLE_H
+#define PAGETABLE_H
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "guestptr.h"
+
+/* Two levels: a directory of 1GB leaves, each an array of entries for
+ * its pages, so a lookup is three loads. A 48-bit address space needs a
+ * directory of 2^18 leaf pointers (2MB, but only what gets used is ever
+ * backed); it and the leaves are calloc'd on first use, so pages no one
+ * asked about cost nothing. Addresses past 48 bits have no entry.
+ *
+ * An entry covers PER_ENT pages, for tables that pack bits. T has to be
+ * valid as zero bytes: a pointer, a number, or an atomic one. Lookups
+ * are safe against one thread adding leaves; leaves are only freed with
+ * the table */
+template <typename T, unsigned PER_ENT = 1>
+class PageTable
+{
+public:
+	static const unsigned PG_BITS = 12;
+	static const uintptr_t PAGE_BYTES = 1UL << PG_BITS;
+	static const unsigned LEAF_BITS = 18;
+	static const unsigned DIR_BITS = 48 - PG_BITS - LEAF_BITS;
+	static const uintptr_t LEAF_PAGES = 1UL << LEAF_BITS;
+	static const uintptr_t MAX_PAGES = 1UL << (LEAF_BITS + DIR_BITS);
+	static const size_t LEAF_ENTS = LEAF_PAGES / PER_ENT;
+
+	PageTable(void) : dir(NULL) {}
+	~PageTable(void)
+	{
+		leaf_t	*d = dir.load();
+
+		if (d == NULL)
+			return;
+		for (auto i : leaves)
+			free(d[i].load());
+		free(d);
+	}
+
+	static uintptr_t pageOf(guest_ptr p) { return p.o >> PG_BITS; }
+	/* page just past [.., e), or past 48 bits if e is */
+	static uintptr_t pageEnd(guest_ptr e)
+	{ return std::min((e.o + PAGE_BYTES - 1) >> PG_BITS, MAX_PAGES); }
+
+	/* page pg's entry, NULL if its leaf was never made */
+	const T* find(uintptr_t pg) const
+	{
+		const T	*leaf;
+
+		if (pg >= MAX_PAGES || (leaf = leafAt(pg >> LEAF_BITS)) == NULL)
+			return NULL;
+		return &leaf[(pg & (LEAF_PAGES - 1)) / PER_ENT];
+	}
+	T* find(uintptr_t pg)
+	{ return const_cast<T*>(((const PageTable*)this)->find(pg)); }
+
+	/* as find(), but makes the leaf; NULL only past 48 bits */
+	T* get(uintptr_t pg)
+	{
+		T	*t = find(pg);
+
+		if (t != NULL || pg >= MAX_PAGES)
+			return t;
+		t = addLeaf(pg >> LEAF_BITS);
+		return &t[(pg & (LEAF_PAGES - 1)) / PER_ENT];
+	}
+
+	/* f(leaf, base, b, e) for the pages [b, e) of each leaf that
+	   [pg, end) touches, 'base' being the leaf's first page. Missing
+	   leaves are skipped, or made if 'alloc' */
+	template <typename F>
+	void eachLeaf(uintptr_t pg, uintptr_t end, bool alloc, F f)
+	{
+		end = std::min(end, MAX_PAGES);
+		if (!alloc && dir.load(std::memory_order_relaxed) == NULL)
+			return;
+
+		while (pg < end) {
+			size_t		slot = pg >> LEAF_BITS;
+			uintptr_t	base = slot << LEAF_BITS;
+			uintptr_t	e_pg = std::min(end, base + LEAF_PAGES);
+			T		*leaf = leafAt(slot);
+
+			if (leaf == NULL && alloc)
+				leaf = addLeaf(slot);
+			if (leaf != NULL)
+				f(leaf, base, pg, e_pg);
+			pg = e_pg;
+		}
+	}
+
+	/* f(pg, entry) for every page of [pg, end) with a leaf */
+	template <typename F>
+	void each(uintptr_t pg, uintptr_t end, bool alloc, F f)
+	{
+		static_assert(PER_ENT == 1, "entries are shared by pages");
+		eachLeaf(pg, end, alloc,
+			[&f] (T* leaf, uintptr_t base, uintptr_t b, uintptr_t e) {
+				for (; b < e; b++)
+					f(b, leaf[b - base]);
+			});
+	}
+
+private:
+	PageTable(const PageTable&) = delete;
+	PageTable& operator=(const PageTable&) = delete;
+
+	typedef std::atomic<T*>	leaf_t;
+
+	T* leafAt(size_t slot) const
+	{
+		leaf_t	*d = dir.load(std::memory_order_acquire);
+		return (d != NULL) ? d[slot].load(std::memory_order_acquire) : NULL;
+	}
+
+	T* addLeaf(size_t slot)
+	{
+		leaf_t	*d = dir.load(std::memory_order_relaxed);
+		T	*leaf;
+
+		if (d == NULL) {
+			d = (leaf_t*)calloc(1UL << DIR_BITS, sizeof(leaf_t));
+			assert (d != NULL);
+			dir.store(d, std::memory_order_release);
+		}
+
+		leaf = (T*)calloc(LEAF_ENTS, sizeof(T));
+		assert (leaf != NULL);
+		d[slot].store(leaf, std::memory_order_release);
+		leaves.push_back(slot);
+		return leaf;
+	}
+
+	std::atomic<leaf_t*>	dir;
+	std::vector<size_t>	leaves;	/* directory slots in use */
+};
+
+/* host protection of the page at 'host' becomes 'prot'; signal safe */
+static inline void hostProtect(void* host, int prot)
+{ ::mprotect(host, PageTable<char>::PAGE_BYTES, prot); }
+
+/* takes write access away from a page of a larger host mapping that has
+ * it now. The page is written to first, while it's still part of the
+ * whole mapping, so the piece the mprotect splits off shares its
+ * anon_vma; otherwise the host can't merge the pieces back later and
+ * mremap fails across them. 0 or -1, as mprotect */
+static inline int hostWriteProtect(void* host, int prot)
+{
+	((std::atomic<uint8_t>*)host)->fetch_or(0, std::memory_order_relaxed);
+	return ::mprotect(host, PageTable<char>::PAGE_BYTES, prot & ~PROT_WRITE);
+}
+
+#endif
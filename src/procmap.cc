@@ -3,14 +3,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/ptrace.h>
 #include <unistd.h>
+#include <algorithm>
 
 #include "procmap.h"
 
+/* /proc/pid/mem is read this much at a time */
+#define COPY_CHUNK	(1 << 20)
+#define COPY_PAGE	4096
+
 bool ProcMap::dump_maps = false;
 
 int ProcMap::getProt(void) const
@@ -100,11 +106,13 @@ void ProcMap::mapStack(pid_t pid)
 		mem_end);
 }
 
+/* a chunk at a time; one read() stops short at 2GB. Only pages that
+   differ from what's there already are written, so pages the process
+   never touched stay unbacked here too */
 bool ProcMap::procMemCopy(pid_t pid, guest_ptr m_beg, guest_ptr m_end)
 {
 	char	path[128];
-	off_t	off;
-	ssize_t	br;
+	char	*buf;
 	int	fd;
 	bool	ret = false;
 
@@ -117,23 +125,30 @@ bool ProcMap::procMemCopy(pid_t pid, guest_ptr m_beg, guest_ptr m_end)
 		return false;
 	}
 
-	off = lseek(fd, m_beg.o, SEEK_SET);
-	if (off != (off_t)m_beg.o) {
-		std::cerr << "[ProcMap] could not seek to "
-			  << (void*)m_beg.o << '\n';
-		goto done;
-	}
+	buf = new char[COPY_CHUNK];
+	for (guest_ptr p = m_beg; p < m_end; ) {
+		char	*host = (char*)mem->getHostPtr(p);
+		ssize_t	br;
+
+		br = pread(fd, buf, std::min<size_t>(COPY_CHUNK, m_end - p), p.o);
+		if (br <= 0) {
+			std::cerr << "[ProcMap] could not read "
+				  << (void*)p.o << "--" << (void*)m_end.o
+				  << " error=" << strerror(errno) << '\n';
+			goto done;
+		}
 
-	br = read(fd, mem->getHostPtr(m_beg), m_end - m_beg);
-	if (br != (ssize_t)(m_end - m_beg)) {
-		std::cerr << "[ProcMap] could not read "
-			  << (int)(m_end - m_beg) << " bytes. Got="
-			  << (int)br << "error=" << strerror(errno) << '\n';
-		goto done;
+		for (ssize_t off = 0; off < br; off += COPY_PAGE) {
+			size_t	n = std::min<size_t>(COPY_PAGE, br - off);
+			if (::memcmp(host + off, buf + off, n) != 0)
+				::memcpy(host + off, buf + off, n);
+		}
+		p.o += br;
 	}
 
 	ret = true;
 done:
+	delete [] buf;
 	close(fd);
 	return ret;
 }
@@ -145,7 +160,9 @@ void ProcMap::mapAnon(pid_t pid)
 	assert (mmap_fd == -1);
 
 	prot = getProt();
-	flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	/* the process already got this past the commit limit; most of a big
+	   heap is never touched, so don't charge all of it again */
+	flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
 
 	int res = mem->mmap(
 		mmap_base,
@@ -322,7 +339,7 @@ ProcMap::ProcMap(GuestMem* in_mem, pid_t pid, const char* mapline, bool _copy)
 	int		rc;
 
 	libname[0] = '\0';
-	rc = sscanf(mapline, "%p-%p %s %x %x:%x %d %s",
+	rc = sscanf(mapline, "%p-%p %s %" SCNx64 " %x:%x %d %s",
 		(void**)&mem_begin,
 		(void**)&mem_end,
 		perms,
@@ -369,8 +386,9 @@ void ProcMap::slurpMappings(
 	ptr_list_t<ProcMap>& ents,
 	bool do_copy)
 {
-	FILE	*f;
-	char	map_fname[256];
+	FILE			*f;
+	char			map_fname[256];
+	GuestMem::MapBatch	batch(m);
 
 	sprintf(map_fname, "/proc/%d/maps", pid);
 	f = fopen(map_fname, "r");
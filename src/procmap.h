@@ -10,7 +10,7 @@ public:
 	ProcMap(GuestMem* mem, pid_t pid, const char* mapline, bool copy=true);
 
 	virtual ~ProcMap(void);
-	unsigned int getByteCount() const
+	size_t getByteCount() const
 	{ return ((uintptr_t)mem_end - (uintptr_t)mem_begin); }
 	guest_ptr getBase(void) const { return mem_begin; }
 	guest_ptr getEnd(void) const { return getBase() + getByteCount(); }
@@ -38,7 +38,7 @@ private:
 
 	guest_ptr	mem_begin, mem_end;
 	char		perms[5];
-	uint32_t	off;
+	uint64_t	off;
 	int		t[2];
 	int		xxx;	/* XXX no idea */
 	char		libname[256];
@@ -0,0 +1,61 @@
+#include <sched.h>
+#include <stdint.h>
+#include <mutex>
+
+#include "rcu.h"
+
+/* threads past this many share slots; that's still correct */
+#define RCU_SLOTS	128
+
+struct alignas(64) RcuSlot
+{
+	std::atomic<unsigned>	readers[2];
+};
+
+static RcuSlot			slots[RCU_SLOTS];
+static std::atomic<unsigned>	epoch(0);
+static std::atomic<unsigned>	next_slot(0);
+static std::mutex		sync_mtx;
+
+static std::atomic<unsigned>* count(unsigned slot)
+{
+	std::atomic<unsigned>	*ctr;
+
+	/* both seq_cst: the writer either sees us counted or we see what
+	   it published */
+	ctr = &slots[slot].readers[epoch.load() & 1];
+	ctr->fetch_add(1);
+	return ctr;
+}
+
+std::atomic<unsigned>* Rcu::enter(void)
+{
+	static thread_local unsigned	slot = ~0U;
+
+	if (slot == ~0U)
+		slot = next_slot.fetch_add(1, std::memory_order_relaxed) % RCU_SLOTS;
+	return count(slot);
+}
+
+/* thread stacks are megabytes apart, so threads mostly still get slots
+   of their own */
+std::atomic<unsigned>* Rcu::enterSignal(void)
+{
+	char	here;
+	return count(((uintptr_t)&here >> 20) % RCU_SLOTS);
+}
+
+void Rcu::synchronize(void)
+{
+	std::lock_guard<std::mutex>	lk(sync_mtx);
+
+	/* a reader may have picked its parity just before an earlier flip,
+	   so drain one, then the other */
+	for (unsigned phase = 0; phase < 2; phase++) {
+		unsigned	old = epoch.fetch_add(1) & 1;
+
+		for (unsigned i = 0; i < RCU_SLOTS; i++)
+			while (slots[i].readers[old].load() != 0)
+				sched_yield();
+	}
+}
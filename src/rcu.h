@@ -0,0 +1,45 @@
+/* read-copy-update for tables many threads read and one thread replaces */
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+
+/* Readers never wait or take locks: entering bumps a counter in a slot
+ * of the reader's own, so readers on different cpus don't even share a
+ * cache line. A writer publishes its new copy first, then synchronize()
+ * returns once every reader that might still hold the old one is gone.
+ * Counters come in two parities, flipped by each phase of synchronize(),
+ * so a steady stream of new readers can't hold a writer off forever. */
+class Rcu
+{
+public:
+	class ReadLock
+	{
+	public:
+		/* for signal handlers, which mustn't touch thread_local
+		   state; the slot comes from the stack address instead */
+		enum signal_t { IN_SIGNAL };
+
+		explicit ReadLock(bool on = true)
+		: ctr(on ? Rcu::enter() : NULL) {}
+		explicit ReadLock(signal_t)
+		: ctr(Rcu::enterSignal()) {}
+		~ReadLock(void) { if (ctr != NULL) Rcu::exit(ctr); }
+		bool held(void) const { return ctr != NULL; }
+	private:
+		ReadLock(const ReadLock&) = delete;
+		ReadLock& operator=(const ReadLock&) = delete;
+		std::atomic<unsigned>	*ctr;
+	};
+
+	/* wait out every read section that started before this call */
+	static void synchronize(void);
+
+private:
+	static std::atomic<unsigned>* enter(void);
+	static std::atomic<unsigned>* enterSignal(void);
+	static void exit(std::atomic<unsigned>* ctr)
+	{ ctr->fetch_sub(1, std::memory_order_release); }
+};
+
+#endif
@@ -13,14 +13,16 @@ Symbols::Symbols(const Symbols& s)
 
 const Symbol* Symbols::findSym(const std::string& s) const
 {
+	std::shared_lock<std::shared_timed_mutex>	lk(mtx);
 	const auto it = name_map.find(s);
 	return (it == name_map.end()) ? nullptr : (*it).second;
 }
 
 const Symbol* Symbols::findSym(uint64_t ptr) const
 {
-	const Symbol			*ret;
-	symaddr_map::const_iterator	it;
+	std::shared_lock<std::shared_timed_mutex>	lk(mtx);
+	const Symbol					*ret;
+	symaddr_map::const_iterator			it;
 
 	if (ptr == 0)
 		return NULL;
@@ -33,9 +35,9 @@ const Symbol* Symbols::findSym(uint64_t ptr) const
 	if (ret->getBaseAddr() == (symaddr_t)ptr)
 		return ret;
 
-	--it;
-	if (it == addr_map.end())
+	if (it == addr_map.begin())
 		return NULL;
+	--it;
 
 	ret = it->second.get();
 	assert (ret->getBaseAddr() <= (symaddr_t)ptr && "WTF");
@@ -46,7 +48,20 @@ const Symbol* Symbols::findSym(uint64_t ptr) const
 	return ret;
 }
 
+unsigned int Symbols::size(void) const
+{
+	std::shared_lock<std::shared_timed_mutex>	lk(mtx);
+	return name_map.size();
+}
+
 bool Symbols::addSym(const std::string& name, symaddr_t addr, unsigned int len)
+{
+	std::unique_lock<std::shared_timed_mutex>	lk(mtx);
+	return insertSym(name, addr, len);
+}
+
+bool Symbols::insertSym(
+	const std::string& name, symaddr_t addr, unsigned int len)
 {
 	if (addr_map.count(addr)) return false;
 	if (name_map.count(name)) return false;
@@ -62,6 +77,11 @@ void Symbols::addSym(const Symbol* sym)
 
 void Symbols::addSyms(const Symbols* syms)
 {
-	for (const auto &p : syms->name_map)
-		addSym(p.second);
+	std::shared_lock<std::shared_timed_mutex>	from(syms->mtx);
+	std::unique_lock<std::shared_timed_mutex>	lk(mtx);
+
+	for (const auto &p : syms->name_map) {
+		const Symbol	*sym(p.second);
+		insertSym(sym->getName(), sym->getBaseAddr(), sym->getLength());
+	}
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 
 typedef uintptr_t symaddr_t;
 
@@ -37,6 +39,8 @@ private:
  * replies to questions about which symbol contains a given address
  * replies to questions about which name maps to a symbol
  * **assumes no overlaps **
+ * lookups may run on any number of threads while symbols are added;
+ * begin()/end() walk the names unlocked, so not while anyone adds.
  */
 
 typedef std::map<std::string, Symbol*> symname_map;
@@ -56,14 +60,17 @@ public:
 		unsigned int len);
 	void addSym(const Symbol* sym);
 	void addSyms(const Symbols* syms);
-	unsigned int size(void) const { return name_map.size(); }
+	unsigned int size(void) const;
 
 	symname_map::const_iterator begin() const { return name_map.begin(); }
 	symname_map::const_iterator end() const { return name_map.end(); }
 
 private:
+	bool insertSym(const std::string& name, symaddr_t addr, unsigned int len);
+
 	symname_map	name_map;
 	symaddr_map	addr_map;
+	mutable std::shared_timed_mutex	mtx;
 };
 
 #endif
@@ -7,7 +7,7 @@
 #include <stdlib.h>
 #include "syscallsmarshalled.h"
 
-SyscallPtrBuf::SyscallPtrBuf(GuestMem* mem, unsigned int in_len,
+SyscallPtrBuf::SyscallPtrBuf(GuestMem* mem, size_t in_len,
  	guest_ptr in_ptr)
 : ptr(in_ptr), len(in_len)
 {
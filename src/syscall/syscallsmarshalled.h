@@ -7,14 +7,14 @@
 class SyscallPtrBuf
 {
 public:
-	SyscallPtrBuf(GuestMem* mem, unsigned int in_len, guest_ptr in_ptr);
+	SyscallPtrBuf(GuestMem* mem, size_t in_len, guest_ptr in_ptr);
 	virtual ~SyscallPtrBuf(void) { if (data) delete [] data; }
 	guest_ptr getPtr(void) const { return ptr; }
 	const void* getData(void) const { return data; }
-	unsigned int getLength(void) const { return len; }
+	size_t getLength(void) const { return len; }
 private:
 	guest_ptr	ptr;
-	unsigned int	len;
+	size_t		len;
 	char		*data;
 };
 
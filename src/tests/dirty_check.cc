@@ -0,0 +1,111 @@
+/* dirty page tracking across mremap, with both backends */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "guestmem.h"
+
+#define PAGE_SZ		4096
+#define PAGES		16
+
+#define check(x)	do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+static const char	*backend;
+
+static void fail(const char* what, int line)
+{
+	fprintf(stderr, "dirty_check: %s: line %d: %s\n", backend, line, what);
+	abort();
+}
+
+/* every page of [p, p+len) in the dirty runs */
+static bool allDirty(GuestMem& mem, guest_ptr p, size_t len)
+{
+	std::vector<char>	seen(len / PAGE_SZ, 0);
+
+	for (const auto &r : mem.getDirtyPages())
+		for (size_t off = 0; off < r.second; off += PAGE_SZ) {
+			guest_ptr	pg(r.first + off);
+			if (pg >= p && pg < p + len)
+				seen[(pg - p) / PAGE_SZ] = 1;
+		}
+	for (auto s : seen)
+		if (!s)
+			return false;
+	return true;
+}
+
+static size_t dirtyPages(GuestMem& mem)
+{
+	size_t	n = 0;
+	for (const auto &r : mem.getDirtyPages())
+		n += r.second / PAGE_SZ;
+	return n;
+}
+
+static void writeAll(GuestMem& mem, guest_ptr p, size_t len)
+{
+	for (size_t off = 0; off < len; off += PAGE_SZ)
+		mem.write<uint64_t>(p + off, off | 1);
+}
+
+static void run(const char* name)
+{
+	GuestMem	mem;
+	guest_ptr	p, q, blk, r;
+	int		err;
+
+	backend = name;
+	/* room to grow in place once, then a page in the way */
+	err = mem.mmap(p, guest_ptr(0), (2*PAGES + 1)*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	check(err == 0);
+	check(mem.munmap(p + PAGES*PAGE_SZ, PAGES*PAGE_SZ) == 0);
+	blk = p + 2*PAGES*PAGE_SZ;
+	writeAll(mem, p, PAGES*PAGE_SZ);
+	check(mem.setDirtyTracking(true));
+
+	/* one page written since the checkpoint, the rest clean */
+	mem.checkpoint();
+	mem.write<uint64_t>(p + 3*PAGE_SZ, 7);
+	check(dirtyPages(mem) == 1);
+
+	/* grows in place; the grown tail is written straight away */
+	err = mem.mremap(q, p, PAGES*PAGE_SZ, 2*PAGES*PAGE_SZ, 0, guest_ptr(0));
+	check(err == 0 && q == p);
+	writeAll(mem, q, 2*PAGES*PAGE_SZ);
+	check(allDirty(mem, q, 2*PAGES*PAGE_SZ));
+	check(mem.read<uint64_t>(q + 3*PAGE_SZ) == (3*PAGE_SZ | 1));
+
+	/* up against 'blk' now, so growing has to move */
+	mem.checkpoint();
+	mem.write<uint64_t>(q + 5*PAGE_SZ, 9);
+	check(mem.isMapped(blk));
+	err = mem.mremap(r, q, 2*PAGES*PAGE_SZ, 4*PAGES*PAGE_SZ,
+		MREMAP_MAYMOVE, guest_ptr(0));
+	check(err == 0 && r != q);
+	check(mem.read<uint64_t>(r + 5*PAGE_SZ) == 9);
+	check(mem.read<uint64_t>(r + 6*PAGE_SZ) == (6*PAGE_SZ | 1));
+	writeAll(mem, r, 4*PAGES*PAGE_SZ);
+	check(allDirty(mem, r, 4*PAGES*PAGE_SZ));
+
+	/* and tracking goes on as before after a checkpoint */
+	mem.checkpoint();
+	check(dirtyPages(mem) == 0);
+	mem.write<uint64_t>(r + 10*PAGE_SZ, 1);
+	check(dirtyPages(mem) == 1 && allDirty(mem, r + 10*PAGE_SZ, PAGE_SZ));
+
+	printf("dirty_check: %s ok\n", backend);
+}
+
+int main(void)
+{
+	/* soft-dirty where the kernel has it */
+	run("default");
+	setenv("GUEST_NO_SOFTDIRTY", "1", 1);
+	run("mprotect");
+	return 0;
+}
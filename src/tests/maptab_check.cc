@@ -0,0 +1,527 @@
+/* randomized checks of GuestMapTab and GuestMem's mapping table against
+ * plain reference models */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "guestmaptab.h"
+#include "guestmemsink.h"
+
+#define PAGE_SZ		4096
+#define TAB_PAGES	2048
+#define TAB_SEEDS	24
+#define TAB_STEPS	3000
+#define MAX_VERS	8
+#define MEM_PAGES	512
+#define MEM_SEEDS	24
+#define MEM_STEPS	2000
+
+#define check(x)	do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+static unsigned	cur_seed, cur_step;
+
+static void fail(const char* what, int line)
+{
+	fprintf(stderr, "maptab_check: seed %u step %u: line %d: %s\n",
+		cur_seed, cur_step, line, what);
+	abort();
+}
+
+static unsigned rnd(unsigned n) { return (unsigned)(random() % n); }
+
+struct Rec
+{
+	Rec(void) : offset(0), length(0), tag(0) {}
+	Rec(uintptr_t o, size_t l, unsigned t) : offset(o), length(l), tag(t) {}
+	uintptr_t end(void) const { return offset + length; }
+	bool operator==(const Rec& r) const
+	{ return offset == r.offset && length == r.length && tag == r.tag; }
+
+	uintptr_t	offset;
+	size_t		length;
+	unsigned	tag;
+};
+
+typedef std::map<uintptr_t, Rec>	model_t;
+
+/* small chunks so splits, merges and the hole tree get exercised */
+template <unsigned ENTS>
+struct TabCheck
+{
+	typedef GuestMapTab<Rec, ENTS>	tab_t;
+
+	struct Version
+	{
+		tab_t	tab;
+		model_t	model;
+	};
+
+	std::vector<std::unique_ptr<Version>>	vers;
+
+	static bool isFree(const model_t& m, uintptr_t b, uintptr_t e)
+	{
+		auto it = m.lower_bound(b);
+		if (it != m.end() && it->second.offset < e)
+			return false;
+		if (it != m.begin() && (--it)->second.end() > b)
+			return false;
+		return true;
+	}
+
+	static const Rec* pick(const model_t& m)
+	{
+		auto	it = m.begin();
+
+		if (m.empty())
+			return NULL;
+		std::advance(it, rnd(m.size()));
+		return &it->second;
+	}
+
+	static void checkTab(const tab_t& t, const model_t& m)
+	{
+		auto	it = t.begin();
+
+		check(t.isConsistent());
+		check(t.size() == m.size());
+		for (const auto &r : m) {
+			check(it != t.end());
+			check(*it == r.second);
+			++it;
+		}
+		check(it == t.end());
+
+		for (unsigned i = 0; i < 16; i++) {
+			uintptr_t	a = rnd(TAB_PAGES + 2) * PAGE_SZ + rnd(2);
+			const Rec	*f = t.find(a);
+			auto		ub = m.upper_bound(a);
+			const Rec	*want = NULL;
+			auto		lb = m.lower_bound(a);
+
+			/* record containing a, if any */
+			if (ub != m.begin()) {
+				auto	prev = std::prev(ub);
+				if (prev->second.end() > a)
+					want = &prev->second;
+			}
+			check((f == NULL) == (want == NULL));
+			check(f == NULL || *f == *want);
+
+			/* first record ending past a */
+			auto ue = t.upperEnd(a);
+			auto me = (want != NULL) ? std::prev(ub) : ub;
+			check((ue == t.end()) == (me == m.end()));
+			check(ue == t.end() || *ue == me->second);
+
+			auto tl = t.lowerBound(a);
+			check((tl == t.end()) == (lb == m.end()));
+			check(tl == t.end() || *tl == lb->second);
+		}
+
+		for (unsigned i = 0; i < 4; i++) {
+			uintptr_t	len = rnd(4) ? rnd(8) * PAGE_SZ : rnd(64) * PAGE_SZ;
+			uintptr_t	from = rnd(TAB_PAGES) * PAGE_SZ;
+			auto		g = t.firstGap(t.lowerBound(from), len);
+			uintptr_t	prev_end = 0;
+			const Rec	*want = NULL;
+
+			for (const auto &r : m) {
+				if (	r.second.offset >= from &&
+					r.second.offset - prev_end > len)
+				{
+					want = &r.second;
+					break;
+				}
+				prev_end = r.second.end();
+			}
+			check((g == t.end()) == (want == NULL));
+			check(g == t.end() || *g == *want);
+		}
+	}
+
+	static void checkDiff(const Version& a, const Version& b)
+	{
+		std::vector<Rec>	gone, added, want_gone, want_added;
+
+		a.tab.diff(b.tab, [&] (const Rec& r, bool in_b) {
+			(in_b ? added : gone).push_back(r); });
+
+		for (const auto &r : a.model) {
+			auto it = b.model.find(r.first);
+			if (it == b.model.end() || !(it->second == r.second))
+				want_gone.push_back(r.second);
+		}
+		for (const auto &r : b.model) {
+			auto it = a.model.find(r.first);
+			if (it == a.model.end() || !(it->second == r.second))
+				want_added.push_back(r.second);
+		}
+		check(gone == want_gone);
+		check(added == want_added);
+	}
+
+	void checkRefs(void) const
+	{
+		std::vector<const tab_t*>	all;
+		for (const auto &v : vers)
+			all.push_back(&v->tab);
+		check(tab_t::refsConsistent(all));
+	}
+
+	/* one random change to version v */
+	void step(Version& v)
+	{
+		tab_t		&t(v.tab);
+		model_t		&m(v.model);
+		const Rec	*r;
+		unsigned	op = rnd(100);
+
+		if (op < 35) {
+			/* a new record in free space */
+			uintptr_t	o = (1 + rnd(TAB_PAGES)) * PAGE_SZ;
+			size_t		l = (1 + rnd(rnd(4) ? 4 : 32)) * PAGE_SZ;
+			Rec		n(o, l, rnd(4));
+
+			if (!isFree(m, o, o + l))
+				return;
+			t.insert(t.lowerBound(o), n);
+			m[o] = n;
+		} else if (op < 50) {
+			if ((r = pick(m)) == NULL)
+				return;
+			t.erase(t.lowerBound(r->offset));
+			m.erase(r->offset);
+		} else if (op < 62) {
+			/* split in two, as mprotect does */
+			Rec	head, tail;
+			size_t	k;
+
+			if ((r = pick(m)) == NULL || r->length < 2*PAGE_SZ)
+				return;
+			k = (1 + rnd(r->length / PAGE_SZ - 1)) * PAGE_SZ;
+			head = tail = *r;
+			head.length = k;
+			tail.offset += k;
+			tail.length -= k;
+			tail.tag = rnd(4);
+
+			auto it = t.lowerBound(r->offset);
+			it->length = k;
+			t.update(it);
+			++it;
+			t.insert(it, tail);
+			m[head.offset] = head;
+			m[tail.offset] = tail;
+		} else if (op < 70) {
+			/* trim the front, which moves the chunk key */
+			Rec	n;
+
+			if ((r = pick(m)) == NULL || r->length < 2*PAGE_SZ)
+				return;
+			n = *r;
+			n.offset += PAGE_SZ;
+			n.length -= PAGE_SZ;
+			auto it = t.lowerBound(r->offset);
+			*it = n;
+			t.update(it);
+			m.erase(r->offset);
+			m[n.offset] = n;
+		} else if (op < 76) {
+			/* grow or shrink the tail in place */
+			Rec	n;
+
+			if ((r = pick(m)) == NULL)
+				return;
+			n = *r;
+			if (rnd(2) && n.length > PAGE_SZ)
+				n.length -= PAGE_SZ;
+			else if (isFree(m, n.end(), n.end() + PAGE_SZ))
+				n.length += PAGE_SZ;
+			auto it = t.lowerBound(n.offset);
+			*it = n;
+			t.update(it);
+			m[n.offset] = n;
+		} else if (op < 80) {
+			/* a run of erases off one iterator */
+			unsigned	k = 1 + rnd(ENTS * 2);
+
+			if ((r = pick(m)) == NULL)
+				return;
+			auto it = t.lowerBound(r->offset);
+			auto mi = m.find(r->offset);
+			for (; k && it != t.end(); k--) {
+				it = t.erase(it);
+				mi = m.erase(mi);
+			}
+		} else if (op < 83) {
+			/* writing through a non-const walk claims chunks */
+			for (auto &x : t)
+				if (rnd(8) == 0) {
+					x.tag ^= 1;
+					m[x.offset].tag ^= 1;
+				}
+		} else if (op < 85) {
+			std::vector<Rec>	l;
+			for (const auto &x : m)
+				l.push_back(x.second);
+			t.assign(l.begin(), l.end());
+		} else if (op == 85 && rnd(8) == 0) {
+			t.clear();
+			m.clear();
+		}
+	}
+
+	void run(void)
+	{
+		vers.clear();
+		vers.emplace_back(new Version());
+
+		for (cur_step = 0; cur_step < TAB_STEPS; cur_step++) {
+			unsigned	op = rnd(100);
+			Version		&v(*vers[rnd(vers.size())]);
+
+			if (op < 6 && vers.size() < MAX_VERS) {
+				/* capture */
+				Version	*n = new Version();
+				n->tab = v.tab;
+				n->model = v.model;
+				vers.emplace_back(n);
+			} else if (op < 9 && vers.size() > 1) {
+				/* 'v' may be the one going */
+				vers.erase(vers.begin() + rnd(vers.size()));
+				checkRefs();
+				continue;
+			} else if (op < 12) {
+				/* restore */
+				Version	&src(*vers[rnd(vers.size())]);
+				v.tab = src.tab;
+				v.model = src.model;
+			} else if (op < 15) {
+				checkDiff(v, *vers[rnd(vers.size())]);
+			} else
+				step(v);
+
+			checkTab(v.tab, v.model);
+			checkRefs();
+			if (cur_step % 64 == 0)
+				for (const auto &o : vers)
+					checkTab(o->tab, o->model);
+		}
+
+		for (const auto &o : vers)
+			checkTab(o->tab, o->model);
+	}
+};
+
+/* per page of a GuestMem: what the table should say */
+struct PageState
+{
+	PageState(void) : mapped(false), req(0), cur(0), name(-1) {}
+	bool operator==(const PageState& p) const
+	{
+		return	mapped == p.mapped && req == p.req && cur == p.cur &&
+			name == p.name;
+	}
+	bool	mapped;
+	int	req, cur;
+	int	name;
+};
+
+static const std::string	names[] = { "libA", "libB" };
+static const int	prots[] = {
+	PROT_READ, PROT_READ | PROT_WRITE, PROT_READ | PROT_EXEC, PROT_NONE };
+
+struct MemCheck
+{
+	struct Layout
+	{
+		GuestMem::maptab_t		tab;
+		std::vector<PageState>		pages;
+		bool				merged;
+	};
+
+	GuestMemSink			*mem;
+	std::vector<PageState>		pages;
+	/* no two neighbours could be merged */
+	bool				merged;
+	std::vector<Layout>		layouts;
+
+	static guest_ptr addr(unsigned pg) { return guest_ptr((pg + 16) * PAGE_SZ); }
+
+	void set(unsigned b, unsigned e, const PageState& s)
+	{ for (unsigned i = b; i < e; i++) pages[i] = s; }
+
+	static PageState state(int prot, int name)
+	{
+		PageState	s;
+		s.mapped = true;
+		s.req = s.cur = prot;
+		s.name = name;
+		return s;
+	}
+
+	void record(unsigned b, unsigned e, int prot, int name)
+	{
+		GuestMem::Mapping	m(addr(b), (e - b) * PAGE_SZ, prot);
+
+		/* the table interns it */
+		m.name = (name >= 0) ? &names[name] : NULL;
+		mem->recordMapping(m);
+		set(b, e, state(prot, name));
+	}
+
+	void checkMem(void)
+	{
+		guest_ptr	prev_end(0);
+		const GuestMem::Mapping	*prev = NULL;
+		std::list<GuestMem::Mapping>	l;
+
+		for (unsigned pg = 0; pg < MEM_PAGES; pg++) {
+			GuestMem::Mapping	m;
+			PageState		s;
+			int			n = -1;
+
+			if (mem->lookupMapping(addr(pg), m)) {
+				if (m.name != NULL)
+					n = (*m.name == names[0]) ? 0 : 1;
+				s = state(m.req_prot, n);
+				s.cur = m.cur_prot;
+			}
+			check(s == pages[pg]);
+			check(mem->canAccess(addr(pg), 1, PROT_READ) ==
+				(s.mapped && (s.cur & PROT_READ)));
+			check(mem->canAccess(addr(pg), 1, PROT_WRITE) ==
+				(s.mapped && (s.cur & PROT_WRITE)));
+		}
+
+		/* getMaps() only has the readable ones */
+		for (const auto &m : mem->getMappings())
+			l.push_back(m);
+		for (const auto &m : l) {
+			check(m.offset >= prev_end && m.length > 0);
+			if (merged && prev != NULL && prev->end() == m.offset)
+				check(!(prev->req_prot == m.req_prot &&
+					prev->cur_prot == m.cur_prot &&
+					prev->type == m.type &&
+					prev->name == m.name));
+			prev_end = m.end();
+			prev = &m;
+		}
+
+		for (unsigned i = 0; i < 2; i++) {
+			std::list<GuestMem::Mapping>	want;
+			for (const auto &m : l)
+				if (m.name != NULL && *m.name == names[i])
+					want.push_back(m);
+			check(mem->lookupMappings(names[i].c_str()).size() ==
+				want.size());
+		}
+	}
+
+	void step(void)
+	{
+		unsigned	b = rnd(MEM_PAGES);
+		unsigned	e = std::min((unsigned)MEM_PAGES, b + 1 + rnd(rnd(4) ? 8 : 64));
+		unsigned	op = rnd(100);
+		bool		coalescing = mem->isCoalescing();
+
+		if (op < 35) {
+			record(b, e, prots[rnd(4)], (int)rnd(3) - 1);
+			merged = merged && coalescing;
+		} else if (op < 50) {
+			/* unmapping a hole only gets a complaint on stderr */
+			if (!pages[b].mapped)
+				return;
+			check(mem->munmap(addr(b), (e - b) * PAGE_SZ) == 0);
+			set(b, e, PageState());
+		} else if (op < 65) {
+			/* mprotect drops the name, as it always has */
+			int	prot = prots[rnd(4)];
+			for (unsigned i = b; i < e; i++)
+				if (!pages[i].mapped)
+					return;
+			check(mem->mprotect(addr(b), (e - b) * PAGE_SZ, prot) == 0);
+			set(b, e, state(prot, -1));
+			merged = merged && coalescing;
+		} else if (op < 75) {
+			/* a sorted batch, as a bulk load would have it */
+			std::vector<GuestMem::Mapping>	batch;
+			unsigned			pg = rnd(32);
+
+			while (pg < MEM_PAGES) {
+				unsigned	n = 1 + rnd(16);
+				int		prot = prots[rnd(4)];
+				int		name = (int)rnd(3) - 1;
+
+				n = std::min(n, MEM_PAGES - pg);
+				GuestMem::Mapping m(addr(pg), n * PAGE_SZ, prot);
+				if (name >= 0)
+					m.name = &names[name];
+				batch.push_back(m);
+				set(pg, pg + n, state(prot, name));
+				pg += n + rnd(rnd(2) ? 4 : 64);
+			}
+			mem->recordMappings(batch);
+			merged = merged && coalescing;
+		} else if (op < 80) {
+			mem->setCoalescing(!coalescing);
+		} else if (op < 85) {
+			mem->coalesceMappings();
+			merged = true;
+		} else if (op < 90 && layouts.size() < MAX_VERS) {
+			layouts.push_back(Layout{mem->captureLayout(), pages, merged});
+		} else if (op < 95 && !layouts.empty()) {
+			Layout	&l(layouts[rnd(layouts.size())]);
+			mem->restoreLayout(l.tab);
+			pages = l.pages;
+			merged = l.merged;
+		} else if (!layouts.empty()) {
+			layouts.erase(layouts.begin() + rnd(layouts.size()));
+		}
+	}
+
+	void run(void)
+	{
+		mem = new GuestMemSink();
+		pages.assign(MEM_PAGES, PageState());
+		merged = true;
+		layouts.clear();
+		mem->setCoalescing(rnd(2));
+
+		for (cur_step = 0; cur_step < MEM_STEPS; cur_step++) {
+			step();
+			checkMem();
+		}
+
+		layouts.clear();
+		delete mem;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	unsigned	seeds = (argc > 1) ? atoi(argv[1]) : TAB_SEEDS;
+
+	for (cur_seed = 1; cur_seed <= seeds; cur_seed++) {
+		srandom(cur_seed);
+		TabCheck<4>().run();
+		srandom(cur_seed);
+		TabCheck<64>().run();
+	}
+	printf("maptab_check: table ok, %u seeds x %u steps\n", seeds, TAB_STEPS);
+
+	for (cur_seed = 1; cur_seed <= MEM_SEEDS; cur_seed++) {
+		srandom(cur_seed);
+		MemCheck().run();
+	}
+	printf("maptab_check: guestmem ok, %u seeds x %u steps\n",
+		MEM_SEEDS, MEM_STEPS);
+
+	return 0;
+}
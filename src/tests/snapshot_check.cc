@@ -0,0 +1,109 @@
+/* a sparse guest slurped from a child, saved as a snapshot and loaded
+ * back: every marker has to survive the trip */
+#include <assert.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "guestcpustate.h"
+#include "guestsnapshot.h"
+#include "procmap.h"
+#include "ptcpustate.h"
+
+/* past 4GB, and mostly holes */
+#define SPARSE_GB	6
+#define SPARSE_STRIDE	(64UL << 20)
+
+#define check(x)	do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+static void fail(const char* what, int line)
+{
+	fprintf(stderr, "snapshot_check: line %d: %s\n", line, what);
+	abort();
+}
+
+/* just enough of a guest for GuestSnapshot::save */
+class CheckGuest : public Guest
+{
+public:
+	CheckGuest(GuestMem* m) : Guest("/bin/true")
+	{
+		mem = m;
+		cpu_state = GuestCPUState::create(getArch());
+	}
+	guest_ptr getEntryPoint(void) const override { return guest_ptr(0); }
+	Arch::Arch getArch(void) const override { return Arch::getHostArch(); }
+};
+
+static int rmEnt(const char* path, const struct stat*, int, struct FTW*)
+{ return remove(path); }
+
+int main(void)
+{
+	GuestMem	*mem = new GuestMem();
+	CheckGuest	*g;
+	GuestSnapshot	*ss;
+	ProcMap		*pm;
+	guest_ptr	p;
+	size_t		len = (size_t)SPARSE_GB << 30;
+	char		dir[] = "/tmp/snapshot_check.XXXXXX";
+	char		line[128];
+	unsigned	marks = 0;
+	pid_t		pid;
+	int		err;
+
+	err = mem->mmap(p, guest_ptr(0), len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	check(err == 0);
+	for (size_t off = SPARSE_STRIDE - 8; off < len; off += SPARSE_STRIDE)
+		mem->write<uint64_t>(p + off, off | 1);
+	mem->write<uint64_t>(p, 0x5a5a5a5a);
+
+	if ((pid = fork()) == 0) {
+		pause();
+		_exit(0);
+	}
+	check(pid > 0);
+	/* the only cpu states there are; making one doesn't touch the pid */
+	PTCPUState::registerCPUs(pid);
+
+	/* the child holds the only copy from here on */
+	delete mem;
+	mem = new GuestMem();
+	snprintf(line, sizeof(line), "%lx-%lx rw-p 00000000 00:00 0\n",
+		p.o, p.o + len);
+	pm = ProcMap::create(mem, pid, line);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	check(pm != NULL && pm->getByteCount() == len);
+
+	check(mkdtemp(dir) != NULL);
+	g = new CheckGuest(mem);
+	GuestSnapshot::save(g, dir);
+	/* the snapshot maps it back at the same address, so both go
+	 * first; the ProcMap unmaps its range from the guest */
+	delete pm;
+	delete g;
+
+	ss = GuestSnapshot::create(dir);
+	check(ss != NULL);
+	mem = ss->getMem();
+	check(mem->isMapped(p) && mem->isMapped(p + (len - 1)));
+	check(!mem->isMapped(p + len));
+	check(mem->read<uint64_t>(p) == 0x5a5a5a5a);
+	for (size_t off = SPARSE_STRIDE - 8; off < len; off += SPARSE_STRIDE) {
+		check(mem->read<uint64_t>(p + off) == (off | 1));
+		check(mem->read<uint64_t>(p + (off - 8)) == 0);
+		marks++;
+	}
+	delete ss;
+
+	nftw(dir, rmEnt, 16, FTW_DEPTH | FTW_PHYS);
+	printf("snapshot_check: %u markers over %uGB ok\n", marks, SPARSE_GB);
+
+	return 0;
+}
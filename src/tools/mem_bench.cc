@@ -0,0 +1,1192 @@
+/* microbenchmarks for the guest memory layer */
+#include <iostream>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "guestmemsink.h"
+#include "guestsearch.h"
+#include "procmap.h"
+#include "symbols.h"
+
+#define PAGE_SZ		4096
+/* lowest address findFreeRegion will hand out */
+#define MAP_BASE	0x100000UL
+#define LOOKUP_C	(4*1024*1024)
+#define FREE_C		(64*1024)
+#define STORM_PAGES	(64*1024)
+#define STORM_C		(1024*1024)
+#define ACCESS_PAGES	256
+#define ACCESS_C	(64*1024*1024)
+#define HASH_PAGES	(64*1024)
+#define HASH_ROUNDS	4
+#define DIRTY_WRITES	1000
+#define CLONE_C		16
+#define HUGE_MB		512
+#define HUGE_C		(16*1024*1024)
+#define BRK_C		(1024*1024)
+#define BRK_STEP	64
+#define PLACE_C		(16*1024)
+#define CHECK_MAPS	4096
+#define CHECK_C		(16*1024*1024)
+#define SHARED_SYMS	(64*1024)
+#define SHARED_C	(2*1024*1024)
+#define CKPT_C		1000
+#define CKPT_EDITS	4
+#define SHADOW_PAGES	(16*1024)
+#define SHADOW_C	(64*1024*1024)
+#define CODE_PAGES	256
+#define CODE_WRITES	(64*1024)
+#define CODE_C		(64*1024*1024)
+#define WATCH_PAGES	256
+#define WATCH_OBJS	8192
+#define WATCH_WRITES	(64*1024)
+#define SEARCH_GB	16
+#define SEARCH_FILL	(512UL << 20)
+#define SPARSE_GB	6
+#define SPARSE_STRIDE	(256UL << 20)
+
+/* count heap allocations so table churn shows up */
+static std::atomic<uint64_t>	alloc_c;
+static std::atomic<int64_t>	live_bytes;
+
+static void* countedAlloc(size_t sz)
+{
+	void	*p;
+
+	alloc_c++;
+	if ((p = malloc(sz)) == NULL)
+		throw std::bad_alloc();
+	live_bytes += malloc_usable_size(p);
+	return p;
+}
+
+static void countedFree(void* p)
+{
+	live_bytes -= malloc_usable_size(p);
+	free(p);
+}
+
+/* every form, so each new/delete pair goes through the same counts */
+void* operator new(size_t sz) { return countedAlloc(sz); }
+void* operator new[](size_t sz) { return countedAlloc(sz); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+
+static double now(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sink memory never touches the host, so mapping tables can be
+ * arbitrarily large without backing them */
+static GuestMem* buildMem(unsigned map_c)
+{
+	GuestMem	*mem = new GuestMemSink();
+
+	/* two page mappings separated by a one page hole */
+	for (unsigned i = 0; i < map_c; i++) {
+		GuestMem::Mapping m(
+			guest_ptr(MAP_BASE + i*3*PAGE_SZ),
+			2*PAGE_SZ,
+			PROT_READ | PROT_WRITE);
+		mem->recordMapping(m);
+	}
+
+	return mem;
+}
+
+static void benchLookup(unsigned map_c)
+{
+	GuestMem	*mem(buildMem(map_c));
+	uint64_t	*addrs = new uint64_t[LOOKUP_C];
+	unsigned	hits = 0;
+	double		t_rand, t_local;
+
+	srandom(map_c);
+	for (unsigned i = 0; i < LOOKUP_C; i++) {
+		uint64_t	off = random() % ((uint64_t)map_c*3*PAGE_SZ);
+		addrs[i] = MAP_BASE + off;
+	}
+
+	t_rand = now();
+	for (unsigned i = 0; i < LOOKUP_C; i++)
+		hits += mem->isMapped(guest_ptr(addrs[i]));
+	t_rand = now() - t_rand;
+
+	/* walk each mapping a word at a time; what an interpreter does */
+	t_local = now();
+	for (unsigned i = 0; i < LOOKUP_C; i++) {
+		uint64_t	a = MAP_BASE + ((i / 1024) % map_c)*3*PAGE_SZ +
+			(i % 1024)*8;
+		hits += mem->isMapped(guest_ptr(a));
+	}
+	t_local = now() - t_local;
+
+	std::cout << "lookup maps=" << map_c
+		<< " random=" << (uint64_t)(LOOKUP_C / t_rand) << "/s"
+		<< " local=" << (uint64_t)(LOOKUP_C / t_local) << "/s"
+		<< " (hits=" << hits << ")\n";
+
+	delete [] addrs;
+	delete mem;
+}
+
+/* every hole is one page, so first-fit has to get past all of them */
+static void benchFreeRegion(unsigned map_c)
+{
+	GuestMem		*mem(buildMem(map_c));
+	GuestMem::Mapping	m;
+	uint64_t		sum = 0;
+	double			t;
+
+	t = now();
+	for (unsigned i = 0; i < FREE_C; i++) {
+		mem->findFreeRegion(PAGE_SZ, m);
+		sum += m.offset;
+	}
+	t = now() - t;
+
+	std::cout << "freeregion maps=" << map_c
+		<< " " << (uint64_t)(FREE_C / t) << "/s"
+		<< " (sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* interpreter-style word traffic over a small working set */
+template <typename V>
+static uint64_t sumWords(const V& v, guest_ptr base)
+{
+	uint64_t	sum = 0;
+
+	for (unsigned i = 0; i < ACCESS_C; i++) {
+		guest_ptr	p(base + ((i * 8) % (ACCESS_PAGES*PAGE_SZ)));
+		sum += v.template read<uint64_t>(p) + i;
+		v.write(p, sum);
+	}
+
+	return sum;
+}
+
+/* the old accessors, for comparison */
+struct OldView
+{
+	OldView(GuestMem& _mem) : mem(_mem) {}
+	template <typename T> T read(guest_ptr p) const
+	{ return mem.readVirt<T>(p); }
+	template <typename T> void write(guest_ptr p, const T& t) const
+	{ *(T*)mem.getHostPtr(p) = t; mem.writeVirt<T>(p, t); }
+	GuestMem	&mem;
+};
+
+struct MemView
+{
+	MemView(GuestMem& _mem) : mem(_mem) {}
+	template <typename T> T read(guest_ptr p) const
+	{ return mem.read<T>(p); }
+	template <typename T> void write(guest_ptr p, const T& t) const
+	{ mem.write<T>(p, t); }
+	GuestMem	&mem;
+};
+
+static void benchAccess(void)
+{
+	GuestMem	*mem = new GuestMem();
+	guest_ptr	p;
+	uint64_t	sum = 0;
+	double		t_old, t_mem, t_view;
+	int		err;
+
+	err = mem->mmap(p, guest_ptr(0), ACCESS_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	t_old = now();
+	sum += sumWords(OldView(*mem), p);
+	t_old = now() - t_old;
+
+	t_mem = now();
+	sum += sumWords(MemView(*mem), p);
+	t_mem = now() - t_mem;
+
+	t_view = now();
+	mem->withView([&] (auto v) { sum += sumWords(v, p); });
+	t_view = now() - t_view;
+
+	std::cout << "access virtual=" << (uint64_t)(ACCESS_C / t_old) << "/s"
+		<< " read<T>=" << (uint64_t)(ACCESS_C / t_mem) << "/s"
+		<< " view=" << (uint64_t)(ACCESS_C / t_view) << "/s"
+		<< " (sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* guest words on a 32-bit guest, the way stack and argv code walks them */
+template <typename V>
+static uint64_t sumNatives(V& v, guest_ptr base)
+{
+	const unsigned	words = ACCESS_PAGES*PAGE_SZ/4;
+	uint64_t	sum = 0;
+
+	for (unsigned i = 0; i < ACCESS_C; i++) {
+		sum += v.readNative(base, i % words) + i;
+		v.writeNative(base + (i % words)*4, sum);
+	}
+
+	return sum;
+}
+
+static void benchWidth(void)
+{
+	GuestMem	*mem = new GuestMem();
+	guest_ptr	p;
+	uint64_t	sum = 0;
+	double		t_mem, t_view;
+	int		err;
+
+	mem->mark32Bit();
+	err = mem->mmap(p, guest_ptr(0), ACCESS_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	t_mem = now();
+	sum += sumNatives(*mem, p);
+	t_mem = now() - t_mem;
+
+	t_view = now();
+	mem->withWidth([&] (auto v) { sum += sumNatives(v, p); });
+	t_view = now() - t_view;
+
+	std::cout << "width32 readNative=" << (uint64_t)(ACCESS_C / t_mem) << "/s"
+		<< " view=" << (uint64_t)(ACCESS_C / t_view) << "/s"
+		<< " (sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* word reads scattered over many small mappings, unchecked, checked
+   through the page bitmap, and checked through the mapping table */
+static void benchChecked(void)
+{
+	GuestMem		*mem = new GuestMem();
+	std::vector<guest_ptr>	pages;
+	uint64_t		sum = 0, v;
+	double			t_raw, t_chk, t_tab;
+	unsigned		faults = 0;
+
+	for (unsigned i = 0; i < CHECK_MAPS; i++) {
+		guest_ptr	p;
+		int		err;
+
+		err = mem->mmap(p, guest_ptr(0), PAGE_SZ,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+		assert (err == 0);
+		pages.push_back(p);
+	}
+	/* every so often, a pointer to nowhere */
+	pages.push_back(guest_ptr(0));
+
+	t_raw = now();
+	for (unsigned i = 0; i < CHECK_C; i++) {
+		guest_ptr	p(pages[i % CHECK_MAPS] + (i % 512)*8);
+		sum += mem->read<uint64_t>(p);
+	}
+	t_raw = now() - t_raw;
+
+	t_chk = now();
+	for (unsigned i = 0; i < CHECK_C; i++) {
+		guest_ptr	p(pages[i % pages.size()] + (i % 512)*8);
+		if (mem->readChecked(p, v) == 0) sum += v;
+		else faults++;
+	}
+	t_chk = now() - t_chk;
+
+	t_tab = now();
+	for (unsigned i = 0; i < CHECK_C; i++) {
+		guest_ptr		p(pages[i % pages.size()] + (i % 512)*8);
+		GuestMem::Mapping	m;
+		if (mem->lookupMapping(p, m) && (m.cur_prot & PROT_READ))
+			sum += mem->read<uint64_t>(p);
+		else
+			faults++;
+	}
+	t_tab = now() - t_tab;
+
+	std::cout << "checked maps=" << CHECK_MAPS
+		<< " unchecked=" << (uint64_t)(CHECK_C / t_raw) << "/s"
+		<< " bitmap=" << (uint64_t)(CHECK_C / t_chk) << "/s"
+		<< " table=" << (uint64_t)(CHECK_C / t_tab) << "/s"
+		<< " (faults=" << faults << " sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* analysis threads reading one guest while another keeps changing its
+ * mappings; total reads a second for each reader count */
+static void benchShared(void)
+{
+	GuestMem		*mem = new GuestMem();
+	Symbols			syms;
+	std::vector<guest_ptr>	pages;
+	guest_ptr		flip;
+	int			err;
+
+	for (unsigned i = 0; i < CHECK_MAPS; i++) {
+		guest_ptr	p;
+		char		name[32];
+
+		err = mem->mmap(p, guest_ptr(0), PAGE_SZ,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+		assert (err == 0);
+		snprintf(name, sizeof(name), "sym%u", i);
+		mem->memcpy(p, name, strlen(name) + 1);
+		pages.push_back(p);
+	}
+	for (unsigned i = 0; i < SHARED_SYMS; i++) {
+		char	name[32];
+		snprintf(name, sizeof(name), "sym%u", i);
+		syms.addSym(name, MAP_BASE + i*64, 64);
+	}
+
+	err = mem->mmap(flip, guest_ptr(0), PAGE_SZ, PROT_READ,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+	mem->setSharedReads(true);
+
+	for (unsigned thread_c = 1; thread_c <= 8; thread_c *= 2) {
+		std::vector<std::thread>	readers;
+		std::atomic<bool>		done(false);
+		std::atomic<uint64_t>		found(0);
+		unsigned			updates = 0;
+		double				t;
+
+		std::thread writer([&] {
+			while (!done.load()) {
+				mem->mprotect(flip, PAGE_SZ, (updates & 1)
+					? PROT_READ : PROT_READ | PROT_WRITE);
+				updates++;
+			}
+		});
+
+		t = now();
+		for (unsigned i = 0; i < thread_c; i++) {
+			readers.emplace_back([&, i] {
+				uint64_t	hit = 0, v;
+				char		buf[32];
+
+				for (unsigned j = 0; j < SHARED_C / thread_c; j++) {
+					guest_ptr		p(pages[(j*7 + i) % CHECK_MAPS]);
+					GuestMem::Mapping	m;
+
+					hit += mem->lookupMapping(p, m);
+					hit += mem->readChecked(p, v) == 0;
+					if (mem->readString(p, buf, sizeof(buf)) > 0)
+						hit += syms.findSym(buf) != NULL;
+					hit += syms.findSym(MAP_BASE + j*64) != NULL;
+				}
+				found += hit;
+			});
+		}
+		for (auto &r : readers) r.join();
+		t = now() - t;
+		done = true;
+		writer.join();
+
+		std::cout << "shared readers=" << thread_c
+			<< " reads=" << (uint64_t)(SHARED_C / t) << "/s"
+			<< " updates=" << updates
+			<< " (found=" << found.load() << ")\n";
+	}
+
+	delete mem;
+}
+
+/* the weighted word sum chksumMapping used to be */
+static uint64_t oldChksum(const uint64_t* p, size_t len)
+{
+	uint64_t	ret = 0;
+	for (unsigned i = 0; i < len/sizeof(*p); i++)
+		ret += (i+1)*p[i];
+	return ret;
+}
+
+static void benchHash(void)
+{
+	GuestMem	*mem = new GuestMem();
+	guest_ptr	p;
+	uint64_t	*w, sum = 0;
+	double		t_old, t_one, t_all;
+	size_t		len = (size_t)HASH_PAGES*PAGE_SZ;
+	int		err;
+
+	err = mem->mmap(p, guest_ptr(0), len,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	w = (uint64_t*)mem->getHostPtr(p);
+	for (size_t i = 0; i < len/8; i++)
+		w[i] = i * 0x9e3779b97f4a7c15ULL;
+
+	t_old = now();
+	for (unsigned i = 0; i < HASH_ROUNDS; i++)
+		sum += oldChksum(w, len);
+	t_old = now() - t_old;
+
+	t_one = now();
+	for (unsigned i = 0; i < HASH_ROUNDS; i++)
+		sum += mem->getPageHashes(1).back().hash.lo;
+	t_one = now() - t_one;
+
+	t_all = now();
+	for (unsigned i = 0; i < HASH_ROUNDS; i++)
+		sum += mem->getPageHashes().back().hash.lo;
+	t_all = now() - t_all;
+
+	std::cout << "hash MB=" << (len >> 20)
+		<< " oldsum=" << (uint64_t)(HASH_ROUNDS*len / t_old / 1e6) << "MB/s"
+		<< " pagehash=" << (uint64_t)(HASH_ROUNDS*len / t_one / 1e6) << "MB/s"
+		<< " parallel=" << (uint64_t)(HASH_ROUNDS*len / t_all / 1e6) << "MB/s"
+		<< " (sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* a few scattered writes into a big heap, then ask what changed */
+static void benchDirty(void)
+{
+	GuestMem	*mem = new GuestMem();
+	guest_ptr	p;
+	size_t		len = (size_t)HASH_PAGES*PAGE_SZ;
+	double		t_ckpt, t_write, t_get;
+	size_t		dirty_c = 0;
+	int		err;
+
+	err = mem->mmap(p, guest_ptr(0), len,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+	mem->memset(p, 1, len);
+
+	if (!mem->setDirtyTracking(true)) {
+		std::cout << "dirty tracking unavailable\n";
+		delete mem;
+		return;
+	}
+
+	t_ckpt = now();
+	mem->checkpoint();
+	t_ckpt = now() - t_ckpt;
+
+	srandom(DIRTY_WRITES);
+	t_write = now();
+	for (unsigned i = 0; i < DIRTY_WRITES; i++) {
+		guest_ptr	w(p + (random() % (len / 8)) * 8);
+		mem->write<uint64_t>(w, i);
+	}
+	t_write = now() - t_write;
+
+	t_get = now();
+	for (const auto &r : mem->getDirtyPages())
+		dirty_c += r.second / PAGE_SZ;
+	t_get = now() - t_get;
+
+	std::cout << "dirty MB=" << (len >> 20)
+		<< " checkpoint=" << t_ckpt*1e3 << "ms"
+		<< " writes=" << DIRTY_WRITES
+		<< " " << t_write*1e3 << "ms"
+		<< " collect=" << t_get*1e3 << "ms"
+		<< " pages=" << dirty_c << "\n";
+
+	delete mem;
+}
+
+/* branch a guest many times; each branch scribbles on a few pages */
+static void benchClone(bool memfd)
+{
+	GuestMem	*mem = new GuestMem();
+	GuestMem	*c[CLONE_C];
+	guest_ptr	p;
+	size_t		len = (size_t)HASH_PAGES*PAGE_SZ;
+	double		t_first, t_rest;
+	uint64_t	sum = 0;
+	int		err;
+
+	mem->mark32Bit();
+	mem->setMemfdBacking(memfd);
+	err = mem->mmap(p, guest_ptr(0), len,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+	mem->memset(p, 1, len);
+
+	t_first = now();
+	c[0] = mem->clone();
+	t_first = now() - t_first;
+	if (c[0] == NULL) {
+		std::cout << "clone unavailable\n";
+		delete mem;
+		return;
+	}
+
+	t_rest = now();
+	for (unsigned i = 1; i < CLONE_C; i++) {
+		c[i] = mem->clone();
+		assert (c[i] != NULL);
+	}
+	t_rest = now() - t_rest;
+
+	for (unsigned i = 0; i < CLONE_C; i++) {
+		for (unsigned j = 0; j < DIRTY_WRITES; j++)
+			c[i]->write<uint64_t>(p + (size_t)j*37*PAGE_SZ % len, i);
+		sum += c[i]->read<uint64_t>(p);
+	}
+
+	std::cout << "clone " << (memfd ? "memfd" : "anon")
+		<< " MB=" << (len >> 20)
+		<< " first=" << t_first*1e3 << "ms"
+		<< " next=" << t_rest*1e3/(CLONE_C - 1) << "ms"
+		<< " (sum=" << sum << ")\n";
+
+	for (unsigned i = 0; i < CLONE_C; i++)
+		delete c[i];
+	delete mem;
+}
+
+/* what a snapshot writer pays to get guest memory into a file */
+static void benchCopyOut(bool memfd)
+{
+	GuestMem	mem;
+	guest_ptr	p;
+	size_t		len = (size_t)HASH_PAGES*PAGE_SZ;
+	char		path[] = "/tmp/mem_bench.XXXXXX";
+	double		t;
+	int		fd, err;
+
+	mem.setMemfdBacking(memfd);
+	err = mem.mmap(p, guest_ptr(0), len,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+	mem.memset(p, 1, len);
+
+	fd = mkstemp(path);
+	assert (fd >= 0);
+	unlink(path);
+
+	t = now();
+	for (unsigned i = 0; i < HASH_ROUNDS; i++) {
+		err = mem.copyToFile(fd, 0, p, len);
+		assert (err == 0);
+	}
+	t = now() - t;
+	close(fd);
+
+	std::cout << "copyout " << (memfd ? "memfd" : "anon")
+		<< " MB=" << (len >> 20)
+		<< " " << (len * HASH_ROUNDS >> 20) / t << "MB/s\n";
+}
+
+/* random reads over a big anonymous region, with and without THP */
+/* heap objects under write watchpoints: setting them up, writes they
+   catch, and writes to the rest of the heap next to them */
+static void benchWatch(void)
+{
+	GuestMem	*mem = new GuestMem();
+	guest_ptr	p, plain;
+	unsigned	hits = 0;
+	double		t_add, t_hit, t_plain;
+	int		err;
+
+	if (!WatchTracker::isSupported()) {
+		delete mem;
+		return;
+	}
+
+	err = mem->mmap(p, guest_ptr(0), WATCH_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+	/* objects are 64 bytes apart, so they fill the first pages */
+	plain = p + (WATCH_OBJS*64 + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ;
+
+	mem->setWatchHook([&hits] (guest_ptr, size_t, uint64_t) { hits++; });
+
+	t_add = now();
+	for (unsigned i = 0; i < WATCH_OBJS; i++) {
+		err = mem->watchWrites(p + i*64, 8);
+		assert (err == 0);
+	}
+	t_add = now() - t_add;
+
+	t_hit = now();
+	for (unsigned i = 0; i < WATCH_WRITES; i++) {
+		unsigned	o = (i * 2654435761U) % WATCH_OBJS;
+		mem->write<uint64_t>(p + o*64, i);
+	}
+	t_hit = now() - t_hit;
+	assert (hits == WATCH_WRITES);
+
+	t_plain = now();
+	for (unsigned i = 0; i < ACCESS_C; i++) {
+		guest_ptr	q(plain + (i*8) % (p + WATCH_PAGES*PAGE_SZ - plain));
+		mem->write<uint64_t>(q, i);
+	}
+	t_plain = now() - t_plain;
+
+	std::cout << "watch objs=" << WATCH_OBJS
+		<< " add=" << (uint64_t)(WATCH_OBJS / t_add) << "/s"
+		<< " caught=" << (uint64_t)(WATCH_WRITES / t_hit) << "/s"
+		<< " unwatched=" << (uint64_t)(ACCESS_C / t_plain) << "/s\n";
+
+	delete mem;
+}
+
+/* a sparse SEARCH_GB mapping, random data up front, with a string, a
+   value, and a pointer planted in every GB; all searched for in a pass */
+static void benchSearch(void)
+{
+	GuestMem	*mem = new GuestMem();
+	GuestSearch	*gs;
+	guest_ptr	p;
+	size_t		len = (size_t)SEARCH_GB << 30;
+	uint64_t	x = 88172645463325252ULL;
+	const char	marker[] = "mem_bench marker";
+	const char	masked[] = "be?ch m";
+	const uint8_t	mask[] = { 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0xff };
+	unsigned	counts[4] = { 0, 0, 0, 0 };
+	double		t;
+	int		err;
+
+	err = mem->mmap(p, guest_ptr(0), len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert (err == 0);
+	for (size_t off = 0; off < SEARCH_FILL; off += 8) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		mem->write<uint64_t>(p + off, x);
+	}
+	for (size_t off = (1UL << 30) - 4096; off < len; off += 1UL << 30) {
+		mem->memcpy(p + (off + 3), marker, sizeof(marker) - 1);
+		mem->write<uint64_t>(p + (off + 64), 0x5eedf00dcafe1234ULL);
+		mem->write<uint64_t>(p + (off + 128), p.o + 100);
+	}
+
+	gs = new GuestSearch(*mem);
+	gs->addString(marker);
+	gs->addBytes(masked, sizeof(mask), mask);
+	gs->addValue(0x5eedf00dcafe1234ULL);
+	gs->addPointers(p, p + 4096);
+
+	t = now();
+	for (const auto &h : *gs)
+		counts[h.what]++;
+	t = now() - t;
+	for (unsigned i = 0; i < 4; i++)
+		assert (counts[i] == SEARCH_GB);
+
+	std::cout << "search GB=" << SEARCH_GB
+		<< " patterns=4 time=" << t << "s"
+		<< " GB/s=" << SEARCH_GB / t << "\n";
+
+	delete gs;
+	delete mem;
+}
+
+/* a mapping past 4GB with a page touched every SPARSE_STRIDE, slurped
+   out of a forked copy of us and written out as a snapshot would */
+static void benchSparse(void)
+{
+	GuestMem	*mem = new GuestMem();
+	GuestMem	*copy;
+	ProcMap		*pm;
+	guest_ptr	p;
+	size_t		len = (size_t)SPARSE_GB << 30;
+	char		path[] = "/tmp/mem_bench.XXXXXX";
+	char		line[128];
+	struct stat	s;
+	double		t_slurp, t_save;
+	pid_t		pid;
+	int		fd, err;
+
+	err = mem->mmap(p, guest_ptr(0), len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert (err == 0);
+	for (size_t off = SPARSE_STRIDE - 8; off < len; off += SPARSE_STRIDE)
+		mem->write<uint64_t>(p + off, off | 1);
+
+	if ((pid = fork()) == 0) {
+		pause();
+		_exit(0);
+	}
+	assert (pid > 0);
+
+	/* same addresses in the copy; ours have to go first */
+	delete mem;
+	copy = new GuestMem();
+	snprintf(line, sizeof(line), "%lx-%lx rw-p 00000000 00:00 0\n",
+		p.o, p.o + len);
+
+	t_slurp = now();
+	pm = ProcMap::create(copy, pid, line);
+	t_slurp = now() - t_slurp;
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	assert (pm != NULL && pm->getByteCount() == len);
+
+	fd = mkstemp(path);
+	assert (fd >= 0);
+	unlink(path);
+
+	t_save = now();
+	err = copy->copyToFile(fd, 0, p, len, true);
+	t_save = now() - t_save;
+	assert (err == 0);
+
+	err = fstat(fd, &s);
+	assert (err == 0 && (size_t)s.st_size == len);
+	for (size_t off = SPARSE_STRIDE - 8; off < len; off += SPARSE_STRIDE) {
+		uint64_t	v = 0;
+		assert (copy->read<uint64_t>(p + off) == (off | 1));
+		assert (pread(fd, &v, 8, off) == 8 && v == (off | 1));
+	}
+	close(fd);
+
+	std::cout << "sparse GB=" << SPARSE_GB
+		<< " slurp=" << t_slurp << "s"
+		<< " save=" << t_save << "s"
+		<< " file_KB=" << s.st_blocks / 2 << "\n";
+
+	delete pm;
+	delete copy;
+}
+
+static void benchHuge(bool huge)
+{
+	GuestMem		mem;
+	GuestMem::HugeStats	hs;
+	guest_ptr		p;
+	size_t			len = (size_t)HUGE_MB << 20;
+	uint64_t		x = 1, sum = 0;
+	const uint64_t		*w;
+	double			t_touch, t_read;
+	int			err;
+
+	mem.setHugePages(huge);
+	err = mem.mmap(p, guest_ptr(0), len,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	t_touch = now();
+	mem.memset(p, 1, len);
+	t_touch = now() - t_touch;
+
+	w = (const uint64_t*)mem.getHostPtr(p);
+	t_read = now();
+	for (unsigned i = 0; i < HUGE_C; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		sum += w[(x >> 20) % (len / 8)];
+	}
+	t_read = now() - t_read;
+
+	hs = mem.getHugeStats();
+	std::cout << "huge " << (huge ? "on" : "off")
+		<< " MB=" << HUGE_MB
+		<< " touch=" << t_touch*1e3 << "ms"
+		<< " random=" << (uint64_t)(HUGE_C / t_read) << "/s"
+		<< " advised=" << (hs.advised >> 20) << "MB"
+		<< " huge=" << (hs.huge >> 20) << "MB"
+		<< " (sum=" << (void*)sum << ")\n";
+
+	mem.munmap(p, len);
+}
+
+/* a guest malloc creeping the heap up a little at a time, then
+   trimming it back */
+static void benchBrk(void)
+{
+	GuestMem	mem;
+	guest_ptr	b;
+	double		t_grow, t_trim;
+	bool		ok;
+
+	ok = mem.sbrk(guest_ptr(0));
+	assert (ok);
+	b = mem.brk();
+
+	t_grow = now();
+	for (unsigned i = 1; i <= BRK_C; i++) {
+		ok = mem.sbrk(b + (size_t)i*BRK_STEP);
+		assert (ok);
+	}
+	t_grow = now() - t_grow;
+
+	t_trim = now();
+	for (unsigned i = BRK_C; i > 0; i -= BRK_C/1024) {
+		ok = mem.sbrk(b + (size_t)i*BRK_STEP);
+		assert (ok);
+	}
+	t_trim = now() - t_trim;
+
+	std::cout << "brk steps=" << BRK_C << "x" << BRK_STEP
+		<< " grow=" << t_grow*1e3 << "ms"
+		<< " trim1024=" << t_trim*1e3 << "ms"
+		<< " maps=" << mem.getNumMaps() << "\n";
+}
+
+/* loading a snapshot-sized map list one at a time vs. as one batch */
+static void benchBulkLoad(unsigned map_c)
+{
+	std::vector<GuestMem::Mapping>	batch;
+	GuestMem			*mem;
+	double				t_one, t_bulk;
+
+	for (unsigned i = 0; i < map_c; i++)
+		batch.push_back(GuestMem::Mapping(
+			guest_ptr(MAP_BASE + i*3*PAGE_SZ),
+			2*PAGE_SZ,
+			PROT_READ | PROT_WRITE));
+
+	mem = new GuestMemSink();
+	t_one = now();
+	for (auto m : batch)
+		mem->recordMapping(m);
+	t_one = now() - t_one;
+	delete mem;
+
+	mem = new GuestMemSink();
+	t_bulk = now();
+	mem->recordMappings(batch);
+	t_bulk = now() - t_bulk;
+	assert (mem->getNumMaps() == map_c + 1);
+	delete mem;
+
+	std::cout << "load maps=" << map_c
+		<< " single=" << t_one*1e3 << "ms"
+		<< " batch=" << t_bulk*1e3 << "ms\n";
+}
+
+/* a checkpoint of the mapping layout every few mprotects, kept as
+ * versions and as flat copies of the table; then diffing neighbouring
+ * versions and restoring each one */
+static void benchLayout(unsigned map_c)
+{
+	GuestMem					*mem = buildMem(map_c);
+	std::vector<GuestMem::maptab_t>			vers;
+	std::vector<std::vector<GuestMem::Mapping>>	flat;
+	std::vector<GuestMem::Mapping>			gone, added;
+	double						t_ver, t_flat, t_diff, t_rest;
+	int64_t						b_ver, b_flat;
+
+	auto edit = [&] (unsigned i) {
+		for (unsigned j = 0; j < CKPT_EDITS; j++) {
+			unsigned	k = ((i*CKPT_EDITS + j) * 7919) % map_c;
+			mem->mprotect(guest_ptr(MAP_BASE + k*3*PAGE_SZ), PAGE_SZ,
+				(i & 1) ? PROT_READ : PROT_READ | PROT_WRITE);
+		}
+	};
+
+	vers.reserve(CKPT_C);
+	b_ver = live_bytes;
+	t_ver = now();
+	for (unsigned i = 0; i < CKPT_C; i++) {
+		edit(i);
+		vers.push_back(mem->captureLayout());
+	}
+	t_ver = now() - t_ver;
+	b_ver = live_bytes - b_ver;
+
+	flat.reserve(CKPT_C);
+	b_flat = live_bytes;
+	t_flat = now();
+	for (unsigned i = 0; i < CKPT_C; i++) {
+		edit(i);
+		flat.push_back(std::vector<GuestMem::Mapping>());
+		flat.back().reserve(mem->getNumMaps());
+		for (const auto &m : mem->getMappings())
+			flat.back().push_back(m);
+	}
+	t_flat = now() - t_flat;
+	b_flat = live_bytes - b_flat;
+
+	t_diff = now();
+	for (unsigned i = 1; i < CKPT_C; i++) {
+		gone.clear();
+		added.clear();
+		GuestMem::diffLayouts(vers[i-1], vers[i], gone, added);
+	}
+	t_diff = now() - t_diff;
+
+	t_rest = now();
+	for (unsigned i = CKPT_C; i > 0; i--)
+		mem->restoreLayout(vers[i-1]);
+	t_rest = now() - t_rest;
+
+	std::cout << "layout maps=" << map_c
+		<< " ckpts=" << CKPT_C
+		<< " version=" << t_ver*1e6/CKPT_C << "us/"
+		<< b_ver/CKPT_C << "B"
+		<< " flat=" << t_flat*1e6/CKPT_C << "us/"
+		<< b_flat/CKPT_C << "B"
+		<< " diff=" << t_diff*1e6/(CKPT_C-1) << "us"
+		<< " restore=" << t_rest*1e6/CKPT_C << "us\n";
+
+	delete mem;
+}
+
+/* a byte of shadow for each guest byte, found straight off the address
+ * versus through the hash of pages tools tend to roll themselves; then
+ * an mremap taking the shadow along */
+static void benchShadow(void)
+{
+	GuestMem					*mem = new GuestMem();
+	GuestShadow					*sh;
+	std::unordered_map<uintptr_t, uint8_t*>		hm;
+	guest_ptr					p, q, r;
+	uint64_t					sum = 0;
+	double						t_sh, t_hm, t_mv;
+	int						err;
+
+	err = mem->mmap(p, guest_ptr(0), SHADOW_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	sh = mem->addShadow(PAGE_SZ);
+	for (unsigned i = 0; i < SHADOW_PAGES; i++) {
+		guest_ptr	pg(p + i*PAGE_SZ);
+
+		sh->get(pg)[0] = i;
+		hm[pg.o / PAGE_SZ] = new uint8_t[PAGE_SZ]();
+		hm[pg.o / PAGE_SZ][0] = i;
+	}
+
+	t_sh = now();
+	for (unsigned i = 0; i < SHADOW_C; i++) {
+		guest_ptr	a(p + (i * 2654435761U) % (SHADOW_PAGES*PAGE_SZ));
+		sum += sh->peek(a)[sh->offsetOf(a)];
+	}
+	t_sh = now() - t_sh;
+
+	t_hm = now();
+	for (unsigned i = 0; i < SHADOW_C; i++) {
+		guest_ptr	a(p + (i * 2654435761U) % (SHADOW_PAGES*PAGE_SZ));
+		sum += hm.find(a.o / PAGE_SZ)->second[a.o % PAGE_SZ];
+	}
+	t_hm = now() - t_hm;
+
+	err = mem->mmap(q, guest_ptr(0), SHADOW_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	t_mv = now();
+	err = mem->mremap(r, p, SHADOW_PAGES*PAGE_SZ, SHADOW_PAGES*PAGE_SZ,
+		MREMAP_MAYMOVE | MREMAP_FIXED, q);
+	t_mv = now() - t_mv;
+	assert (err == 0 && r == q);
+	assert (sh->peek(p) == NULL && sh->peek(q + PAGE_SZ)[0] == 1);
+
+	std::cout << "shadow pages=" << SHADOW_PAGES
+		<< " direct=" << (uint64_t)(SHADOW_C / t_sh) << "/s"
+		<< " hash=" << (uint64_t)(SHADOW_C / t_hm) << "/s"
+		<< " mremap=" << t_mv*1e3 << "ms"
+		<< " (shadowed=" << sh->getPageCount()
+		<< " sum=" << (void*)sum << ")\n";
+
+	for (auto &e : hm)
+		delete [] e.second;
+	delete mem;
+}
+
+/* self-modifying code under a block cache: each write to a watched
+ * code page faults once, moves that page on, and is watched again, as
+ * a translator would after decoding the page afresh. The cache keeps
+ * every other page's blocks where it used to flush them all */
+static void benchCode(void)
+{
+	GuestMem		*mem = new GuestMem();
+	std::vector<uint64_t>	gens(CODE_PAGES);
+	guest_ptr		p;
+	uint64_t		sum = 0;
+	unsigned		stale = 0, moved = 0;
+	double			t_wr, t_gen;
+	int			err;
+
+	err = mem->mmap(p, guest_ptr(0), CODE_PAGES*PAGE_SZ,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert (err == 0);
+
+	mem->setCodeTracking(true);
+	mem->setCodeHook([&moved] (guest_ptr, size_t) { moved++; });
+	for (unsigned i = 0; i < CODE_PAGES; i++)
+		gens[i] = mem->watchCode(p + i*PAGE_SZ);
+
+	t_wr = now();
+	for (unsigned i = 0; i < CODE_WRITES; i++) {
+		unsigned	pg = (i * 2654435761U) % CODE_PAGES;
+
+		mem->write<uint8_t>(p + pg*PAGE_SZ + (i % PAGE_SZ), i);
+		mem->watchCode(p + pg*PAGE_SZ);
+	}
+	t_wr = now() - t_wr;
+
+	t_gen = now();
+	for (unsigned i = 0; i < CODE_C; i++)
+		sum += mem->getCodeGen(p + (i % CODE_PAGES)*PAGE_SZ);
+	t_gen = now() - t_gen;
+
+	for (unsigned i = 0; i < CODE_PAGES; i++)
+		stale += mem->getCodeGen(p + i*PAGE_SZ) != gens[i];
+
+	std::cout << "code pages=" << CODE_PAGES
+		<< " caught=" << (uint64_t)(CODE_WRITES / t_wr) << "/s"
+		<< " gens=" << (uint64_t)(CODE_C / t_gen) << "/s"
+		<< " (hooks=" << moved << " stale=" << stale
+		<< " sum=" << (void*)sum << ")\n";
+
+	delete mem;
+}
+
+/* what a loader does: reserve a span anywhere, then MAP_FIXED the
+   segments over it; plus fixed maps into fresh space and over holes */
+static void benchPlace(void)
+{
+	GuestMem	mem;
+	guest_ptr	p, q;
+	double		t_any, t_own, t_fresh, t_mixed, t_unmap;
+	int		flags = MAP_PRIVATE | MAP_ANONYMOUS, err;
+
+	t_any = t_own = t_fresh = t_mixed = t_unmap = 0;
+	for (unsigned i = 0; i < PLACE_C; i++) {
+		double	t = now();
+
+		err = mem.mmap(p, guest_ptr(0), 16*PAGE_SZ,
+			PROT_NONE, flags, -1, 0);
+		assert (err == 0);
+		t_any += now() - t;
+
+		t = now();
+		err = mem.mmap(q, p, 4*PAGE_SZ,
+			PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0);
+		assert (err == 0);
+		t_own += now() - t;
+
+		err = mem.munmap(p + 8*PAGE_SZ, 8*PAGE_SZ);
+		assert (err == 0);
+
+		t = now();
+		err = mem.mmap(q, p + 12*PAGE_SZ, 4*PAGE_SZ,
+			PROT_READ, flags | MAP_FIXED, -1, 0);
+		assert (err == 0);
+		t_fresh += now() - t;
+
+		t = now();
+		err = mem.mmap(q, p + 6*PAGE_SZ, 4*PAGE_SZ,
+			PROT_READ, flags | MAP_FIXED, -1, 0);
+		assert (err == 0);
+		t_mixed += now() - t;
+
+		t = now();
+		mem.munmap(p, 16*PAGE_SZ);
+		t_unmap += now() - t;
+	}
+
+	std::cout << "place " << (mem.isFlat() ? "flat" : "rebased")
+		<< " anywhere=" << (uint64_t)(PLACE_C / t_any) << "/s"
+		<< " fixed-owned=" << (uint64_t)(PLACE_C / t_own) << "/s"
+		<< " fixed-fresh=" << (uint64_t)(PLACE_C / t_fresh) << "/s"
+		<< " fixed-mixed=" << (uint64_t)(PLACE_C / t_mixed) << "/s"
+		<< " unmap=" << (uint64_t)(PLACE_C / t_unmap) << "/s\n";
+}
+
+/* JIT-style W^X flipping of single pages inside one big code mapping */
+static void benchProtStorm(bool coalesce)
+{
+	GuestMem	*mem = new GuestMemSink();
+	uint64_t	start_c;
+	double		t;
+
+	mem->setCoalescing(coalesce);
+	GuestMem::Mapping code(
+		guest_ptr(MAP_BASE), STORM_PAGES*PAGE_SZ, PROT_READ | PROT_EXEC);
+	mem->recordMapping(code);
+
+	srandom(STORM_PAGES);
+	start_c = alloc_c;
+	t = now();
+	for (unsigned i = 0; i < STORM_C; i++) {
+		guest_ptr	pg(MAP_BASE + (random() % STORM_PAGES)*PAGE_SZ);
+		mem->mprotect(pg, PAGE_SZ, PROT_READ | PROT_WRITE);
+		mem->mprotect(pg, PAGE_SZ, PROT_READ | PROT_EXEC);
+	}
+	t = now() - t;
+
+	std::cout << "mprotect storm coalesce=" << coalesce
+		<< " calls=" << 2*STORM_C
+		<< " maps=" << mem->getNumMaps()
+		<< " allocs=" << alloc_c - start_c
+		<< " " << (uint64_t)(2*STORM_C / t) << "/s\n";
+
+	t = now();
+	delete mem;
+	t = now() - t;
+	std::cout << "mprotect storm teardown " << t*1e3 << "ms\n";
+}
+
+int main(int argc, char* argv[])
+{
+	static const unsigned counts[] = {
+		100, 1000, 10000, 30000, 60000, 0 };
+
+	benchAccess();
+	benchWidth();
+	benchChecked();
+	benchShadow();
+	benchCode();
+	benchWatch();
+	benchShared();
+	benchHash();
+	benchDirty();
+	benchClone(false);
+	benchClone(true);
+	benchCopyOut(false);
+	benchCopyOut(true);
+	benchHuge(false);
+	benchHuge(true);
+	benchSparse();
+	benchSearch();
+	benchBrk();
+	benchPlace();
+
+	for (unsigned i = 0; counts[i]; i++)
+		benchLookup(counts[i]);
+
+	for (unsigned i = 0; counts[i]; i++)
+		benchBulkLoad(counts[i]);
+
+	for (unsigned i = 0; counts[i]; i++)
+		benchLayout(counts[i]);
+
+	benchProtStorm(false);
+	benchProtStorm(true);
+
+	/* search by maps rather than asking the host */
+	setenv("GUEST_4GB_REBASE", "1", 1);
+	benchPlace();
+	for (unsigned i = 0; counts[i]; i++)
+		benchFreeRegion(counts[i]);
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "rcu.h"
+#include "watchtracker.h"
+#include "guestmem.h"
+
+/* old copies wait for a grace period in batches of this many */
+#define RETIRE_BATCH	64
+/* pages one instruction can be caught writing */
+#define MAX_STEP_PAGES	4
+#define TRAP_FLAG	0x100
+
+/* what this thread is stepping over; plain data in static TLS, so
+   signal safe */
+struct StepState
+{
+	WatchTracker	*owner;
+	unsigned	n;
+	uintptr_t	pg[MAX_STEP_PAGES];
+	uintptr_t	addr[MAX_STEP_PAGES];
+};
+
+static thread_local StepState	stepping ATTRIBUTE_INITIAL_EXEC;
+
+WatchTracker::WatchTracker(GuestMem& _mem)
+: mem(_mem)
+, watch_c(0)
+{
+	FaultDispatch::add(this, true);
+}
+
+WatchTracker::~WatchTracker(void)
+{
+	FaultDispatch::remove(this);
+	drop(	guest_ptr(0),
+		guest_ptr(tab_t::MAX_PAGES << tab_t::PG_BITS),
+		true);
+	reclaim();
+}
+
+bool WatchTracker::isSupported(void)
+{
+#ifdef __amd64__
+	return true;
+#else
+	return false;
+#endif
+}
+
+WatchTracker::slot_t* WatchTracker::find(guest_ptr p, bool alloc)
+{
+	uintptr_t	pg = tab_t::pageOf(p);
+	return alloc ? tab.get(pg) : tab.find(pg);
+}
+
+void WatchTracker::retire(PageWatch* pw)
+{
+	retired.push_back(pw);
+	if (retired.size() >= RETIRE_BATCH)
+		reclaim();
+}
+
+void WatchTracker::reclaim(void)
+{
+	if (retired.empty())
+		return;
+	Rcu::synchronize();
+	for (auto pw : retired)
+		delete pw;
+	retired.clear();
+}
+
+uint64_t WatchTracker::load(const Watch& w) const
+{
+	uint64_t	v = 0;
+	::memcpy(&v, mem.getHostPtr(w.p), w.len);
+	return v;
+}
+
+void WatchTracker::protect(guest_ptr pg, int prot) const
+{ hostProtect(mem.getHostPtr(pg), prot); }
+
+int WatchTracker::watch(guest_ptr p, size_t len, int prot)
+{
+	guest_ptr	pg(p.o & ~(tab_t::PAGE_BYTES - 1));
+	slot_t		*s;
+	PageWatch	*old, *pw;
+
+	if (!isSupported())
+		return -ENOSYS;
+	if (len == 0 || len > 8)
+		return -EINVAL;
+	if (((p.o + len - 1) & ~(tab_t::PAGE_BYTES - 1)) != pg.o)
+		return -EINVAL;
+	if (!(prot & PROT_WRITE))
+		return -EACCES;
+	if ((s = find(pg, true)) == NULL)
+		return -EFAULT;
+
+	old = s->load();
+	if (old != NULL) {
+		for (const auto &w : old->w)
+			if (w.p == p)
+				return -EEXIST;
+		pw = new PageWatch(*old);
+	} else
+		pw = new PageWatch();
+	pw->prot = prot;
+
+	pw->w.emplace_back(p, len, 0);
+	pw->w.back().last = load(pw->w.back());
+	watch_c++;
+
+	/* published first; a write faults the moment it's protected */
+	s->store(pw);
+	if (old != NULL) {
+		/* already write-protected; only the rest may have moved */
+		if (old->prot != prot)
+			protect(pg, prot & ~PROT_WRITE);
+		retire(old);
+		return 0;
+	}
+
+	hostWriteProtect(mem.getHostPtr(pg), prot);
+	return 0;
+}
+
+int WatchTracker::unwatch(guest_ptr p)
+{
+	guest_ptr	pg(p.o & ~(tab_t::PAGE_BYTES - 1));
+	slot_t		*s;
+	PageWatch	*old, *pw;
+
+	if ((s = find(pg, false)) == NULL || (old = s->load()) == NULL)
+		return -ENOENT;
+
+	pw = new PageWatch();
+	pw->prot = old->prot;
+	for (const auto &w : old->w)
+		if (w.p != p)
+			pw->w.push_back(w);
+
+	if (pw->w.size() == old->w.size()) {
+		delete pw;
+		return -ENOENT;
+	}
+	watch_c--;
+
+	if (pw->w.empty()) {
+		delete pw;
+		s->store(NULL);
+		protect(pg, old->prot);
+	} else
+		s->store(pw);
+
+	retire(old);
+	return 0;
+}
+
+void WatchTracker::drop(guest_ptr b, guest_ptr e, bool restore)
+{
+	if (watch_c == 0)
+		return;
+
+	tab.each(tab_t::pageOf(b), tab_t::pageEnd(e), false,
+		[this, restore] (uintptr_t pg, slot_t& s) {
+			PageWatch	*pw = s.exchange(NULL);
+
+			if (pw == NULL)
+				return;
+			if (restore)
+				protect(guest_ptr(pg << tab_t::PG_BITS), pw->prot);
+			watch_c -= pw->w.size();
+			retire(pw);
+		});
+}
+
+/* open the page and step the write with the trap flag */
+bool WatchTracker::handleFault(void* addr, void* uctx)
+{
+#ifdef __amd64__
+	ucontext_t	*uc = (ucontext_t*)uctx;
+	uintptr_t	a = (uintptr_t)addr;
+	uintptr_t	base = (uintptr_t)mem.getBase();
+	guest_ptr	pg;
+	slot_t		*s;
+	PageWatch	*pw;
+	unsigned	i;
+
+	if (a < base)
+		return false;
+	pg = guest_ptr((a - base) & ~(tab_t::PAGE_BYTES - 1));
+
+	Rcu::ReadLock	rl(Rcu::ReadLock::IN_SIGNAL);
+
+	if ((s = find(pg, false)) == NULL || (pw = s->load()) == NULL)
+		return false;
+	if (stepping.n != 0 && stepping.owner != this)
+		return false;
+
+	/* the same instruction can fault on a page again if another
+	   thread's trap closed it first */
+	for (i = 0; i < stepping.n && stepping.pg[i] != pg.o; i++);
+	if (i == MAX_STEP_PAGES)
+		return false;
+	if (i == stepping.n) {
+		stepping.pg[i] = pg.o;
+		stepping.addr[i] = a - base;
+		stepping.n++;
+	}
+	stepping.owner = this;
+
+	protect(pg, pw->prot);
+	uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* the write is done; close the pages back up and report */
+bool WatchTracker::handleTrap(void* uctx)
+{
+#ifdef __amd64__
+	ucontext_t	*uc = (ucontext_t*)uctx;
+	StepState	st;
+
+	if (stepping.n == 0 || stepping.owner != this)
+		return false;
+
+	st = stepping;
+	stepping.n = 0;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+
+	Rcu::ReadLock	rl(Rcu::ReadLock::IN_SIGNAL);
+
+	for (unsigned i = 0; i < st.n; i++) {
+		guest_ptr	pg(st.pg[i]);
+		slot_t		*s = find(pg, false);
+		PageWatch	*pw;
+
+		/* unwatched in the meantime; it's open for good */
+		if (s == NULL || (pw = s->load()) == NULL)
+			continue;
+
+		protect(pg, pw->prot & ~PROT_WRITE);
+
+		/* the watch written at, and any others the write changed */
+		for (const auto &w : pw->w) {
+			uint64_t	v = load(w);
+			bool		hit;
+
+			hit = st.addr[i] >= w.p.o && st.addr[i] < w.p.o + w.len;
+			if (!hit && v == w.last.load())
+				continue;
+			w.last.store(v);
+			if (hook)
+				hook(w.p, w.len, v);
+		}
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
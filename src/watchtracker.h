@@ -0,0 +1,102 @@
+/* write watchpoints on guest memory, by page protection */
+#ifndef WATCHTRACKER_H
+#define WATCHTRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "faultdispatch.h"
+#include "pagetable.h"
+
+class GuestMem;
+
+/* a write hit the watch at [p, p+len); 'val' is what's there after it */
+typedef std::function<void(guest_ptr p, size_t len, uint64_t val)>
+	watch_hook_t;
+
+/* Pages with a watch are write-protected on the host. A write to one
+ * faults; the page is opened and the writing instruction stepped with
+ * the trap flag, then the trap puts the protection back and runs the
+ * hook for every watch on the page the write landed in or changed. There
+ * is no limit on watches and nothing to pay for pages without one.
+ *
+ * Watches on a page go away when its host protection is replaced
+ * (mprotect, munmap, mremap, an mmap over it). While a write is being
+ * stepped its page is open, so another thread writing the page just
+ * then is missed. Watched pages are plain mprotect()s, so GuestMem keeps
+ * mprotect dirty tracking and watchCode() off them, and the kernel's own
+ * writes to one get EFAULT. The hook runs in signal context: no allocation, no
+ * locks, no writes to watched pages. x86-64 hosts only */
+class WatchTracker : public FaultHandler
+{
+public:
+	WatchTracker(GuestMem& _mem);
+	virtual ~WatchTracker(void);
+
+	/* watch writes to [p, p+len), len up to 8 and inside one page
+	   with host protection 'prot'; 0 or -errno */
+	int watch(guest_ptr p, size_t len, int prot);
+	/* drop the watch starting at p; -ENOENT if there isn't one */
+	int unwatch(guest_ptr p);
+	/* drop every watch on pages touching [b, e); 'restore' puts their
+	   protection back, otherwise it was already replaced */
+	void drop(guest_ptr b, guest_ptr e, bool restore);
+
+	size_t getNumWatches(void) const { return watch_c; }
+	/* p's page has a watch */
+	bool isWatched(guest_ptr p) const
+	{
+		const slot_t	*s = tab.find(tab_t::pageOf(p));
+		return s != NULL && s->load() != NULL;
+	}
+	void setHook(watch_hook_t h) { hook = h; }
+
+	bool handleFault(void* addr, void* uctx) override;
+	bool handleTrap(void* uctx) override;
+
+	static bool isSupported(void);
+
+private:
+	WatchTracker(const WatchTracker&) = delete;
+	WatchTracker& operator=(const WatchTracker&) = delete;
+
+	struct Watch
+	{
+		Watch(guest_ptr _p, size_t _len, uint64_t v)
+		: p(_p), len(_len), last(v) {}
+		Watch(const Watch& w)
+		: p(w.p), len(w.len), last(w.last.load()) {}
+
+		guest_ptr			p;
+		size_t				len;
+		mutable std::atomic<uint64_t>	last;
+	};
+
+	/* never changed once published; replaced whole under RCU */
+	struct PageWatch
+	{
+		int			prot;	/* to put back */
+		std::vector<Watch>	w;
+	};
+
+	typedef std::atomic<PageWatch*>	slot_t;
+	typedef PageTable<slot_t>	tab_t;
+
+	slot_t* find(guest_ptr p, bool alloc);
+	void publish(guest_ptr pg, PageWatch* pw);
+	void retire(PageWatch* pw);
+	void reclaim(void);
+	uint64_t load(const Watch& w) const;
+	void protect(guest_ptr pg, int prot) const;
+
+	GuestMem			&mem;
+	tab_t				tab;
+	std::vector<PageWatch*>		retired;
+	size_t				watch_c;
+	watch_hook_t			hook;
+};
+
+#endif